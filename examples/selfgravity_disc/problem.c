@@ -24,6 +24,7 @@ int main(int argc, char* argv[]){
 	r->gravity	= REB_GRAVITY_TREE;
 	r->boundary	= REB_BOUNDARY_OPEN;
 	r->opening_angle2	= 1.5;		// This constant determines the accuracy of the tree code gravity estimate.
+	// For large N, REB_GRAVITY_FMM is faster (O(N)). Its accuracy is set by r->fmm_order and r->fmm_opening_angle.
 	r->G 		= 1;		
 	r->softening 	= 0.02;		// Gravitational softening length
 	r->dt 		= 3e-2;		// Timestep
@@ -15,10 +15,10 @@ import types
 ### The following enum and class definitions need to
 ### consitent with those in rebound.h
         
-INTEGRATORS = {"ias15": 0, "whfast": 1, "sei": 2, "wh": 3, "leapfrog": 4, "hybrid": 5, "none": 6}
+INTEGRATORS = {"ias15": 0, "whfast": 1, "sei": 2, "wh": 3, "leapfrog": 4, "hybrid": 5, "none": 6, "hermite": 7}
 BOUNDARIES = {"none": 0, "open": 1, "periodic": 2, "shear": 3}
-GRAVITIES = {"none": 0, "basic": 1, "compensated": 2, "tree": 3}
-COLLISIONS = {"none": 0, "direct": 1, "tree": 2}
+GRAVITIES = {"none": 0, "basic": 1, "compensated": 2, "tree": 3, "fmm": 4, "pm": 5}
+COLLISIONS = {"none": 0, "direct": 1, "tree": 2, "grid": 3, "sweep": 4}
 
 class reb_vec3d(Structure):
     _fields_ = [("x", c_double),
@@ -46,7 +46,6 @@ class reb_collision(Structure):
     _fields_ = [("p1", c_int),
                 ("p2", c_int),
                 ("gb", reb_ghostbox),
-                ("time", c_double),
                 ("ri", c_int)]
 
 class reb_simulation_integrator_hybrid(Structure):
@@ -57,6 +56,14 @@ class reb_simulation_integrator_wh(Structure):
     _fields_ = [(("allocatedN"), c_int),
                 ("eta", POINTER(c_double))]
 
+class reb_simulation_integrator_leapfrog(Structure):
+    _fields_ = [("block_levels", c_uint),
+                ("block_eta", c_double),
+                ("allocatedN", c_int),
+                ("rung", POINTER(c_int)),
+                ("active", POINTER(c_int)),
+                ("rung_N", c_int)]
+
 class reb_simulation_integrator_sei(Structure):
     _fields_ = [("OMEGA", c_double),
                 ("OMEGAZ", c_double),
@@ -66,6 +73,20 @@ class reb_simulation_integrator_sei(Structure):
                 ("sindtz", c_double),
                 ("tandtz", c_double)]
 
+class reb_simulation_integrator_hermite(Structure):
+    _fields_ = [("eta", c_double),
+                ("block_levels", c_uint),
+                ("allocatedN", c_int),
+                ("x0", POINTER(c_double)),
+                ("v0", POINTER(c_double)),
+                ("a0", POINTER(c_double)),
+                ("j0", POINTER(c_double)),
+                ("jerk", POINTER(c_double)),
+                ("level", POINTER(c_int)),
+                ("tick", POINTER(c_uint)),
+                ("active", POINTER(c_int)),
+                ("N_last", c_int)]
+
 class reb_simulation_integrator_ias15(Structure):
     _fields_ = [("epsilon", c_double),
                 ("min_dt", c_double),
@@ -351,6 +372,7 @@ class Simulation(Structure):
         - ``'wh'``
         - ``'leapfrog'``
         - ``'hybrid'``
+        - ``'hermite'``
         - ``'none'``
         
         Check the online documentation for a full description of each of the integrators. 
@@ -424,6 +446,8 @@ class Simulation(Structure):
         - ``'basic'`` (default)
         - ``'compensated'``
         - ``'tree'``
+        - ``'fmm'``
+        - ``'pm'``
         
         Check the online documentation for a full description of each of the modules. 
         """
@@ -453,6 +477,8 @@ class Simulation(Structure):
         - ``'none'`` (default)
         - ``'direct'``
         - ``'tree'``
+        - ``'grid'``
+        - ``'sweep'``
         
         Check the online documentation for a full description of each of the modules. 
         """
@@ -657,7 +683,7 @@ class Simulation(Structure):
         if particle is not None:
             if isinstance(particle, Particle):
                 if kwargs == {}: # copy particle
-                    if (self.gravity == "tree" or self.collision == "tree") and self.root_size <=0.:
+                    if (self.gravity == "tree" or self.gravity == "fmm" or self.collision == "tree") and self.root_size <=0.:
                         raise ValueError("The tree code for gravity and/or collision detection has been selected. However, the simulation box has not been configured yet. You cannot add particles until the the simulation box has a finite size.")
 
                     clibrebound.reb_add(byref(self), particle)
@@ -721,6 +747,31 @@ class Simulation(Structure):
             if success == 0:
                 raise ValueError("id %d passed to remove_particle was not found.  Did not remove particle.\n"%(id))
 
+    def remove_mark(self, index):
+        """ 
+        Marks a particle for removal. The particle is only removed (and the indices 
+        of other particles only change) when remove_marked() is called.
+        """
+        success = clibrebound.reb_remove_mark(byref(self), c_int(index))
+        if not success:
+            raise ValueError("Marking particle with index %d failed.\n"%(index))
+
+    def remove_marked(self, keepSorted=1):
+        """ 
+        Removes all particles marked with remove_mark() in a single pass and returns
+        the number of removed particles. Afterwards, removed_map translates the old
+        indices to the new ones (-1 for removed particles).
+        """
+        return clibrebound.reb_remove_marked(byref(self), c_int(keepSorted))
+
+    @property
+    def removed_map(self):
+        """
+        List translating particle indices before the last call of remove_marked() 
+        to indices after it (-1 for removed particles).
+        """
+        return [self._removed_map[i] for i in range(self._removed_map_N)]
+
     def particles_ascii(self, prec=8):
         """
         Returns an ASCII string with all particles' masses, radii, positions and velocities.
@@ -877,9 +928,9 @@ class Simulation(Structure):
         nghostx, nghosty, nghostz : int
             The number of ghost boxes in each direction. All values default to 0 (no ghost boxes).
         """
-        clibrebound.nghostx = c_int(nghostx)
-        clibrebound.nghosty = c_int(nghosty)
-        clibrebound.nghostz = c_int(nghostz)
+        self.nghostx = nghostx
+        self.nghosty = nghosty
+        self.nghostz = nghostz
         return
 
 
@@ -1125,15 +1176,76 @@ Simulation._fields_ = [
                 ("testparticle_type", c_int),
                 ("allocated_N", c_int),
                 ("_particles", POINTER(Particle)),
+                ("_removed", POINTER(c_int)),
+                ("_removed_allocatedN", c_int),
+                ("_removed_N", c_int),
+                ("_removed_map", POINTER(c_int)),
+                ("_removed_map_N", c_int),
+                ("_removed_map_allocatedN", c_int),
                 ("gravity_cs", POINTER(reb_vec3d)),
                 ("gravity_cs_allocatedN", c_int),
+                ("gravity_soa", POINTER(c_double)),
+                ("gravity_soa_allocatedN", c_int),
+                ("gravity_omp", POINTER(c_double)),
+                ("gravity_omp_allocatedN", c_int),
+                ("gravity_sources", POINTER(c_double)),
+                ("gravity_sources_allocatedN", c_int),
                 ("tree_root", c_void_p),
                 ("tree_needs_update", c_int),
                 ("opening_angle2", c_double),
+                ("tree_group_size", c_int),
+                ("tree_multipole_order", c_int),
+                ("tree_multipole_N", c_int),
+                ("tree_opening_tolerance", c_double),
+                ("tree_aerr", POINTER(c_double)),
+                ("tree_aerr_allocatedN", c_int),
+                ("gravity_mixed_precision", c_int),
+                ("tree_pool_slabs", c_void_p),
+                ("tree_pool_slabs_N", c_int),
+                ("tree_pool_slabs_allocatedN", c_int),
+                ("tree_pool_used", c_int),
+                ("tree_pool_free", c_void_p),
+                ("tree_pool_N", c_int),
+                ("tree_pool_N_max", c_int),
+                ("tree_sort_interval", c_int),
+                ("tree_sort_steps", c_int),
+                ("tree_sort_keys", c_void_p),
+                ("tree_sort_keys_allocatedN", c_int),
+                ("tree_sort_particles", c_void_p),
+                ("tree_sort_particles_allocatedN", c_int),
+                ("tree_rebuild", c_int),
+                ("tree_refit", c_int),
+                ("tree_build_index", POINTER(c_int)),
+                ("tree_build_index_allocatedN", c_int),
+                ("fmm_order", c_int),
+                ("fmm_opening_angle", c_double),
+                ("fmm_cells", c_void_p),
+                ("fmm_cells_allocatedN", c_int),
+                ("fmm_coeffs", POINTER(c_double)),
+                ("fmm_coeffs_allocatedN", c_int),
+                ("fmm_particles", POINTER(c_int)),
+                ("fmm_particles_allocatedN", c_int),
+                ("gravity_ewald", c_int),
+                ("gravity_ewald_table", POINTER(c_double)),
+                ("gravity_ewald_table_boxsize", reb_vec3d),
+                ("gravity_ewald_warning", c_uint),
+                ("pm_nx", c_int),
+                ("pm_ny", c_int),
+                ("pm_nz", c_int),
+                ("pm_assignment", c_int),
+                ("pm_grid", POINTER(c_double)),
+                ("pm_work", POINTER(c_double)),
+                ("pm_grid_nx", c_int),
+                ("pm_grid_ny", c_int),
+                ("pm_grid_nz", c_int),
+                ("pm_fftw_plan_forward", c_void_p),
+                ("pm_fftw_plan_backward", c_void_p),
                 ("_status", c_int),
                 ("exact_finish_time", c_int),
                 ("force_is_velocity_dependent", c_uint),
                 ("gravity_ignore_10", c_uint),
+                ("gravity_active", POINTER(c_int)),
+                ("gravity_active_N", c_int),
                 ("output_timing_last", c_double),
                 ("exit_max_distance", c_double),
                 ("exit_min_distance", c_double),
@@ -1154,6 +1266,29 @@ Simulation._fields_ = [
                 ("collisions_plog", c_double),
                 ("max_radius", c_double*2),
                 ("collisions_Nlog", c_long),
+                ("collision_fused", c_int),
+                ("_collisions_fused", c_void_p),
+                ("_collisions_fused_N", c_int),
+                ("_collisions_fused_allocatedN", c_int),
+                ("_collision_grid_hash", POINTER(c_int)),
+                ("_collision_grid_particles", POINTER(c_int)),
+                ("_collision_grid_xyzr", POINTER(c_double)),
+                ("_collision_grid_allocatedN", c_int),
+                ("_collision_grid_start", POINTER(c_int)),
+                ("_collision_grid_start_allocatedN", c_int),
+                ("_collision_sweep_xvalues", c_void_p),
+                ("_collision_sweep_N", c_int),
+                ("_collision_sweep_allocatedN", c_int),
+                ("_collision_sweep_axis", c_int),
+                ("_collision_buffers", c_void_p),
+                ("_collision_buffers_N", c_int),
+                ("_collision_batch_last", POINTER(c_int)),
+                ("_collision_batch_last_allocatedN", c_int),
+                ("_collision_batch", POINTER(c_int)),
+                ("_collision_batch_order", POINTER(c_int)),
+                ("_collision_batch_start", POINTER(c_int)),
+                ("_collision_batch_plog", POINTER(c_double)),
+                ("_collision_batch_allocatedN", c_int),
                 ("_calculate_megno", c_int),
                 ("megno_Ys", c_double),
                 ("megno_Yss", c_double),
@@ -1171,6 +1306,8 @@ Simulation._fields_ = [
                 ("ri_hybrid", reb_simulation_integrator_hybrid),
                 ("ri_whfast", reb_simulation_integrator_whfast),
                 ("ri_ias15", reb_simulation_integrator_ias15),
+                ("ri_leapfrog", reb_simulation_integrator_leapfrog),
+                ("ri_hermite", reb_simulation_integrator_hermite),
                 ("_additional_forces", CFUNCTYPE(None,POINTER(Simulation))),
                 ("_post_timestep_modifications", CFUNCTYPE(None,POINTER(Simulation))),
                 ("_heartbeat", CFUNCTYPE(None,POINTER(Simulation))),
@@ -1,5 +1,80 @@
 import rebound
 import unittest
+import math
+import ctypes
+
+def find_collisions(collision, radius, shear=False, steps=1, m=1., **attrs):
+    """Returns the collisions found in every step as a list of sets of (id1, id2, shiftx, shifty, shiftz).
+    1000 particles with radii radius(i) are placed in a periodic box (or a shearing sheet).
+    Other simulation attributes can be set with attrs. Collisions are recorded but not resolved."""
+    sim = rebound.Simulation()
+    if shear:
+        sim.ri_sei.OMEGA = 1.
+        sim.configure_box(4.,1,10,1)
+        sim.configure_ghostboxes(1,1,0)
+        sim.boundary = "shear"
+        sim.integrator = "sei"
+        sim.dt = 1e-2
+        L, v = (1.99, 19.99, 0.49), (0.3, 0.3, 0.1)
+    else:
+        sim.configure_box(10.)
+        sim.configure_ghostboxes(1,1,1)
+        sim.boundary = "periodic"
+        sim.integrator = "leapfrog"
+        sim.dt = 1e-3
+        L, v = (4.99, 4.99, 4.99), (1., 1., 1.)
+    sim.gravity = "none"
+    sim.collision = collision
+    for key, value in attrs.items():
+        setattr(sim, key, value)
+    for i in range(1000):
+        sim.add(m=m, r=radius(i), x=L[0]*math.sin(i), y=L[1]*math.cos(3.*i), z=L[2]*math.sin(7.*i), vx=v[0]*math.cos(5.*i), vy=v[1]*math.sin(11.*i), vz=v[2]*math.cos(13.*i), id=i)
+    collisions = []
+    def resolve(simp, c):
+        ps = simp.contents.particles
+        collisions[-1].add((ps[c.p1].id, ps[c.p2].id, round(c.gb.shiftx), round(c.gb.shifty,6), round(c.gb.shiftz)))
+        return 0
+    sim.collision_resolve = resolve
+    for i in range(steps):
+        collisions.append(set())
+        sim.step()
+    return collisions, sim
+
+# True if librebound has been compiled with OpenMP.
+openmp = hasattr(rebound.clibrebound, "omp_set_num_threads")
+
+def set_omp_threads(n):
+    """Sets the number of OpenMP threads (if compiled with OpenMP) and returns the previous number."""
+    if not openmp:
+        return 1
+    previous = rebound.clibrebound.omp_get_max_threads()
+    rebound.clibrebound.omp_set_num_threads(n)
+    return previous
+
+def hardsphere_box(threads, steps, **attrs):
+    """Returns the simulation after resolving hard sphere collisions of 1000 densely packed 
+    particles in a periodic box for a number of steps with the given number of OpenMP threads."""
+    sim = rebound.Simulation()
+    sim.configure_box(10.)
+    sim.configure_ghostboxes(1,1,1)
+    sim.boundary = "periodic"
+    sim.integrator = "leapfrog"
+    sim.dt = 1e-2
+    sim.gravity = "none"
+    sim.collision = "tree"
+    for key, value in attrs.items():
+        setattr(sim, key, value)
+    for i in range(1000):
+        sim.add(m=1.+0.5*math.sin(3.*i), r=0.3, x=4.99*math.sin(i), y=4.99*math.cos(3.*i), z=4.99*math.sin(7.*i), vx=math.cos(5.*i), vy=math.sin(11.*i), vz=math.cos(13.*i), id=i)
+    # Collisions are shuffled with rand() before they are resolved.
+    ctypes.CDLL(None).srand(7)
+    previous = set_omp_threads(threads)
+    try:
+        for i in range(steps):
+            sim.step()
+    finally:
+        set_omp_threads(previous)
+    return sim
 
 class TestBoundary(unittest.TestCase):
     
@@ -28,6 +103,71 @@ class TestBoundary(unittest.TestCase):
         self.assertAlmostEqual(sim.particles[0].x,1,1e-16)
         self.assertEqual(sim.N,1)
     
+    def test_periodic_collision_tree(self):
+        # The tree search walks all ghost boxes at once and must find the same collisions as the direct search.
+        radius = lambda i: 0.2
+        direct, _ = find_collisions("direct", radius)
+        tree, _ = find_collisions("tree", radius)
+        self.assertGreater(sum(1 for c in direct[0] if c[2] or c[3] or c[4]), 0)
+        self.assertEqual(direct, tree)
+
+    def test_periodic_collision_grid(self):
+        # The hashed grid must find the same collisions as the direct search, also for different radii.
+        radius = lambda i: 0.1+0.15*abs(math.sin(17.*i))
+        direct, _ = find_collisions("direct", radius)
+        grid, _ = find_collisions("grid", radius)
+        self.assertGreater(sum(1 for c in direct[0] if c[2] or c[3] or c[4]), 0)
+        self.assertEqual(direct, grid)
+
+    def test_shear_collision_sweep(self):
+        # Sweep and prune must find the same collisions as the direct search, also after the sorted list was updated in place.
+        radius = lambda i: 0.05+0.05*abs(math.sin(17.*i))
+        direct, _ = find_collisions("direct", radius, shear=True, steps=20)
+        sweep, sim = find_collisions("sweep", radius, shear=True, steps=20)
+        self.assertEqual(sim._collision_sweep_axis, 1)
+        self.assertGreater(sum(1 for c in direct[-1] if c[2] or c[3]), 0)
+        self.assertEqual(direct, sweep)
+
+    def test_periodic_collision_sweep_sorted(self):
+        # The sorted list must follow the particles when a tree reorders them along a Morton curve.
+        radius = lambda i: 0.2
+        attrs = dict(steps=5, m=1e-4, gravity="tree", softening=0.02, tree_sort_interval=2)
+        direct, _ = find_collisions("direct", radius, **attrs)
+        sweep, _ = find_collisions("sweep", radius, **attrs)
+        self.assertGreater(len(direct[-1]), 0)
+        self.assertEqual(direct, sweep)
+
+    def test_periodic_collision_fused(self):
+        # Candidates recorded during the gravity walk give the same collisions as the normal search.
+        radius = lambda i: 0.2
+        plain, _ = find_collisions("tree", radius, steps=5, m=1e-4, gravity="tree", softening=0.02, collision_fused=0)
+        fused, _ = find_collisions("tree", radius, steps=5, m=1e-4, gravity="tree", softening=0.02, collision_fused=1)
+        for i in range(5):
+            self.assertGreater(len(plain[i]), 0)
+            self.assertEqual(fused[i], plain[i])
+
+    @unittest.skipUnless(openmp, "librebound compiled without OpenMP")
+    def test_periodic_collision_hardsphere_batches(self):
+        # With several threads, hard sphere collisions are resolved in parallel batches.
+        # The velocities must be identical to resolving them one by one.
+        serial = hardsphere_box(1, 10)
+        batches = hardsphere_box(4, 10)
+        self.assertGreater(serial.collisions_Nlog, 1000)
+        self.assertEqual(serial.collisions_Nlog, batches.collisions_Nlog)
+        for p, q in zip(serial.particles, batches.particles):
+            self.assertEqual((p.vx, p.vy, p.vz), (q.vx, q.vy, q.vz))
+
+    @unittest.skipUnless(openmp, "librebound compiled without OpenMP")
+    def test_periodic_collision_tree_threads(self):
+        # Collisions found in per-thread buffers are merged in a deterministic order,
+        # so the particle state must be bit-identical for any number of threads.
+        attrs = dict(gravity="tree", G=1e-4, softening=0.1)
+        serial = hardsphere_box(1, 20, **attrs)
+        threads = hardsphere_box(3, 20, **attrs)
+        self.assertGreater(serial.collisions_Nlog, 1000)
+        for p, q in zip(serial.particles, threads.particles):
+            self.assertEqual((p.id, p.x, p.y, p.z, p.vx, p.vy, p.vz), (q.id, q.x, q.y, q.z, q.vx, q.vy, q.vz))
+    
     
 if __name__ == "__main__":
     unittest.main()
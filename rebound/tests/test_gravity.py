@@ -25,6 +25,29 @@ class TestGravity(unittest.TestCase):
         x0 = sim.particles[0].x
         self.assertNotEqual(x0, 0.)
     
+    def test_testparticle_basic_chunks(self):
+        # Massless testparticles must feel the same force as massive particles with m=0.
+        def setup(N_active):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.boundary = "periodic"
+            sim.nghostx = 1
+            sim.nghosty = 1
+            sim.integrator = "none"
+            for i in range(8):
+                sim.add(m=1e-3*(i+1), x=0.5*i-2., y=math.sin(i), z=0.1*math.cos(i))
+            for i in range(1000):
+                sim.add(m=0., x=4.*math.sin(3.*i), y=4.*math.cos(5.*i), z=0.2*math.sin(i))
+            sim.N_active = N_active
+            sim.step()
+            return sim
+        sim0 = setup(8)
+        sim1 = setup(-1)
+        for i in range(sim0.N):
+            self.assertAlmostEqual(sim0.particles[i].ax, sim1.particles[i].ax, delta=1e-15)
+            self.assertAlmostEqual(sim0.particles[i].ay, sim1.particles[i].ay, delta=1e-15)
+            self.assertAlmostEqual(sim0.particles[i].az, sim1.particles[i].az, delta=1e-15)
+
     def test_testparticle_comp_0(self):
         sim = rebound.Simulation()
         sim.gravity = "compensated"
@@ -48,6 +71,355 @@ class TestGravity(unittest.TestCase):
         self.assertNotEqual(x0, 0.)
 
 
+    def test_basic_vs_compensated(self):
+        accs = []
+        for gravity in ["basic", "compensated"]:
+            sim = rebound.Simulation()
+            sim.gravity = gravity
+            sim.softening = 0.01
+            for i in range(600):
+                sim.add(m=1e-3, x=math.sin(i), y=math.cos(3.*i), z=0.1*math.sin(7.*i))
+            sim.N_active = 500
+            sim.testparticle_type = 1
+            sim.step()
+            accs.append([(p.ax, p.ay, p.az) for p in sim.particles])
+        for a, b in zip(accs[0], accs[1]):
+            for k in range(3):
+                self.assertAlmostEqual(a[k], b[k], delta=1e-10*(1.+abs(b[k])))
+
+    def test_fmm_vs_basic(self):
+        accs = []
+        for gravity in ["basic", "fmm"]:
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.gravity = gravity
+            sim.fmm_order = 5
+            sim.fmm_opening_angle = 0.3
+            for i in range(1000):
+                sim.add(m=1e-3, x=math.sin(i), y=math.cos(3.*i), z=0.1*math.sin(7.*i))
+            sim.step()
+            accs.append([(p.ax, p.ay, p.az) for p in sim.particles])
+        err2 = 0.
+        norm2 = 0.
+        for a, b in zip(accs[0], accs[1]):
+            for k in range(3):
+                err2 += (a[k]-b[k])**2
+                norm2 += a[k]**2
+        self.assertLess(math.sqrt(err2/norm2), 1e-4)
+
+    def test_fmm_vs_basic_softening(self):
+        # The expansions use the softened kernel and particles do not interact with their own images.
+        accs = []
+        for gravity in ["basic", "fmm"]:
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.configure_ghostboxes(1,1,0)
+            sim.boundary = "periodic"
+            sim.gravity = gravity
+            sim.softening = 0.3
+            sim.fmm_order = 5
+            sim.fmm_opening_angle = 0.3
+            for i in range(1000):
+                sim.add(m=1e-3, x=math.sin(i), y=math.cos(3.*i), z=0.1*math.sin(7.*i))
+            sim.step()
+            accs.append([(p.ax, p.ay, p.az) for p in sim.particles])
+        err2 = 0.
+        norm2 = 0.
+        for a, b in zip(accs[0], accs[1]):
+            for k in range(3):
+                err2 += (a[k]-b[k])**2
+                norm2 += a[k]**2
+        self.assertLess(math.sqrt(err2/norm2), 1e-4)
+
+    def test_tree_multipole_order(self):
+        def setup(gravity):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.gravity = gravity
+            sim.integrator = "leapfrog"
+            sim.boundary = "open"
+            sim.dt = 1e-6
+            sim.opening_angle2 = 0.25
+            for i in range(1000):
+                sim.add(m=1e-3, x=math.sin(i), y=math.cos(3.*i), z=0.1*math.sin(7.*i))
+            return sim
+        sim = setup("basic")
+        sim.step()
+        a0 = [(p.ax, p.ay, p.az) for p in sim.particles]
+        errs = []
+        for order in [0, 2, 3]:
+            sim = setup("tree")
+            sim.tree_multipole_order = order # rebuilds the tree
+            sim.step()
+            err2 = 0.
+            norm2 = 0.
+            for a, p in zip(a0, sim.particles):
+                b = (p.ax, p.ay, p.az)
+                for k in range(3):
+                    err2 += (a[k]-b[k])**2
+                    norm2 += a[k]**2
+            errs.append(math.sqrt(err2/norm2))
+        self.assertLess(errs[1], errs[0])
+        self.assertLess(errs[2], errs[1])
+
+    def test_tree_sort_particles(self):
+        def setup(sort_interval):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.gravity = "tree"
+            sim.integrator = "leapfrog"
+            sim.boundary = "open"
+            sim.dt = 1e-3
+            sim.softening = 0.01
+            sim.tree_sort_interval = sort_interval
+            for i in range(1000):
+                sim.add(m=1e-3, x=math.sin(i), y=math.cos(3.*i), z=0.1*math.sin(7.*i), id=i)
+            return sim
+        sim0 = setup(0)
+        sim1 = setup(3)
+        sim0.integrate(0.01)
+        sim1.integrate(0.01)
+        self.assertNotEqual([p.id for p in sim1.particles], [p.id for p in sim0.particles])
+        self.assertEqual(sorted([p.id for p in sim1.particles]), list(range(1000)))
+        ps0 = dict((p.id, p) for p in sim0.particles)
+        for p in sim1.particles:
+            q = ps0[p.id]
+            self.assertAlmostEqual(p.x, q.x, delta=1e-12)
+            self.assertAlmostEqual(p.ax, q.ax, delta=1e-8*(1.+abs(q.ax)))
+
+    def test_tree_rebuild(self):
+        def setup(rebuild):
+            sim = rebound.Simulation()
+            sim.configure_box(10.,2,2,1)
+            sim.gravity = "tree"
+            sim.integrator = "leapfrog"
+            sim.boundary = "open"
+            sim.dt = 1e-2
+            sim.softening = 0.01
+            sim.tree_multipole_order = 2
+            sim.tree_rebuild = rebuild
+            for i in range(1000):
+                sim.add(m=1e-3, x=9.*math.sin(i), y=9.*math.cos(3.*i), z=4.*math.sin(7.*i), vx=10.*math.cos(5.*i), id=i)
+            return sim
+        sim0 = setup(0)
+        sim1 = setup(1)
+        sim0.integrate(0.2)
+        sim1.integrate(0.2)
+        self.assertLess(sim1.N, 1000)
+        self.assertEqual(sim0.N, sim1.N)
+        self.assertEqual(sim0.tree_pool_N, sim1.tree_pool_N)
+        ps0 = dict((p.id, p) for p in sim0.particles)
+        for p in sim1.particles:
+            self.assertEqual(p.ax, ps0[p.id].ax)
+
+    def test_tree_group_walk(self):
+        def setup(gravity, group_size):
+            sim = rebound.Simulation()
+            sim.configure_box(10.,2,1,1)
+            sim.configure_ghostboxes(1,1,0)
+            sim.boundary = "periodic"
+            sim.gravity = gravity
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-6
+            sim.softening = 0.01
+            sim.opening_angle2 = 0.25
+            sim.tree_multipole_order = 2
+            sim.tree_group_size = group_size
+            for i in range(1000):
+                sim.add(m=1e-3, x=9.*math.sin(i), y=4.*math.cos(3.*i), z=0.1*math.sin(7.*i))
+            sim.step()
+            return sim
+        sim = setup("basic", 0)
+        a0 = [(p.ax, p.ay, p.az) for p in sim.particles]
+        errs = []
+        for group_size in [0, 16]:
+            sim = setup("tree", group_size)
+            err2 = 0.
+            norm2 = 0.
+            for a, p in zip(a0, sim.particles):
+                b = (p.ax, p.ay, p.az)
+                for k in range(3):
+                    err2 += (a[k]-b[k])**2
+                    norm2 += a[k]**2
+            errs.append(math.sqrt(err2/norm2))
+        self.assertLess(errs[0], 1e-3)
+        self.assertLess(errs[1], errs[0])
+
+    def test_tree_opening_tolerance(self):
+        # Clumps in a diffuse disc. The relative criterion resolves the clumps better.
+        def setup(gravity, tolerance):
+            sim = rebound.Simulation()
+            sim.configure_box(20.)
+            sim.gravity = gravity
+            sim.integrator = "none"
+            sim.opening_angle2 = 0.25
+            for i in range(2000):
+                if i%2==0:
+                    sim.add(m=1e-3, x=7.*math.sin(i), y=7.*math.cos(3.*i), z=0.05*math.sin(7.*i))
+                else:
+                    c = (i//2)%10
+                    sim.add(m=1e-3, x=5.*math.cos(c)+0.05*math.sin(i), y=5.*math.sin(c)+0.05*math.cos(5.*i), z=0.05*math.sin(3.*i))
+            sim.step()
+            sim.tree_opening_tolerance = tolerance
+            sim.step()
+            return sim
+        sim = setup("basic", 0.)
+        a0 = [(p.ax, p.ay, p.az) for p in sim.particles]
+        errs = []
+        for tolerance in [0., 1e-3]:
+            sim = setup("tree", tolerance)
+            errmax = 0.
+            for a, p in zip(a0, sim.particles):
+                d = math.sqrt((a[0]-p.ax)**2+(a[1]-p.ay)**2+(a[2]-p.az)**2)
+                errmax = max(errmax, d/math.sqrt(a[0]**2+a[1]**2+a[2]**2))
+            errs.append(errmax)
+        self.assertLess(errs[1], 1e-2)
+        self.assertLess(errs[1], errs[0])
+
+    def test_gravity_mixed_precision(self):
+        # Compares the single precision interactions against the double precision path.
+        def setup(order, mixed):
+            sim = rebound.Simulation()
+            sim.configure_box(10.,2,1,1)
+            sim.configure_ghostboxes(1,1,0)
+            sim.boundary = "periodic"
+            sim.gravity = "tree"
+            sim.integrator = "none"
+            sim.softening = 0.01
+            sim.tree_multipole_order = order
+            sim.tree_group_size = 16
+            sim.gravity_mixed_precision = mixed
+            for i in range(1000):
+                sim.add(m=1e-3, x=9.*math.sin(i), y=4.*math.cos(3.*i), z=0.1*math.sin(7.*i))
+            sim.step()
+            return sim
+        for order in [0, 2, 3]:
+            sim0 = setup(order, 0)
+            sim1 = setup(order, 1)
+            err2 = 0.
+            norm2 = 0.
+            for p0, p1 in zip(sim0.particles, sim1.particles):
+                err2 += (p0.ax-p1.ax)**2 + (p0.ay-p1.ay)**2 + (p0.az-p1.az)**2
+                norm2 += p0.ax**2 + p0.ay**2 + p0.az**2
+            self.assertLess(math.sqrt(err2/norm2), 1e-4)
+            self.assertGreater(math.sqrt(err2/norm2), 0.)
+
+    def test_tree_refit(self):
+        def setup(refit):
+            sim = rebound.Simulation()
+            sim.configure_box(10.)
+            sim.gravity = "tree"
+            sim.integrator = "none"
+            sim.softening = 0.01
+            sim.tree_multipole_order = 2
+            sim.tree_refit = refit
+            for i in range(1000):
+                sim.add(m=1e-3, x=4.*math.sin(i), y=4.*math.cos(3.*i), z=4.*math.sin(7.*i), id=i)
+            sim.step()
+            return sim
+        sim0 = setup(0)
+        sim1 = setup(1)
+        for sim in [sim0, sim1]:
+            for i in range(0, 1000, 97):
+                sim.particles[i].x += 1e-6 if i%2 else 1.
+                sim.particles[i].m *= 2.
+            sim.step()
+        ps0 = dict((p.id, p) for p in sim0.particles)
+        for p in sim1.particles:
+            self.assertEqual(p.ax, ps0[p.id].ax)
+            self.assertEqual(p.ay, ps0[p.id].ay)
+
+    def test_gravity_ewald(self):
+        def setup(gravity, ewald, nghost):
+            sim = rebound.Simulation()
+            sim.configure_box(1.)
+            sim.boundary = "periodic"
+            sim.gravity = gravity
+            sim.gravity_ewald = ewald
+            sim.integrator = "leapfrog"
+            sim.dt = 1e-9
+            sim.opening_angle2 = 1e-4
+            sim.nghostx = nghost
+            sim.nghosty = nghost
+            sim.nghostz = nghost
+            for i in range(30):
+                sim.add(m=1.+0.5*math.sin(5.*i), x=0.49*math.sin(i), y=0.49*math.cos(3.*i), z=0.49*math.sin(7.*i), id=i)
+            sim.step()
+            return sim
+        e = setup("basic", 1, 0)
+        g = setup("basic", 0, 6)
+        t = setup("tree", 1, 0)
+        # Summing over ghost boxes converges to the Ewald result plus a dipole term.
+        M = sum(p.m for p in e.particles)
+        mx = sum(p.m*p.x for p in e.particles)
+        k = 4.*math.pi/3.
+        amax = max(abs(p.ax) for p in e.particles)
+        for i in range(30):
+            p = e.particles[i]
+            self.assertAlmostEqual(g.particles[i].ax, p.ax-k*(M*p.x-mx), delta=1e-2*amax)
+        ts = dict((p.id, p) for p in t.particles)
+        for p in e.particles:
+            self.assertAlmostEqual(ts[p.id].ax, p.ax, delta=1e-2*amax)
+
+    def test_gravity_ewald_unsupported(self):
+        sim = rebound.Simulation()
+        sim.gravity_ewald = 1
+        sim.add(m=1.)
+        sim.add(m=1e-3, a=1.)
+        sim.integrate(1.)
+        self.assertEqual(sim.gravity_ewald, 1)
+        self.assertEqual(sim.gravity_ewald_warning, 1)
+        self.assertAlmostEqual(sim.particles[1].a, 1., delta=1e-6)
+
+    def test_gravity_pm(self):
+        # A single density mode in a razor thin sheet, periodic and sheared.
+        for boundary in ["periodic", "shear"]:
+            sim = rebound.Simulation()
+            sim.configure_box(1., 1, 2, 1)
+            sim.gravity = "pm"
+            sim.boundary = boundary
+            sim.integrator = "none"
+            sim.integrator_sei_OMEGA = 1.
+            sim.pm_nx = 32
+            sim.pm_ny = 64
+            sim.pm_nz = 1
+            ky = 2.*math.pi/2.
+            kx = 2.*math.pi
+            if boundary=="shear":
+                # Shift of the ghostbox is a quarter of the box
+                sim.t = 2./4./1.5
+                kx = 2.*math.pi + ky*0.5
+            for i in range(64):
+                for j in range(128):
+                    x = -0.5+(i+0.5)/64.
+                    y = -1.+(j+0.5)/64.
+                    sim.add(m=1.+0.1*math.cos(kx*x+ky*y), x=x, y=y)
+            sim.step()
+            K = math.sqrt(kx*kx+ky*ky)
+            amp = 2.*math.pi*sim.N/2.*0.1/K
+            for p in sim.particles:
+                theta = kx*p.x+ky*p.y
+                self.assertAlmostEqual(p.ax, -amp*math.sin(theta)*kx, delta=1e-3*amp*K)
+                self.assertAlmostEqual(p.ay, -amp*math.sin(theta)*ky, delta=1e-3*amp*K)
+                self.assertEqual(p.az, 0.)
+
+    def test_tree_pool(self):
+        sim = rebound.Simulation()
+        sim.configure_box(10.)
+        sim.gravity = "tree"
+        sim.integrator = "leapfrog"
+        sim.boundary = "open"
+        sim.dt = 1e-2
+        for i in range(1000):
+            sim.add(m=1e-6, x=math.sin(i), y=math.cos(3.*i), z=0.1*math.sin(7.*i), vx=math.cos(5.*i))
+        self.assertGreater(sim.tree_pool_N, sim.N)
+        self.assertEqual(sim.tree_pool_N_max, sim.tree_pool_N)
+        sim.integrate(1.)
+        self.assertGreater(sim.tree_pool_N, sim.N)
+        self.assertGreaterEqual(sim.tree_pool_N_max, sim.tree_pool_N)
+        sim.tree_multipole_order = 2
+        sim.step()
+        self.assertGreater(sim.tree_pool_N, sim.N)
 
 
     def test_testparticle_whfast_comp_0(self):
@@ -53,6 +53,56 @@ class TestIntegrator2(unittest.TestCase):
         x1 = sim.calculate_energy()
         self.assertAlmostEqual(x0, x1, delta=1e-14)
 
+    def test_leapfrog_block_timesteps(self):
+        def run(levels, dt, eta=0.025):
+            sim = rebound.Simulation()
+            sim.configure_box(20.)
+            sim.gravity = "tree"
+            sim.integrator = "leapfrog"
+            sim.softening = 0.001
+            sim.dt = dt
+            sim.exact_finish_time = 0
+            sim.ri_leapfrog.block_levels = levels
+            sim.ri_leapfrog.block_eta = eta
+            sim.add(m=1., id=0)
+            sim.add(m=1e-3, a=0.1, e=0.1, id=1)
+            sim.add(m=1e-3, a=2., e=0.1, id=2, primary=sim.particles[0])
+            sim.move_to_com()
+            sim.integrate(5.)
+            ps = sorted(sim.particles, key=lambda p: p.id)
+            dx, dy, dz = ps[1].x-ps[0].x, ps[1].y-ps[0].y, ps[1].z-ps[0].z
+            dv2 = (ps[1].vx-ps[0].vx)**2 + (ps[1].vy-ps[0].vy)**2 + (ps[1].vz-ps[0].vz)**2
+            mu = ps[0].m + ps[1].m
+            return ps[1].x, -mu/(2.*(dv2/2.-mu/math.sqrt(dx*dx+dy*dy+dz*dz)))
+        # All particles on the finest level is the same as the leapfrog with a smaller timestep.
+        self.assertAlmostEqual(run(3, 0.02, 1e-12)[0], run(1, 0.005)[0], delta=1e-8)
+        # The inner orbit is resolved with block timesteps.
+        self.assertLess(abs(run(5, 0.02)[1]-0.1), 2e-5)
+        self.assertGreater(abs(run(1, 0.02)[1]-0.1), 1e-4)
+
+    def test_hermite(self):
+        def run(eta, levels):
+            sim = rebound.Simulation()
+            sim.integrator = "hermite"
+            sim.ri_hermite.eta = eta
+            sim.ri_hermite.block_levels = levels
+            sim.dt = 0.1
+            sim.add(m=1.)
+            sim.add(m=1e-3, a=1., e=0.5)
+            sim.add(m=1e-3, a=5., e=0.1)
+            sim.move_to_com()
+            e0 = sim.calculate_energy()
+            sim.integrate(100., exact_finish_time=0)
+            return abs((sim.calculate_energy()-e0)/e0), [sim.ri_hermite.level[i] for i in range(sim.N)]
+        e1 = run(0.02, 1)[0]
+        e2 = run(0.01, 1)[0]
+        self.assertLess(e1, 1e-3)
+        # Fourth order: the error decreases with eta^2.
+        self.assertLess(e2, e1/3.)
+        e3, levels = run(0.02, 8)
+        self.assertLess(e3, 1e-3)
+        self.assertGreater(max(levels), min(levels))
+
 
 class TestIntegrator(unittest.TestCase):
     def setUp(self):
@@ -39,6 +39,30 @@ class TestSimulation(unittest.TestCase):
         self.sim.remove(1,keepSorted=0)
         self.assertEqual(self.sim.N,1)
     
+    def test_remove_marked(self):
+        for keepSorted in [1, 0]:
+            sim = rebound.Simulation()
+            for i in range(10):
+                sim.add(m=1., x=i, id=i)
+            for i in [8, 9, 2, 3]:
+                sim.remove_mark(i)
+            sim.remove_mark(3)
+            self.assertEqual(sim.N, 10)
+            self.assertEqual(sim.remove_marked(keepSorted=keepSorted), 4)
+            self.assertEqual(sim.N, 6)
+            ids = [p.id for p in sim.particles]
+            if keepSorted:
+                self.assertEqual(ids, [0, 1, 4, 5, 6, 7])
+            else:
+                self.assertEqual(sorted(ids), [0, 1, 4, 5, 6, 7])
+            m = sim.removed_map
+            for i in range(10):
+                if i in [2, 3, 8, 9]:
+                    self.assertEqual(m[i], -1)
+                else:
+                    self.assertEqual(sim.particles[m[i]].id, i)
+            self.assertEqual(sim.remove_marked(), 0)
+    
     def test_ascii(self):
         a = self.sim.particles_ascii()
         sim = rebound.Simulation()
@@ -40,6 +40,26 @@ class TestVariationalIAS15(unittest.TestCase):
 
         self.assertAlmostEqual(self.Xshifted,X_var,delta=1e-5)
     
+    def test_var_shared_configurations(self):
+        # Several configurations share the pair geometry, results must not depend on the others.
+        var_a = self.sim.add_variation()
+        var_b = self.sim.add_variation()
+        self.sim.add_variation(order=2,first_order=var_a)
+        var_a.particles[1].x = 1.
+        var_b.particles[2].vy = 1.
+        self.sim.integrate(10.)
+        sim2 = rebound.Simulation()
+        sim2.add(m=1.)
+        sim2.add(m=1.e-3,a=1)
+        sim2.add(a=1.76)
+        sim2.move_to_com()
+        var_b2 = sim2.add_variation()
+        var_b2.particles[2].vy = 1.
+        sim2.integrate(10.)
+        for i in range(3):
+            self.assertAlmostEqual(var_b.particles[i].x,var_b2.particles[i].x,delta=1e-12)
+            self.assertAlmostEqual(var_b.particles[i].vy,var_b2.particles[i].vy,delta=1e-12)
+
     def test_var_restart(self):
         var_i = self.sim.add_variation()
         var_ii = self.sim.add_variation(order=2,first_order=var_i)
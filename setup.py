@@ -26,8 +26,11 @@ libreboundmodule = Extension('librebound',
                                 'src/integrator_leapfrog.c',
                                 'src/integrator_sei.c',
                                 'src/integrator_hybrid.c',
+                                'src/integrator_hermite.c',
                                 'src/integrator.c',
                                 'src/gravity.c',
+                                'src/gravity_fmm.c',
+                                'src/gravity_pm.c',
                                 'src/boundary.c',
                                 'src/collision.c',
                                 'src/tools.c',
@@ -38,7 +41,7 @@ libreboundmodule = Extension('librebound',
                                 ],
                     include_dirs = ['src'],
                     define_macros=[ ('LIBREBOUND', None) ],
-                    extra_compile_args=['-fstrict-aliasing', '-O3','-std=c99','-march=native','-Wno-unknown-pragmas', '-DLIBREBOUND', '-D_GNU_SOURCE', '-fPIC'],
+                    extra_compile_args=['-fstrict-aliasing', '-O3','-std=c99','-march=native','-fno-math-errno','-Wno-unknown-pragmas', '-DLIBREBOUND', '-D_GNU_SOURCE', '-fPIC'],
                     extra_link_args=extra_link_args,
                     )
 
@@ -43,7 +43,7 @@ void reb_boundary_check(struct reb_simulation* const r){
 	const struct reb_vec3d boxsize = r->boxsize;
 	switch(r->boundary){
 		case REB_BOUNDARY_OPEN:
-			for (int i=0;i<N;i++){ // run through loop backwards so we don't have to recheck same index after removing
+			for (int i=0;i<N;i++){
 				int removep = 0;
 				if(particles[i].x>boxsize.x/2.){
 					removep = 1;
@@ -64,16 +64,11 @@ void reb_boundary_check(struct reb_simulation* const r){
 					removep = 1;
 				}
 				if (removep==1){
-                    reb_remove(r, i,0); // keepSorted=0 by default in C version
-                    if (r->tree_root==NULL){
-                        i--; // need to recheck the particle that replaced the removed one
-                        N--; // This is the local N
-                    }else{
-                        // particle just marked, will be removed later
-                        r->tree_needs_update= 1;
-                    }
+					reb_remove_mark(r, i);
 				}
 			}
+			// All particles are removed in one pass, keepSorted=0 by default in C version.
+			reb_remove_marked(r, 0);
 			break;
 		case REB_BOUNDARY_SHEAR:
 		{
@@ -31,6 +31,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
@@ -40,8 +41,550 @@
 #include "boundary.h"
 #include "tree.h"
 #include "communication_mpi.h"
+#ifdef OPENMP
+#include <omp.h>
+#endif
 
-static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, int* collisions_N, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r,  double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c);
+static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r,  double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c);
+static void reb_tree_get_nearest_neighbour_in_cell_images(struct reb_simulation* const r, const struct reb_ghostbox* const gbs, const struct reb_ghostbox* const gbunmods, const int* const act, const int nact, int ri, double p1_r,  double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c);
+#if defined(OPENMP) && !defined(MPI)
+static void reb_collision_resolve_hardsphere_batches(struct reb_simulation* const r, const int collisions_N);
+#endif // OPENMP && !MPI
+
+/**
+ * @brief Comparison function used to sort collisions.
+ * @details Collisions are ordered by particle indices and then by ghost box.
+ */
+static int reb_collision_compare(const void* a, const void* b){
+	const struct reb_collision* const ca = a;
+	const struct reb_collision* const cb = b;
+	if (ca->p1!=cb->p1) return ca->p1<cb->p1?-1:1;
+	if (ca->p2!=cb->p2) return ca->p2<cb->p2?-1:1;
+	if (ca->gb.shiftx!=cb->gb.shiftx) return ca->gb.shiftx<cb->gb.shiftx?-1:1;
+	if (ca->gb.shifty!=cb->gb.shifty) return ca->gb.shifty<cb->gb.shifty?-1:1;
+	if (ca->gb.shiftz!=cb->gb.shiftz) return ca->gb.shiftz<cb->gb.shiftz?-1:1;
+	if (ca->ri!=cb->ri) return ca->ri<cb->ri?-1:1;
+	return 0;
+}
+
+void reb_collision_buffers_reset(struct reb_simulation* const r){
+	int nthreads = 1;
+#ifdef OPENMP
+	nthreads = omp_get_max_threads();
+#endif // OPENMP
+	if (r->collision_buffers_N<nthreads){
+		r->collision_buffers = realloc(r->collision_buffers, sizeof(struct reb_collision_buffer)*nthreads);
+		for (int t=r->collision_buffers_N;t<nthreads;t++){
+			r->collision_buffers[t].collisions = NULL;
+			r->collision_buffers[t].allocatedN = 0;
+		}
+		r->collision_buffers_N = nthreads;
+	}
+	for (int t=0;t<r->collision_buffers_N;t++){
+		r->collision_buffers[t].N = 0;
+	}
+}
+
+void reb_collision_buffer_add(struct reb_simulation* const r, const struct reb_collision c){
+	int t = 0;
+#ifdef OPENMP
+	t = omp_get_thread_num();
+#endif // OPENMP
+	struct reb_collision_buffer* const b = &(r->collision_buffers[t]);
+	if (b->allocatedN<=b->N){
+		b->allocatedN = b->allocatedN?2*b->allocatedN:32;
+		b->collisions = realloc(b->collisions,sizeof(struct reb_collision)*b->allocatedN);
+	}
+	b->collisions[b->N] = c;
+	b->N++;
+}
+
+int reb_collision_buffers_merge(struct reb_simulation* const r, struct reb_collision** const collisions, int* const allocatedN){
+	int N = 0;
+	for (int t=0;t<r->collision_buffers_N;t++){
+		N += r->collision_buffers[t].N;
+	}
+	if (*allocatedN<N){
+		*allocatedN = N;
+		*collisions = realloc(*collisions,sizeof(struct reb_collision)*N);
+	}
+	int n = 0;
+	for (int t=0;t<r->collision_buffers_N;t++){
+		struct reb_collision_buffer* const b = &(r->collision_buffers[t]);
+		memcpy(*collisions+n, b->collisions, sizeof(struct reb_collision)*b->N);
+		n += b->N;
+		b->N = 0;
+	}
+	// The order in which threads find collisions is not reproducible.
+	qsort(*collisions, N, sizeof(struct reb_collision), reb_collision_compare);
+	return N;
+}
+
+#ifndef MPI
+
+/**
+ * @brief Checks the collision candidates recorded during the tree gravity walk.
+ * @details The candidates are pairs which were close at the time the gravity was calculated.
+ * They are checked with the positions and velocities at the end of the timestep, in the 
+ * same way as the tree search does. Duplicates (found through several ghost boxes) are removed first.
+ * @param r REBOUND simulation to work on.
+ * @return Number of collisions found.
+ */
+static int reb_collision_search_fused(struct reb_simulation* const r){
+	const struct reb_particle* const particles = r->particles;
+	// Candidates are sorted by the merge.
+	const int N_candidates = reb_collision_buffers_merge(r, &r->collisions_fused, &r->collisions_fused_allocatedN);
+	r->collisions_fused_N = -1;
+	// Ghost boxes, but only the inner most ring.
+	int nghostxcol = (r->nghostx>1?1:r->nghostx);
+	int nghostycol = (r->nghosty>1?1:r->nghosty);
+	int nghostzcol = (r->nghostz>1?1:r->nghostz);
+	int collisions_N = 0;
+	for (int i=0;i<N_candidates;i++){
+		const struct reb_collision c = r->collisions_fused[i];
+		if (i>0 && c.p1==r->collisions_fused[i-1].p1 && c.p2==r->collisions_fused[i-1].p2) continue;
+		const struct reb_particle p1 = particles[c.p1];
+		const struct reb_particle p2 = particles[c.p2];
+		const double rp = p1.r+p2.r;
+		for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
+		for (int gby=-nghostycol; gby<=nghostycol; gby++){
+		for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
+			struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+			double dx = p1.x + gb.shiftx - p2.x;
+			double dy = p1.y + gb.shifty - p2.y;
+			double dz = p1.z + gb.shiftz - p2.z;
+			double r2 = dx*dx+dy*dy+dz*dz;
+			// reb_particles are not overlapping 
+			if (r2 > rp*rp) continue;
+			double dvx = p1.vx + gb.shiftvx - p2.vx;
+			double dvy = p1.vy + gb.shiftvy - p2.vy;
+			double dvz = p1.vz + gb.shiftvz - p2.vz;
+			// reb_particles are not approaching each other
+			if (dvx*dx + dvy*dy + dvz*dz >0) continue;
+			if (r->collisions_allocatedN<=collisions_N){
+				r->collisions_allocatedN += 32;
+				r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
+			}
+			r->collisions[collisions_N].p1 = c.p1;
+			r->collisions[collisions_N].p2 = c.p2;
+			r->collisions[collisions_N].gb = gb;
+			r->collisions[collisions_N].ri = 0;
+			collisions_N++;
+		}
+		}
+		}
+	}
+	return collisions_N;
+}
+#endif // MPI
+
+/**
+ * @brief Hash of a grid cell.
+ * @param cx Cell index in x direction
+ * @param cy Cell index in y direction
+ * @param cz Cell index in z direction
+ * @param mask Number of hash buckets minus one (power of two minus one).
+ */
+static inline int reb_collision_grid_hash(const long long cx, const long long cy, const long long cz, const unsigned long long mask){
+	const unsigned long long h = ((unsigned long long)cx*73856093ULL) ^ ((unsigned long long)cy*19349663ULL) ^ ((unsigned long long)cz*83492791ULL);
+	return (int)(h & mask);
+}
+
+/**
+ * @brief Searches for collisions with a hashed uniform grid.
+ * @details The cell size is the largest possible sum of two radii, so overlapping 
+ * particles are in the same or in neighbouring cells. The particles are sorted by 
+ * hash bucket every timestep (counting sort, O(N)) and their positions and radii are
+ * copied in this order so that a bucket can be read sequentially. For every particle 
+ * and every image in the inner most ring of ghost boxes, the 27 neighbouring cells 
+ * are searched. Images further than one cell away from the bounding box of all 
+ * particles are skipped. Different cells can share a bucket, so a pair is only 
+ * recorded when it is found in the cell the second particle actually belongs to.
+ * As in the tree search, every collision is found by both particles.
+ * @param r REBOUND simulation to work on.
+ * @return Number of collisions found.
+ */
+static int reb_collision_search_grid(struct reb_simulation* const r){
+	const struct reb_particle* const particles = r->particles;
+	const int N = r->N;
+	if (N<2){
+		return 0;
+	}
+	// Bounding box and largest radius. max_radius is not used because it can be
+	// outdated (e.g. after merging collisions).
+	double xmin = INFINITY, ymin = INFINITY, zmin = INFINITY;
+	double xmax = -INFINITY, ymax = -INFINITY, zmax = -INFINITY;
+	double rmax = 0.;
+#pragma omp parallel for schedule(static) reduction(min:xmin,ymin,zmin) reduction(max:xmax,ymax,zmax,rmax)
+	for (int i=0;i<N;i++){
+		const struct reb_particle p = particles[i];
+		if (p.x<xmin) xmin = p.x;
+		if (p.y<ymin) ymin = p.y;
+		if (p.z<zmin) zmin = p.z;
+		if (p.x>xmax) xmax = p.x;
+		if (p.y>ymax) ymax = p.y;
+		if (p.z>zmax) zmax = p.z;
+		if (p.r>rmax) rmax = p.r;
+	}
+	const double cs = 2.*rmax;
+	if (cs<=0.){
+		return 0;
+	}
+	const double ics = 1./cs;
+	// Number of hash buckets: power of two, at least 2N.
+	unsigned int nbuckets = 1;
+	while (nbuckets<2u*(unsigned int)N){
+		nbuckets <<= 1;
+	}
+	const unsigned long long mask = nbuckets-1;
+	if (r->collision_grid_allocatedN<N){
+		r->collision_grid_hash = realloc(r->collision_grid_hash, sizeof(int)*N);
+		r->collision_grid_particles = realloc(r->collision_grid_particles, sizeof(int)*N);
+		r->collision_grid_xyzr = realloc(r->collision_grid_xyzr, sizeof(double)*4*N);
+		r->collision_grid_allocatedN = N;
+	}
+	if (r->collision_grid_start_allocatedN<(int)nbuckets+1){
+		r->collision_grid_start = realloc(r->collision_grid_start, sizeof(int)*(nbuckets+1));
+		r->collision_grid_start_allocatedN = nbuckets+1;
+	}
+	int* const hash = r->collision_grid_hash;
+	int* const start = r->collision_grid_start;
+	int* const sorted = r->collision_grid_particles;
+	double* const xyzr = r->collision_grid_xyzr;
+	
+	// Sort particles by hash bucket.
+#pragma omp parallel for schedule(static)
+	for (int i=0;i<N;i++){
+		const struct reb_particle p = particles[i];
+		hash[i] = reb_collision_grid_hash((long long)floor(p.x*ics), (long long)floor(p.y*ics), (long long)floor(p.z*ics), mask);
+	}
+	for (unsigned int b=0;b<=nbuckets;b++){
+		start[b] = 0;
+	}
+	for (int i=0;i<N;i++){
+		start[hash[i]+1]++;
+	}
+	for (unsigned int b=0;b<nbuckets;b++){
+		start[b+1] += start[b];
+	}
+	for (int i=0;i<N;i++){
+		// start[hash] is used as insertion point and restored below.
+		sorted[start[hash[i]]++] = i;
+	}
+	for (unsigned int b=nbuckets;b>0;b--){
+		start[b] = start[b-1];
+	}
+	start[0] = 0;
+#pragma omp parallel for schedule(static)
+	for (int s=0;s<N;s++){
+		const struct reb_particle p = particles[sorted[s]];
+		xyzr[4*s+0] = p.x;
+		xyzr[4*s+1] = p.y;
+		xyzr[4*s+2] = p.z;
+		xyzr[4*s+3] = p.r;
+	}
+	
+	// Ghost boxes, but only the inner most ring.
+	int nghostxcol = (r->nghostx>1?1:r->nghostx);
+	int nghostycol = (r->nghosty>1?1:r->nghosty);
+	int nghostzcol = (r->nghostz>1?1:r->nghostz);
+	const int nimg = (2*nghostxcol+1)*(2*nghostycol+1)*(2*nghostzcol+1);
+	struct reb_ghostbox* const gbunmods = malloc(sizeof(struct reb_ghostbox)*nimg);
+	{
+		int k = 0;
+		for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
+		for (int gby=-nghostycol; gby<=nghostycol; gby++){
+		for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
+			gbunmods[k++] = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+		}
+		}
+		}
+	}
+	reb_collision_buffers_reset(r);
+	// Loop over particles in bucket order, neighbouring queries then share buckets.
+#pragma omp parallel for schedule(guided)
+	for (int s1=0;s1<N;s1++){
+		const int i = sorted[s1];
+		const double r1 = xyzr[4*s1+3];
+		for (int k=0;k<nimg;k++){
+			const struct reb_ghostbox gb = gbunmods[k];
+			const double x = xyzr[4*s1+0] + gb.shiftx;
+			const double y = xyzr[4*s1+1] + gb.shifty;
+			const double z = xyzr[4*s1+2] + gb.shiftz;
+			// Image is too far away from all particles.
+			if (x<xmin-cs || x>xmax+cs || y<ymin-cs || y>ymax+cs || z<zmin-cs || z>zmax+cs) continue;
+			const long long cx = (long long)floor(x*ics);
+			const long long cy = (long long)floor(y*ics);
+			const long long cz = (long long)floor(z*ics);
+			const int central = gb.shiftx==0. && gb.shifty==0. && gb.shiftz==0.;
+			for (int dx=-1;dx<=1;dx++){
+			for (int dy=-1;dy<=1;dy++){
+			for (int dz=-1;dz<=1;dz++){
+				const int b = reb_collision_grid_hash(cx+dx, cy+dy, cz+dz, mask);
+				for (int s2=start[b];s2<start[b+1];s2++){
+					// Do not collide particle with itself.
+					if (central && s1==s2) continue;
+					const double rx = x - xyzr[4*s2+0];
+					const double ry = y - xyzr[4*s2+1];
+					const double rz = z - xyzr[4*s2+2];
+					const double rp = r1 + xyzr[4*s2+3];
+					// reb_particles are not overlapping 
+					if (rx*rx + ry*ry + rz*rz > rp*rp) continue;
+					// Bucket is shared with another cell.
+					if ((long long)floor(xyzr[4*s2+0]*ics)!=cx+dx 
+					 || (long long)floor(xyzr[4*s2+1]*ics)!=cy+dy 
+					 || (long long)floor(xyzr[4*s2+2]*ics)!=cz+dz) continue;
+					const int j = sorted[s2];
+					const struct reb_particle p1 = particles[i];
+					const struct reb_particle p2 = particles[j];
+					const double vx = p1.vx + gb.shiftvx - p2.vx;
+					const double vy = p1.vy + gb.shiftvy - p2.vy;
+					const double vz = p1.vz + gb.shiftvz - p2.vz;
+					// reb_particles are not approaching each other
+					if (vx*rx + vy*ry + vz*rz >0) continue;
+					const struct reb_collision c = {.p1 = i, .p2 = j, .gb = gb, .ri = 0};
+					reb_collision_buffer_add(r, c);
+				}
+			}
+			}
+			}
+		}
+	}
+	free(gbunmods);
+	return reb_collision_buffers_merge(r, &r->collisions, &r->collisions_allocatedN);
+}
+
+/**
+ * @brief Component of a vector along the sweep axis.
+ */
+static inline double reb_collision_sweep_component(const int axis, const double x, const double y, const double z){
+	switch (axis){
+		case 1:
+			return y;
+		case 2:
+			return z;
+		default:
+			return x;
+	}
+}
+
+/**
+ * @brief Compares the position of two xvalues along the sweep axis.
+ */
+static int reb_collision_sweep_compare(const void* a, const void* b){
+	const double diff = ((struct reb_collision_sweep_xvalue*)a)->x - ((struct reb_collision_sweep_xvalue*)b)->x;
+	if (diff > 0) return 1;
+	if (diff < 0) return -1;
+	return 0;
+}
+
+/**
+ * @brief Sorts an array of xvalues with insertion sort.
+ * @param xv Array of xvalues.
+ * @param N Number of xvalues.
+ * @param maxmoves Give up after this many moves (the array is then only partially sorted).
+ * @return 1 if the array is sorted, 0 if maxmoves was exceeded.
+ */
+static int reb_collision_sweep_insertionsort(struct reb_collision_sweep_xvalue* const xv, const int N, const long maxmoves){
+	long moves = 0;
+	for (int j=1;j<N;j++){
+		const struct reb_collision_sweep_xvalue key = xv[j];
+		int i = j - 1;
+		while (i>=0 && xv[i].x > key.x){
+			xv[i+1] = xv[i];
+			i--;
+		}
+		xv[i+1] = key;
+		moves += j-1-i;
+		if (moves>maxmoves){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * @brief Searches for collisions with a sweep and prune algorithm.
+ * @details The particles are kept sorted along one axis, the longest extent of the 
+ * particle distribution. Between timesteps the list is only nearly unsorted and is 
+ * updated in place with an insertion sort, which is close to O(N) for coherent motion. 
+ * With OpenMP, contiguous strips of the list are sorted in parallel first. The list 
+ * is rebuilt with quicksort (and the axis chosen again) if the number of particles 
+ * changed, if the particles have been reordered (collision_sweep_N is then reset), or if 
+ * the insertion sort needs too many moves.
+ * 
+ * For every particle and every image in the inner most ring of ghost boxes, only 
+ * particles within the sum of its radius and the maximum radius along the sweep axis 
+ * are tested. The strips of the list are searched in parallel.
+ * As in the tree search, every collision is found by both particles.
+ * @param r REBOUND simulation to work on.
+ * @return Number of collisions found.
+ */
+static int reb_collision_search_sweep(struct reb_simulation* const r){
+	const struct reb_particle* const particles = r->particles;
+	const int N = r->N;
+	if (N<2){
+		return 0;
+	}
+	// Largest radius, found while the positions along the sweep axis are updated.
+	// max_radius is not used because it can be outdated (e.g. after merging collisions).
+	double maxr = 0.;
+	int rebuild = (r->collision_sweep_N!=N);
+	if (r->collision_sweep_allocatedN<N){
+		r->collision_sweep_xvalues = realloc(r->collision_sweep_xvalues, sizeof(struct reb_collision_sweep_xvalue)*N);
+		r->collision_sweep_allocatedN = N;
+	}
+	struct reb_collision_sweep_xvalue* const xv = r->collision_sweep_xvalues;
+	if (rebuild){
+		// Sweep along the longest extent of the particle distribution.
+		double min[3] = {INFINITY, INFINITY, INFINITY};
+		double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+		for (int i=0;i<N;i++){
+			const double p[3] = {particles[i].x, particles[i].y, particles[i].z};
+			for (int d=0;d<3;d++){
+				if (p[d]<min[d]) min[d] = p[d];
+				if (p[d]>max[d]) max[d] = p[d];
+			}
+		}
+		r->collision_sweep_axis = 0;
+		for (int d=1;d<3;d++){
+			if (max[d]-min[d] > max[r->collision_sweep_axis]-min[r->collision_sweep_axis]){
+				r->collision_sweep_axis = d;
+			}
+		}
+	}
+	const int axis = r->collision_sweep_axis;
+	if (rebuild){
+		for (int i=0;i<N;i++){
+			xv[i].x = reb_collision_sweep_component(axis, particles[i].x, particles[i].y, particles[i].z);
+			xv[i].pt = i;
+			if (particles[i].r>maxr) maxr = particles[i].r;
+		}
+	}else{
+#pragma omp parallel for schedule(static) reduction(max:maxr)
+		for (int s=0;s<N;s++){
+			const struct reb_particle p = particles[xv[s].pt];
+			xv[s].x = reb_collision_sweep_component(axis, p.x, p.y, p.z);
+			if (p.r>maxr) maxr = p.r;
+		}
+		// Particles moved only a little since the last timestep. Update the order in place.
+		int nstrips = 1;
+#ifdef OPENMP
+		nstrips = omp_get_max_threads();
+		if (nstrips>N) nstrips = N;
+#endif // OPENMP
+		int sorted = 1;
+#pragma omp parallel for schedule(static,1) reduction(&:sorted)
+		for (int k=0;k<nstrips;k++){
+			const int s0 = (int)((long)N*k/nstrips);
+			const int s1 = (int)((long)N*(k+1)/nstrips);
+			sorted &= reb_collision_sweep_insertionsort(xv+s0, s1-s0, 32L*(s1-s0));
+		}
+		if (sorted && nstrips>1){
+			// Only particles near the strip boundaries are moved.
+			sorted = reb_collision_sweep_insertionsort(xv, N, 32L*N);
+		}
+		rebuild = !sorted;
+	}
+	if (rebuild){
+		qsort(xv, N, sizeof(struct reb_collision_sweep_xvalue), reb_collision_sweep_compare);
+	}
+	r->collision_sweep_N = N;
+	if (maxr<=0.){
+		return 0;
+	}
+
+	// Ghost boxes, but only the inner most ring, ordered by their shift along the sweep axis.
+	int nghostxcol = (r->nghostx>1?1:r->nghostx);
+	int nghostycol = (r->nghosty>1?1:r->nghosty);
+	int nghostzcol = (r->nghostz>1?1:r->nghostz);
+	const int nimg = (2*nghostxcol+1)*(2*nghostycol+1)*(2*nghostzcol+1);
+	struct reb_ghostbox* const gbunmods = malloc(sizeof(struct reb_ghostbox)*nimg);
+	double* const gbshift = malloc(sizeof(double)*nimg);
+	{
+		int k = 0;
+		for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
+		for (int gby=-nghostycol; gby<=nghostycol; gby++){
+		for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
+			const struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+			const double shift = reb_collision_sweep_component(axis, gb.shiftx, gb.shifty, gb.shiftz);
+			int l = k;
+			while (l>0 && gbshift[l-1]>shift){
+				gbunmods[l] = gbunmods[l-1];
+				gbshift[l] = gbshift[l-1];
+				l--;
+			}
+			gbunmods[l] = gb;
+			gbshift[l] = shift;
+			k++;
+		}
+		}
+		}
+	}
+	const double xlo = xv[0].x;
+	const double xhi = xv[N-1].x;
+	reb_collision_buffers_reset(r);
+#pragma omp parallel for schedule(static)
+	for (int s1=0;s1<N;s1++){
+		const int i = xv[s1].pt;
+		const struct reb_particle p1 = particles[i];
+		const double w = p1.r + maxr;
+		// Images with the same shift along the sweep axis share one window.
+		for (int k0=0;k0<nimg;){
+			int k1 = k0+1;
+			while (k1<nimg && gbshift[k1]==gbshift[k0]) k1++;
+			const double x = xv[s1].x + gbshift[k0];
+			if (x+w<xlo || x-w>xhi){
+				k0 = k1;
+				continue;
+			}
+			// First particle in window.
+			int s2;
+			if (gbshift[k0]==0.){
+				s2 = s1;
+				while (s2>0 && xv[s2-1].x>=x-w) s2--;
+			}else{
+				int lo = 0;
+				int hi = N;
+				while (lo<hi){
+					const int mid = (lo+hi)/2;
+					if (xv[mid].x<x-w){
+						lo = mid+1;
+					}else{
+						hi = mid;
+					}
+				}
+				s2 = lo;
+			}
+			for (;s2<N && xv[s2].x<=x+w;s2++){
+				const int j = xv[s2].pt;
+				const struct reb_particle p2 = particles[j];
+				const double rp = p1.r + p2.r;
+				for (int k=k0;k<k1;k++){
+					const struct reb_ghostbox gb = gbunmods[k];
+					// Do not collide particle with itself.
+					if (i==j && gb.shiftx==0. && gb.shifty==0. && gb.shiftz==0.) continue;
+					const double rx = p1.x + gb.shiftx - p2.x;
+					const double ry = p1.y + gb.shifty - p2.y;
+					const double rz = p1.z + gb.shiftz - p2.z;
+					// reb_particles are not overlapping 
+					if (rx*rx + ry*ry + rz*rz > rp*rp) continue;
+					const double vx = p1.vx + gb.shiftvx - p2.vx;
+					const double vy = p1.vy + gb.shiftvy - p2.vy;
+					const double vz = p1.vz + gb.shiftvz - p2.vz;
+					// reb_particles are not approaching each other
+					if (vx*rx + vy*ry + vz*rz >0) continue;
+					const struct reb_collision c = {.p1 = i, .p2 = j, .gb = gb, .ri = 0};
+					reb_collision_buffer_add(r, c);
+				}
+			}
+			k0 = k1;
+		}
+	}
+	free(gbunmods);
+	free(gbshift);
+	return reb_collision_buffers_merge(r, &r->collisions, &r->collisions_allocatedN);
+}
 
 void reb_collision_search(struct reb_simulation* const r){
 	const int N = r->N;
@@ -108,6 +651,13 @@ void reb_collision_search(struct reb_simulation* const r){
 		break;
 		case REB_COLLISION_TREE:
 		{
+#ifndef MPI
+			if (r->collisions_fused_N>=0){
+				// Candidates have been recorded during the gravity walk of this step.
+				collisions_N = reb_collision_search_fused(r);
+				break;
+			}
+#endif // MPI
 			// Update and simplify tree. 
 			// Prepare particles for distribution to other nodes. 
 			reb_tree_update(r);          
@@ -123,12 +673,25 @@ void reb_collision_search(struct reb_simulation* const r){
 			reb_communication_mpi_distribute_essential_tree_for_collisions(r);
 #endif // MPI
 
-			// Loop over ghost boxes, but only the inner most ring.
+			// Ghost boxes, but only the inner most ring.
 			int nghostxcol = (r->nghostx>1?1:r->nghostx);
 			int nghostycol = (r->nghosty>1?1:r->nghosty);
 			int nghostzcol = (r->nghostz>1?1:r->nghostz);
+			const int nimg = (2*nghostxcol+1)*(2*nghostycol+1)*(2*nghostzcol+1);
+			struct reb_ghostbox* const gbunmods = malloc(sizeof(struct reb_ghostbox)*nimg);
+			{
+				int k = 0;
+				for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
+				for (int gby=-nghostycol; gby<=nghostycol; gby++){
+				for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
+					gbunmods[k++] = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+				}
+				}
+				}
+			}
 			const struct reb_particle* const particles = r->particles;
 			const int N = r->N;
+			reb_collision_buffers_reset(r);
 			// Loop over all particles
 #pragma omp parallel for schedule(guided)
 			for (int i=0;i<N;i++){
@@ -138,34 +701,46 @@ void reb_collision_search(struct reb_simulation* const r){
 				collision_nearest.p2 = -1;
 				double p1_r = p1.r;
 				double nearest_r2 = r->boxsize_max*r->boxsize_max/4.;
-				// Loop over ghost boxes.
-				for (int gbx=-nghostxcol; gbx<=nghostxcol; gbx++){
-				for (int gby=-nghostycol; gby<=nghostycol; gby++){
-				for (int gbz=-nghostzcol; gbz<=nghostzcol; gbz++){
-					// Calculated shifted position (for speedup). 
-					struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-					struct reb_ghostbox gbunmod = gb;
-					gb.shiftx += p1.x; 
-					gb.shifty += p1.y; 
-					gb.shiftz += p1.z; 
-					gb.shiftvx += p1.vx; 
-					gb.shiftvy += p1.vy; 
-					gb.shiftvz += p1.vz; 
-					// Loop over all root boxes.
+				struct reb_ghostbox gbs[REB_TREE_IMAGES_MAX];
+				int act[REB_TREE_IMAGES_MAX];
+				for (int k0=0;k0<nimg;k0+=REB_TREE_IMAGES_MAX){
+					const int n = nimg-k0<REB_TREE_IMAGES_MAX?nimg-k0:REB_TREE_IMAGES_MAX;
+					// Calculated shifted positions of the images (for speedup). 
+					for (int k=0;k<n;k++){
+						gbs[k] = gbunmods[k0+k];
+						gbs[k].shiftx += p1.x; 
+						gbs[k].shifty += p1.y; 
+						gbs[k].shiftz += p1.z; 
+						gbs[k].shiftvx += p1.vx; 
+						gbs[k].shiftvy += p1.vy; 
+						gbs[k].shiftvz += p1.vz; 
+						act[k] = k;
+					}
+					// Loop over all root boxes. All images of the chunk are searched in one walk.
 					for (int ri=0;ri<r->root_n;ri++){
 						struct reb_treecell* rootcell = r->tree_root[ri];
 						if (rootcell!=NULL){
-							reb_tree_get_nearest_neighbour_in_cell(r, &collisions_N, gb, gbunmod,ri,p1_r,&nearest_r2,&collision_nearest,rootcell);
+							reb_tree_get_nearest_neighbour_in_cell_images(r, gbs, gbunmods+k0, act, n, ri,p1_r,&nearest_r2,&collision_nearest,rootcell);
 						}
 					}
 				}
-				}
-				}
-				// Continue if no collision was found
-				if (collision_nearest.p2==-1) continue;
 			}
+			free(gbunmods);
+			collisions_N = reb_collision_buffers_merge(r, &r->collisions, &r->collisions_allocatedN);
 		}
 		break;
+		case REB_COLLISION_GRID:
+#ifdef MPI
+			reb_exit("REB_COLLISION_GRID is not supported with MPI.");
+#endif // MPI
+			collisions_N = reb_collision_search_grid(r);
+		break;
+		case REB_COLLISION_SWEEP:
+#ifdef MPI
+			reb_exit("REB_COLLISION_SWEEP is not supported with MPI.");
+#endif // MPI
+			collisions_N = reb_collision_search_sweep(r);
+		break;
 		default:
 			reb_exit("Collision routine not implemented.");
 	}
@@ -184,56 +759,47 @@ void reb_collision_search(struct reb_simulation* const r){
 		// Default is hard sphere
 		resolve = reb_collision_resolve_hardsphere;
 	}
+#if defined(OPENMP) && !defined(MPI)
+	if (resolve==reb_collision_resolve_hardsphere && r->coefficient_of_restitution==NULL && collisions_N>1 && omp_get_max_threads()>1){
+		// Hard sphere collisions never remove particles and can be resolved in independent batches.
+		// A coefficient_of_restitution callback might not be thread-safe, collisions are then resolved one by one.
+		reb_collision_resolve_hardsphere_batches(r, collisions_N);
+		return;
+	}
+#endif // OPENMP && !MPI
+	// Particles are only marked during the loop, so indices stay valid and are removed in one pass afterwards.
+	int keepsorted = 1;
+	if (r->tree_root){
+		keepsorted = 0;
+	}
 	for (int i=0;i<collisions_N;i++){
-        
-        struct reb_collision c = r->collisions[i];
-        if (c.p1 != -1 && c.p2 != -1){
-            
-            // Resolve collision
-            int outcome = resolve(r, c);
-            
-            // Remove particles
-            int shift_pos = 0;
-            int keepsorted = 1;
-            if (r->tree_root){
-                keepsorted = 0;
-            }
-            if (outcome & 1){
-                // Remove p1
-                if (keepsorted==0){
-                    if (c.p2==r->N-1){
-                        shift_pos = -c.p2+c.p1;
-                    }
-                }else{
-                    if (c.p1<c.p2){
-                        shift_pos = -1;
-                    }
-                }
-                reb_remove(r,c.p1,keepsorted);
-                // Check for pair
-                for (int j=i+1;j<collisions_N;j++){
-                    struct reb_collision cp = r->collisions[j];
-                    if (cp.p1==c.p1 || cp.p2==c.p1){
-                        r->collisions[j].p1 = -1;
-                        r->collisions[j].p2 = -1;
-                        // Will be skipped.
-                    }
-                }
-            }
-            if (outcome & 2){
-                // Remove p2
-                reb_remove(r,c.p2+shift_pos,keepsorted);
-                // Check for pair
-                for (int j=i+1;j<collisions_N;j++){
-                    struct reb_collision cp = r->collisions[j];
-                    if (cp.p1==c.p2 || cp.p2==c.p2){
-                        r->collisions[j].p1 = -1;
-                        r->collisions[j].p2 = -1;
-                        // Will be skipped.
-                    }
-                }
-            }
-        }
+		const struct reb_collision c = r->collisions[i];
+		if (c.p1 == -1 || c.p2 == -1) continue;
+		// Skip collisions with particles which have been removed.
+		if (r->removed_N && (r->removed[c.p1] || r->removed[c.p2])) continue;
+		// Resolve collision
+		const int outcome = resolve(r, c);
+		// Remove particles
+		if (outcome & 1){
+			reb_remove_mark(r, c.p1);
+		}
+		if (outcome & 2){
+			reb_remove_mark(r, c.p2);
+		}
+	}
+	if (reb_remove_marked(r, keepsorted)){
+		// Translate remaining collisions to the new particle indices.
+		const int* const map = r->removed_map;
+		for (int i=0;i<collisions_N;i++){
+			struct reb_collision* const c = &(r->collisions[i]);
+			if (c->p1 == -1 || c->p2 == -1) continue;
+			c->p1 = map[c->p1];
+			c->p2 = map[c->p2];
+			if (c->p1 == -1 || c->p2 == -1){
+				c->p1 = -1;
+				c->p2 = -1;
+			}
+		}
 	}
 }
 
@@ -256,10 +822,9 @@ void reb_set_collision_resolve(struct reb_simulation* r, int (*resolve) (struct
  * @param nearest_r2 Pointer to the nearest neighbour found so far.
  * @param collision_nearest Pointer to the nearest collision found so far.
  * @param c Pointer to the cell currently being searched in.
- * @param collisions_N Pointer to current number of collisions
  * @param gbunmod Ghostbox unmodified
  */
-static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, int* collisions_N, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c){
+static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const r, struct reb_ghostbox gb, struct reb_ghostbox gbunmod, int ri, double p1_r, double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c){
 	const struct reb_particle* const particles = r->particles;
 	if (c->pt>=0){ 	
 		// c is a leaf node
@@ -312,16 +877,8 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
 			collision_nearest->ri = ri;
 			collision_nearest->p2 = c->pt;
 			collision_nearest->gb = gbunmod;
-			// Save collision in collisions array.
-#pragma omp critical
-			{
-				if (r->collisions_allocatedN<=(*collisions_N)){
-					r->collisions_allocatedN += 32;
-					r->collisions = realloc(r->collisions,sizeof(struct reb_collision)*r->collisions_allocatedN);
-				}
-				r->collisions[(*collisions_N)] = *collision_nearest;
-				(*collisions_N)++;
-			}
+			// Save collision in the buffer of this thread.
+			reb_collision_buffer_add(r, *collision_nearest);
 		}
 	}else{		
 		// c is not a leaf node
@@ -335,7 +892,7 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
 			for (int o=0;o<8;o++){
 				struct reb_treecell* d = c->oct[o];
 				if (d!=NULL){
-					reb_tree_get_nearest_neighbour_in_cell(r, collisions_N, gb,gbunmod,ri,p1_r,nearest_r2,collision_nearest,d);
+					reb_tree_get_nearest_neighbour_in_cell(r, gb,gbunmod,ri,p1_r,nearest_r2,collision_nearest,d);
 				}
 			}
 		}
@@ -343,7 +900,61 @@ static void reb_tree_get_nearest_neighbour_in_cell(struct reb_simulation* const
 }
 
 
-int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_collision c){
+/**
+ * @brief Find the nearest neighbour in a cell or its daughters for several images of a particle.
+ * @details Instead of walking the tree once per ghost box, every cell is tested against
+ * all images which still need it. Images for which the cell is too far away are dropped.
+ * Once only a single image remains (or a leaf is reached), the search continues with 
+ * reb_tree_get_nearest_neighbour_in_cell().
+ * @param r REBOUND simulation to work on.
+ * @param gbs (Shifted) positions and velocities of all images of the particle.
+ * @param gbunmods Ghostboxes unmodified
+ * @param act Indices of the images for which this cell needs to be searched.
+ * @param nact Number of images for which this cell needs to be searched.
+ * @param ri Index of the root box currently being searched in.
+ * @param p1_r Radius of the particle (this is not in gbs).
+ * @param nearest_r2 Pointer to the nearest neighbour found so far.
+ * @param collision_nearest Pointer to the nearest collision found so far.
+ * @param c Pointer to the cell currently being searched in.
+ */
+static void reb_tree_get_nearest_neighbour_in_cell_images(struct reb_simulation* const r, const struct reb_ghostbox* const gbs, const struct reb_ghostbox* const gbunmods, const int* const act, const int nact, int ri, double p1_r, double* nearest_r2, struct reb_collision* collision_nearest, struct reb_treecell* c){
+	if (nact==1 || c->pt>=0){
+		for (int k=0;k<nact;k++){
+			reb_tree_get_nearest_neighbour_in_cell(r, gbs[act[k]], gbunmods[act[k]], ri, p1_r, nearest_r2, collision_nearest, c);
+		}
+		return;
+	}
+	// Images which need to decent into daughter cells
+	double rp  = p1_r + r->max_radius[1] + 0.86602540378443*c->w;
+	int open[REB_TREE_IMAGES_MAX];
+	int nopen = 0;
+	for (int k=0;k<nact;k++){
+		const struct reb_ghostbox* const gb = &gbs[act[k]];
+		double dx = gb->shiftx - c->x;
+		double dy = gb->shifty - c->y;
+		double dz = gb->shiftz - c->z;
+		double r2 = dx*dx + dy*dy + dz*dz;
+		if (r2 < rp*rp ){
+			open[nopen++] = act[k];
+		}
+	}
+	if (nopen==0) return;
+	for (int o=0;o<8;o++){
+		struct reb_treecell* d = c->oct[o];
+		if (d!=NULL){
+			reb_tree_get_nearest_neighbour_in_cell_images(r, gbs, gbunmods, open, nopen, ri, p1_r, nearest_r2, collision_nearest, d);
+		}
+	}
+}
+
+/**
+ * @brief Applies the velocity changes of a hard sphere collision to both particles.
+ * @param r REBOUND simulation to work on.
+ * @param c Collision to resolve.
+ * @param dplog Momentum exchange of this collision (see collisions_plog).
+ * @return 1 if the particles bounced, 0 if they are not overlapping or not approaching.
+ */
+static int reb_collision_hardsphere_bounce(struct reb_simulation* const r, const struct reb_collision c, double* const dplog){
 	struct reb_particle* const particles = r->particles;
 	struct reb_particle p1 = particles[c.p1];
 	struct reb_particle p2;
@@ -430,14 +1041,111 @@ int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_
 		
 	// Return y-momentum change
 	if (x21>0){
-		r->collisions_plog += -fabs(x21)*(oldvyouter-particles[c.p1].vy) * p1.m;
-		r->collisions_Nlog ++;
+		*dplog = -fabs(x21)*(oldvyouter-particles[c.p1].vy) * p1.m;
 	}else{
-		r->collisions_plog += -fabs(x21)*(oldvyouter-particles[c.p2].vy) * p2.m;
+		*dplog = -fabs(x21)*(oldvyouter-particles[c.p2].vy) * p2.m;
+	}
+	return 1;
+}
+
+int reb_collision_resolve_hardsphere(struct reb_simulation* const r, struct reb_collision c){
+	double dplog;
+	if (reb_collision_hardsphere_bounce(r, c, &dplog)){
+		r->collisions_plog += dplog;
 		r->collisions_Nlog ++;
 	}
-    return 0;
+	return 0;
+}
+
+#if defined(OPENMP) && !defined(MPI)
+/**
+ * @brief Resolves hard sphere collisions in parallel.
+ * @details The collisions are grouped into batches in which no particle appears twice.
+ * Every collision goes into the batch after the last one containing one of its particles.
+ * The batches are resolved one after another, the collisions within a batch in parallel. 
+ * The result is bit-identical to resolving the collisions one by one in the order 
+ * of r->collisions. The momentum exchange is also summed in this order. Not used if 
+ * a coefficient_of_restitution callback is set, because it would be called from several threads.
+ * @param r REBOUND simulation to work on.
+ * @param collisions_N Number of collisions in r->collisions.
+ */
+static void reb_collision_resolve_hardsphere_batches(struct reb_simulation* const r, const int collisions_N){
+	const int N = r->N;
+	if (r->collision_batch_last_allocatedN<N){
+		r->collision_batch_last = realloc(r->collision_batch_last, sizeof(int)*N);
+		r->collision_batch_last_allocatedN = N;
+		for (int i=0;i<N;i++){
+			r->collision_batch_last[i] = 0;
+		}
+	}
+	if (r->collision_batch_allocatedN<collisions_N){
+		r->collision_batch = realloc(r->collision_batch, sizeof(int)*collisions_N);
+		r->collision_batch_order = realloc(r->collision_batch_order, sizeof(int)*collisions_N);
+		r->collision_batch_start = realloc(r->collision_batch_start, sizeof(int)*(collisions_N+1));
+		r->collision_batch_plog = realloc(r->collision_batch_plog, sizeof(double)*collisions_N);
+		r->collision_batch_allocatedN = collisions_N;
+	}
+	const struct reb_collision* const collisions = r->collisions;
+	int* const last = r->collision_batch_last;
+	int* const batch = r->collision_batch;
+	int* const order = r->collision_batch_order;
+	int* const start = r->collision_batch_start;
+	double* const plog = r->collision_batch_plog;
+
+	// Assign batches. last[i] is one more than the last batch containing particle i.
+	int nbatches = 0;
+	for (int k=0;k<collisions_N;k++){
+		const struct reb_collision c = collisions[k];
+		const int b = last[c.p1]>last[c.p2]?last[c.p1]:last[c.p2];
+		batch[k] = b;
+		last[c.p1] = b+1;
+		last[c.p2] = b+1;
+		if (b+1>nbatches){
+			nbatches = b+1;
+		}
+	}
+	for (int k=0;k<collisions_N;k++){
+		last[collisions[k].p1] = 0;
+		last[collisions[k].p2] = 0;
+	}
+	// Sort collisions by batch.
+	for (int b=0;b<=nbatches;b++){
+		start[b] = 0;
+	}
+	for (int k=0;k<collisions_N;k++){
+		start[batch[k]+1]++;
+	}
+	for (int b=0;b<nbatches;b++){
+		start[b+1] += start[b];
+	}
+	for (int k=0;k<collisions_N;k++){
+		// start[batch] is used as insertion point and restored below.
+		order[start[batch[k]]++] = k;
+	}
+	for (int b=nbatches;b>0;b--){
+		start[b] = start[b-1];
+	}
+	start[0] = 0;
+
+#pragma omp parallel
+	for (int b=0;b<nbatches;b++){
+#pragma omp for schedule(static)
+		for (int s=start[b];s<start[b+1];s++){
+			const int k = order[s];
+			if (!reb_collision_hardsphere_bounce(r, collisions[k], &plog[k])){
+				// Particles did not bounce.
+				plog[k] = NAN;
+			}
+		}
+	}
+	for (int k=0;k<collisions_N;k++){
+		if (!isnan(plog[k])){
+			r->collisions_plog += plog[k];
+			r->collisions_Nlog ++;
+		}
+	}
 }
+#endif // OPENMP && !MPI
 
 
 int reb_collision_resolve_merge(struct reb_simulation* const r, struct reb_collision c){
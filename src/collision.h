@@ -24,9 +24,34 @@
  */
 #ifndef _COLLISIONS_H
 #define _COLLISIONS_H
+struct reb_simulation;
+struct reb_collision;
 /**
  * @brief Search for collisions and resolve them.
  */
 void reb_collision_search(struct reb_simulation* const r);
 
+/**
+ * @brief Empties the per-thread collision buffers before a parallel search.
+ * @details Allocates one buffer per OpenMP thread if needed.
+ */
+void reb_collision_buffers_reset(struct reb_simulation* const r);
+
+/**
+ * @brief Adds a collision to the buffer of the calling thread.
+ * @details Can be called from within a parallel region without locking.
+ */
+void reb_collision_buffer_add(struct reb_simulation* const r, const struct reb_collision c);
+
+/**
+ * @brief Merges the per-thread collision buffers into one array.
+ * @details The merged array is sorted by particle indices and ghost box, so 
+ * that it does not depend on the number of threads. The buffers are emptied.
+ * @param r REBOUND simulation to work on.
+ * @param collisions Pointer to the array to merge into (reallocated if needed).
+ * @param allocatedN Pointer to the size allocated for the array.
+ * @return Number of collisions.
+ */
+int reb_collision_buffers_merge(struct reb_simulation* const r, struct reb_collision** const collisions, int* const allocatedN);
+
 #endif // _COLLISIONS_H
@@ -38,6 +38,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 #include "particle.h"
@@ -46,6 +47,14 @@
 #include "boundary.h"
 #include "communication_mpi.h"
 
+/**
+ * @brief Returns a pointer to the i-th cell in a send or receive buffer.
+ * @details Cells have a variable size which depends on the multipole order, see reb_tree_cell_size().
+ */
+static struct reb_treecell* reb_communication_mpi_cell(const struct reb_simulation* const r, struct reb_treecell* const buffer, const int i){
+	return (struct reb_treecell*)((char*)buffer + i*reb_tree_cell_size(r));
+}
+
 void reb_communication_mpi_init(struct reb_simulation* const r, int argc, char** argv){
 	MPI_Init(&argc,&argv);
 	MPI_Comm_size(MPI_COMM_WORLD,&(r->mpi_num));
@@ -94,13 +103,12 @@ void reb_communication_mpi_init(struct reb_simulation* const r, int argc, char**
 	MPI_Type_commit(&(r->mpi_particle)); 
 
 	// Setup MPI description of the cell structure 
+	// The size of a cell depends on the multipole order which needs to be set before calling this function.
+	r->tree_multipole_N = reb_tree_multipole_components(r->tree_multipole_order);
 	struct reb_treecell c;
 	bnum = 0;
     {
         blen[bnum] 	= 8; 
-#ifdef QUADRUPOLE
-        blen[bnum] 	+= 6;
-#endif // QUADRUPOLE
         indices[bnum] 	= 0; 
         oldtypes[bnum] 	= MPI_DOUBLE;
     }
@@ -117,9 +125,15 @@ void reb_communication_mpi_init(struct reb_simulation* const r, int argc, char**
         oldtypes[bnum] 	= MPI_INT;
     }
 	bnum++;
+    if (r->tree_multipole_N>0){
+        blen[bnum] 	= r->tree_multipole_N; 
+        indices[bnum] 	= (char*)&c.mp - (char*)&c; 
+        oldtypes[bnum] 	= MPI_DOUBLE;
+	    bnum++;
+    }
     {
         blen[bnum] 	= 1; 
-        indices[bnum] 	= sizeof(struct reb_treecell); 
+        indices[bnum] 	= reb_tree_cell_size(r); 
         oldtypes[bnum] 	= MPI_UB;
     }
 	bnum++;
@@ -297,10 +311,10 @@ void reb_communication_mpi_prepare_essential_cell_for_collisions_for_proc(struct
 	// Add essential cell to tree_essential_send
 	if (r->tree_essential_send_N[proc]>=r->tree_essential_send_Nmax[proc]){
 		r->tree_essential_send_Nmax[proc] += 32;
-		r->tree_essential_send[proc] = realloc(r->tree_essential_send[proc],sizeof(struct reb_treecell)*r->tree_essential_send_Nmax[proc]);
+		r->tree_essential_send[proc] = realloc(r->tree_essential_send[proc],reb_tree_cell_size(r)*r->tree_essential_send_Nmax[proc]);
 	}
 	// Copy node to send buffer
-	r->tree_essential_send[proc][r->tree_essential_send_N[proc]] = (*node);
+	memcpy(reb_communication_mpi_cell(r, r->tree_essential_send[proc], r->tree_essential_send_N[proc]), node, reb_tree_cell_size(r));
 	r->tree_essential_send_N[proc]++;
 	if (node->pt>=0){ // Is leaf
 		// Also transmit particle (Here could be another check if the particle actually overlaps with the other box)
@@ -311,7 +325,7 @@ void reb_communication_mpi_prepare_essential_cell_for_collisions_for_proc(struct
 		// Copy particle to send buffer
 		r->particles_send[proc][r->particles_send_N[proc]] = r->particles[node->pt];
 		// Update reference from cell to particle
-		r->tree_essential_send[proc][r->tree_essential_send_N[proc]-1].pt = r->particles_send_N[proc];
+		reb_communication_mpi_cell(r, r->tree_essential_send[proc], r->tree_essential_send_N[proc]-1)->pt = r->particles_send_N[proc];
 		r->particles_send_N[proc]++;
 	}else{		// Not a leaf. Check if we need to transfer daughters.
 		double distance2 = reb_communication_distance2_of_proc_to_node(r, proc,node);
@@ -339,10 +353,10 @@ void reb_communication_mpi_prepare_essential_cell_for_gravity_for_proc(struct re
 	// Add essential cell to tree_essential_send
 	if (r->tree_essential_send_N[proc]>=r->tree_essential_send_Nmax[proc]){
 		r->tree_essential_send_Nmax[proc] += 32;
-		r->tree_essential_send[proc] = realloc(r->tree_essential_send[proc],sizeof(struct reb_treecell)*r->tree_essential_send_Nmax[proc]);
+		r->tree_essential_send[proc] = realloc(r->tree_essential_send[proc],reb_tree_cell_size(r)*r->tree_essential_send_Nmax[proc]);
 	}
 	// Copy node to send buffer
-	r->tree_essential_send[proc][r->tree_essential_send_N[proc]] = (*node);
+	memcpy(reb_communication_mpi_cell(r, r->tree_essential_send[proc], r->tree_essential_send_N[proc]), node, reb_tree_cell_size(r));
 	r->tree_essential_send_N[proc]++;
 	if (node->pt<0){		// Not a leaf. Check if we need to transfer daughters.
 		double width = node->w;
@@ -381,7 +395,7 @@ void reb_communication_mpi_distribute_essential_tree_for_gravity(struct reb_simu
 		if  (i==r->mpi_id) continue;
 		while (r->tree_essential_recv_Nmax[i]<r->tree_essential_recv_N[i]){
 			r->tree_essential_recv_Nmax[i] += 32;
-			r->tree_essential_recv[i] = realloc(r->tree_essential_recv[i],sizeof(struct reb_treecell)*r->tree_essential_recv_Nmax[i]);
+			r->tree_essential_recv[i] = realloc(r->tree_essential_recv[i],reb_tree_cell_size(r)*r->tree_essential_recv_Nmax[i]);
 		}
 	}
 	
@@ -410,7 +424,7 @@ void reb_communication_mpi_distribute_essential_tree_for_gravity(struct reb_simu
 	for (int i=0;i<r->mpi_num;i++){
 		if (i==r->mpi_id) continue;
 		for (int j=0;j<r->tree_essential_recv_N[i];j++){
-			reb_tree_add_essential_node(r, &(r->tree_essential_recv[i][j]));
+			reb_tree_add_essential_node(r, reb_communication_mpi_cell(r, r->tree_essential_recv[i], j));
 		}
 	}
 	// Bring everybody into sync, clean up. 
@@ -435,7 +449,7 @@ void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_s
 		if  (i==r->mpi_id) continue;
 		while (r->tree_essential_recv_Nmax[i]<r->tree_essential_recv_N[i]){
 			r->tree_essential_recv_Nmax[i] += 32;
-			r->tree_essential_recv[i] = realloc(r->tree_essential_recv[i],sizeof(struct reb_treecell)*r->tree_essential_recv_Nmax[i]);
+			r->tree_essential_recv[i] = realloc(r->tree_essential_recv[i],reb_tree_cell_size(r)*r->tree_essential_recv_Nmax[i]);
 		}
 	}
 
@@ -463,7 +477,7 @@ void reb_communication_mpi_distribute_essential_tree_for_collisions(struct reb_s
 	// Add tree_essential to local tree
 	for (int i=0;i<r->mpi_num;i++){
 		for (int j=0;j<r->tree_essential_recv_N[i];j++){
-			reb_tree_add_essential_node(r, &(r->tree_essential_recv[i][j]));
+			reb_tree_add_essential_node(r, reb_communication_mpi_cell(r, r->tree_essential_recv[i], j));
 		}
 	}
 	// Bring everybody into sync, clean up. 
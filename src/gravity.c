@@ -31,6 +31,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
@@ -38,18 +39,597 @@
 #include "rebound.h"
 #include "tree.h"
 #include "boundary.h"
+#include "gravity.h"
+#include "collision.h"
+#include "gravity_fmm.h"
+#include "gravity_pm.h"
 
 #ifdef MPI
 #include "communication_mpi.h"
 #endif
+#ifdef OPENMP
+#include <omp.h>
+#endif
+#define MIN(a, b) ((a) > (b) ? (b) : (a))	///< Returns the minimum of a and b
 
 /**
-  * @brief The function loops over all trees to call calculate_forces_for_particle_from_cell() tree to calculate forces for each particle.
+  * @brief The function loops over all trees to call calculate_forces_for_particle_from_cell_images() tree to calculate forces for each particle.
+  * @details All ghost boxes are handled in a single walk of the tree.
   * @param r REBOUND simulation to consider
   * @param pt Index of the particle the force is calculated for.
-  * @param gb Ghostbox plus position of the particle (precalculated). 
+  * @param gbs Ghostboxes (unshifted).
+  * @param nimg Number of ghostboxes.
+  * @param rmargin Distance added to the particle radius for collision candidates, negative if no candidates are recorded.
+  */
+static void reb_calculate_acceleration_for_particle(struct reb_simulation* const r, const int pt, const struct reb_ghostbox* const gbs, const int nimg, const double rmargin);
+
+/**
+  * @brief Calculates the acceleration of all particles with one tree walk per group of particles.
+  * @details Used by REB_GRAVITY_TREE if tree_group_size is larger than 0. The tree is walked once
+  * per group and ghostbox. The accepted cells and particles are stored in interaction lists, 
+  * which are then evaluated for all particles of the group.
+  * @param r REBOUND simulation to consider
+  */
+static void reb_calculate_acceleration_tree_groups(struct reb_simulation* const r);
+
+/**
+  * @brief Calculates the Ewald correction table if it does not exist or the box size has changed.
+  * @param r REBOUND simulation to consider
+  */
+static void reb_gravity_ewald_table_init(struct reb_simulation* const r);
+
+/**
+  * @brief Calculates the acceleration of all particles with direct summation and Ewald summation.
+  * @details Used by REB_GRAVITY_BASIC if gravity_ewald is set. Every pair interacts once via 
+  * the nearest image plus the tabulated correction for all other periodic images.
+  * @param r REBOUND simulation to consider
+  */
+static void reb_calculate_acceleration_ewald_basic(struct reb_simulation* const r, const int _N_start, const int _N_active, const int _N_real);
+
+/**
+  * @brief Calculates the acceleration of all particles with the tree code and Ewald summation.
+  * @details Used by REB_GRAVITY_TREE if gravity_ewald is set. The tree is walked once per particle 
+  * using the nearest image of every cell. Accepted cells and particles get the tabulated correction 
+  * for all other periodic images (monopole only).
+  * @param r REBOUND simulation to consider
   */
-static void reb_calculate_acceleration_for_particle(const struct reb_simulation* const r, const int pt, const struct reb_ghostbox gb);
+static void reb_calculate_acceleration_ewald_tree(struct reb_simulation* const r);
+
+/**
+ * @brief Cache sizes (in bytes) assumed if they cannot be queried at runtime.
+ */
+#define REB_GRAVITY_L1_DEFAULT (32*1024)
+#define REB_GRAVITY_L2_DEFAULT (256*1024)
+
+/**
+ * @brief Tile sizes used by the BASIC kernels.
+ * @details Tiles are chosen such that the data of one tile uses at most half of 
+ * the corresponding cache, leaving room for the other operand. The cache sizes are 
+ * queried only once.
+ * @param ti On return, the number of targets per tile (L1 resident, 6 doubles each). 
+ * @param tj On return, the number of sources per tile (L2 resident, 4 doubles each). 
+ * @param tp On return, the block size used by the symmetric pair loop (L1 resident, 7 doubles each).
+ */
+static void reb_gravity_tile_sizes(int* const ti, int* const tj, int* const tp){
+	static int _ti = 0, _tj = 0, _tp = 0;
+	if (_ti==0){
+		long l1 = 0, l2 = 0;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+		l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+#endif
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		if (l1<=0) l1 = REB_GRAVITY_L1_DEFAULT;
+		if (l2<=0) l2 = REB_GRAVITY_L2_DEFAULT;
+		if (l2<l1) l2 = l1;
+		const int t  = (int)(l1/2/(6*sizeof(double))) & ~7;
+		const int tt = (int)(l2/2/(4*sizeof(double))) & ~7;
+		const int tq = (int)(l1/2/(7*sizeof(double))) & ~7;
+		_tj = tt<256?256:tt;
+		_tp = tq<64?64:tq;
+		_ti = t<64?64:t; // Set last, marks the sizes as initialized.
+	}
+	*ti = _ti;
+	*tj = _tj;
+	*tp = _tp;
+}
+
+/**
+ * @brief Copies positions and masses into the aligned structure-of-arrays buffer.
+ * @details The buffer holds seven arrays of length gravity_soa_allocatedN: 
+ * x, y, z, m, ax, ay, az. Accelerations are set to zero.
+ * @param r REBOUND simulation to consider
+ * @param N Number of particles to stage.
+ */
+static void reb_gravity_soa_prepare(struct reb_simulation* const r, const int N){
+	if (r->gravity_soa_allocatedN<N){
+		free(r->gravity_soa);
+		// Pad every component to a multiple of 8 doubles (64 bytes).
+		const int Npad = (N+7)&~7;
+		if (posix_memalign((void**)&(r->gravity_soa), 64, 7*Npad*sizeof(double))){
+			reb_exit("Cannot allocate memory for gravity calculation.");
+		}
+		r->gravity_soa_allocatedN = Npad;
+	}
+	const int Npad = r->gravity_soa_allocatedN;
+	double* restrict const x  = r->gravity_soa;
+	double* restrict const y  = r->gravity_soa + Npad;
+	double* restrict const z  = r->gravity_soa + 2*Npad;
+	double* restrict const m  = r->gravity_soa + 3*Npad;
+	double* restrict const ax = r->gravity_soa + 4*Npad;
+	double* restrict const ay = r->gravity_soa + 5*Npad;
+	double* restrict const az = r->gravity_soa + 6*Npad;
+	const struct reb_particle* const particles = r->particles;
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<N; i++){
+		x[i]  = particles[i].x;
+		y[i]  = particles[i].y;
+		z[i]  = particles[i].z;
+		m[i]  = particles[i].m;
+		ax[i] = 0.;
+		ay[i] = 0.;
+		az[i] = 0.;
+	}
+}
+
+/**
+ * @brief Copies the accelerations from the structure-of-arrays buffer back into the particle array.
+ * @details Variational particles get zero acceleration. Test particles which were not 
+ * staged (testparticle_type 0) are left untouched, see reb_gravity_basic_testparticles().
+ * @param r REBOUND simulation to consider
+ * @param N Number of particles staged by reb_gravity_soa_prepare().
+ */
+static void reb_gravity_soa_finish(struct reb_simulation* const r, const int N){
+	const int Npad = r->gravity_soa_allocatedN;
+	const double* restrict const ax = r->gravity_soa + 4*Npad;
+	const double* restrict const ay = r->gravity_soa + 5*Npad;
+	const double* restrict const az = r->gravity_soa + 6*Npad;
+	struct reb_particle* const particles = r->particles;
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<N; i++){
+		particles[i].ax = ax[i];
+		particles[i].ay = ay[i];
+		particles[i].az = az[i];
+	}
+	for (int i=r->N-r->N_var; i<r->N; i++){
+		particles[i].ax = 0.;
+		particles[i].ay = 0.;
+		particles[i].az = 0.;
+	}
+}
+
+/**
+ * @brief Innermost loop of the BASIC gravity kernel.
+ * @details Adds the acceleration of one source to all targets with 
+ * index i0 <= i < i1. There are no branches in the loop body so that 
+ * the compiler can vectorize it. 
+ */
+static inline void reb_gravity_basic_kernel(const int i0, const int i1, const double* restrict const x, const double* restrict const y, const double* restrict const z, double* restrict const ax, double* restrict const ay, double* restrict const az, const double xj, const double yj, const double zj, const double Gmj, const double softening2){
+	for (int i=i0; i<i1; i++){
+		const double dx = x[i] - xj;
+		const double dy = y[i] - yj;
+		const double dz = z[i] - zj;
+		const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+		const double _r = sqrt(r2);
+		const double prefact = -Gmj/(r2*_r);
+		ax[i] += prefact*dx;
+		ay[i] += prefact*dy;
+		az[i] += prefact*dz;
+	}
+}
+
+#ifndef OPENMP
+/**
+ * @brief Sums up the acceleration of sources j0 <= j < j1 on targets i0 <= i < i1 in one ghostbox.
+ * @details Uses the structure-of-arrays buffer. Self-interactions and, if
+ * gravity_ignore_10 is set, interactions between particles 0 and 1 are skipped
+ * by splitting the target range rather than by a test in the innermost loop.
+ * The loops are tiled: one tile of sources stays in the L2 cache while all target
+ * tiles (L1 resident) are updated. For large N this avoids streaming 
+ * the whole particle array from memory once per target block.
+ */
+static void reb_gravity_basic_sum(struct reb_simulation* const r, const struct reb_ghostbox gb, const int i0, const int i1, const int j0, const int j1){
+	const int Npad = r->gravity_soa_allocatedN;
+	const double* restrict const x  = r->gravity_soa;
+	const double* restrict const y  = r->gravity_soa + Npad;
+	const double* restrict const z  = r->gravity_soa + 2*Npad;
+	const double* restrict const m  = r->gravity_soa + 3*Npad;
+	double* restrict const ax = r->gravity_soa + 4*Npad;
+	double* restrict const ay = r->gravity_soa + 5*Npad;
+	double* restrict const az = r->gravity_soa + 6*Npad;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const unsigned int _gravity_ignore_10 = r->gravity_ignore_10;
+	int ti, tj, tp;
+	reb_gravity_tile_sizes(&ti, &tj, &tp);
+	for (int jb=j0; jb<j1; jb+=tj){
+		const int je = (jb+tj<j1)?(jb+tj):j1;
+		for (int ib=i0; ib<i1; ib+=ti){
+			const int ie = (ib+ti<i1)?(ib+ti):i1;
+			for (int j=jb; j<je; j++){
+				// The ghostbox shift is applied to the source instead of the target.
+				const double xj = x[j] - gb.shiftx;
+				const double yj = y[j] - gb.shifty;
+				const double zj = z[j] - gb.shiftz;
+				const double Gmj = G*m[j];
+				// Targets to be skipped, in ascending order.
+				int skip[2] = {j, -1};
+				if (_gravity_ignore_10 && j<2){
+					skip[0] = 0;
+					skip[1] = 1;
+				}
+				int s = ib;
+				for (int k=0; k<2; k++){
+					if (skip[k]<s || skip[k]>=ie) continue;
+					reb_gravity_basic_kernel(s, skip[k], x, y, z, ax, ay, az, xj, yj, zj, Gmj, softening2);
+					s = skip[k]+1;
+				}
+				reb_gravity_basic_kernel(s, ie, x, y, z, ax, ay, az, xj, yj, zj, Gmj, softening2);
+			}
+		}
+	}
+}
+
+#endif // OPENMP
+
+/**
+ * @brief Number of test particles processed together by reb_gravity_basic_testparticles().
+ * @details The positions and accelerations of one chunk (6 doubles each) use 12kB and stay in the L1 cache.
+ */
+#define REB_GRAVITY_TESTPARTICLE_CHUNK 256
+
+/**
+ * @brief Acceleration of test particles (testparticle_type 0) due to the massive particles.
+ * @details All massive particles are staged once per call, with every ghostbox shift 
+ * already applied, in the small buffer gravity_sources (x, y, z, G*m). The test 
+ * particles are then streamed through in chunks: positions are gathered into local 
+ * arrays, all sources are applied with the branch-free kernel and the accelerations are 
+ * written back. The test particles are never copied into the structure-of-arrays buffer. 
+ * Chunks are distributed over OpenMP threads. The order of the additions is the same 
+ * as in reb_gravity_basic_sum().
+ * @param r REBOUND simulation to consider
+ * @param _N_start Index of the first massive particle.
+ * @param _N_active Index of the first test particle.
+ * @param _N_real Number of particles (without variational particles).
+ */
+static void reb_gravity_basic_testparticles(struct reb_simulation* const r, const int _N_start, const int _N_active, const int _N_real){
+	struct reb_particle* const particles = r->particles;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const int nghostx = r->nghostx;
+	const int nghosty = r->nghosty;
+	const int nghostz = r->nghostz;
+	const int Ns = (2*nghostx+1)*(2*nghosty+1)*(2*nghostz+1)*(_N_active-_N_start);
+	if (r->gravity_sources_allocatedN<Ns){
+		r->gravity_sources = realloc(r->gravity_sources, 4*Ns*sizeof(double));
+		r->gravity_sources_allocatedN = Ns;
+	}
+	double* restrict const sx  = r->gravity_sources;
+	double* restrict const sy  = r->gravity_sources + Ns;
+	double* restrict const sz  = r->gravity_sources + 2*Ns;
+	double* restrict const sGm = r->gravity_sources + 3*Ns;
+	int s = 0;
+	for (int gbx=-nghostx; gbx<=nghostx; gbx++){
+	for (int gby=-nghosty; gby<=nghosty; gby++){
+	for (int gbz=-nghostz; gbz<=nghostz; gbz++){
+		struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+		for (int j=_N_start; j<_N_active; j++){
+			sx[s]  = particles[j].x - gb.shiftx;
+			sy[s]  = particles[j].y - gb.shifty;
+			sz[s]  = particles[j].z - gb.shiftz;
+			sGm[s] = G*particles[j].m;
+			s++;
+		}
+	}
+	}
+	}
+	int i0 = _N_active;
+	if (r->gravity_ignore_10 && _N_start==0 && _N_active==1 && _N_real>1){
+		// Particle 1 is a test particle and particle 0 is the only source.
+		particles[1].ax = 0.;
+		particles[1].ay = 0.;
+		particles[1].az = 0.;
+		i0 = 2;
+	}
+#pragma omp parallel for schedule(static)
+	for (int ib=i0; ib<_N_real; ib+=REB_GRAVITY_TESTPARTICLE_CHUNK){
+		double x[REB_GRAVITY_TESTPARTICLE_CHUNK];
+		double y[REB_GRAVITY_TESTPARTICLE_CHUNK];
+		double z[REB_GRAVITY_TESTPARTICLE_CHUNK];
+		double ax[REB_GRAVITY_TESTPARTICLE_CHUNK];
+		double ay[REB_GRAVITY_TESTPARTICLE_CHUNK];
+		double az[REB_GRAVITY_TESTPARTICLE_CHUNK];
+		const int n = MIN(REB_GRAVITY_TESTPARTICLE_CHUNK, _N_real-ib);
+		for (int k=0; k<n; k++){
+			x[k]  = particles[ib+k].x;
+			y[k]  = particles[ib+k].y;
+			z[k]  = particles[ib+k].z;
+			ax[k] = 0.;
+			ay[k] = 0.;
+			az[k] = 0.;
+		}
+		for (int j=0; j<Ns; j++){
+			reb_gravity_basic_kernel(0, n, x, y, z, ax, ay, az, sx[j], sy[j], sz[j], sGm[j], softening2);
+		}
+		for (int k=0; k<n; k++){
+			particles[ib+k].ax = ax[k];
+			particles[ib+k].ay = ay[k];
+			particles[ib+k].az = az[k];
+		}
+	}
+}
+
+#ifdef OPENMP
+/**
+ * @brief Returns per-thread acceleration buffers.
+ * @details Each thread gets n arrays of length Npad, all set to zero.
+ * @param r REBOUND simulation to consider
+ * @param N Number of particles.
+ * @param n Number of arrays per thread.
+ * @param Npad On return, the padded array length.
+ * @return Pointer to the buffer. Thread t uses the arrays starting at t*n*Npad.
+ */
+static double* reb_gravity_omp_buffer(struct reb_simulation* const r, const int N, const int n, int* const Npad){
+	*Npad = (N+7)&~7;
+	const int size = omp_get_max_threads()*n*(*Npad);
+	if (r->gravity_omp_allocatedN<size){
+		r->gravity_omp = realloc(r->gravity_omp, size*sizeof(double));
+		r->gravity_omp_allocatedN = size;
+	}
+#pragma omp parallel for schedule(static)
+	for (int k=0; k<size; k++){
+		r->gravity_omp[k] = 0.;
+	}
+	return r->gravity_omp;
+}
+
+/**
+ * @brief Adds a value to a compensated sum.
+ * @details Same scheme as used in the serial REB_GRAVITY_COMPENSATED routine. 
+ * The sum is given by a-cs. 
+ */
+static inline void reb_gravity_kahan_add(double* const a, double* const cs, const double v){
+	const double y = v - *cs;
+	const double t = *a + y;
+	*cs = (t - *a) - y;
+	*a = t;
+}
+
+/**
+ * @brief Symmetric BASIC gravity for OpenMP builds.
+ * @details Every pair i<j (i<_N_active, j<j1) is evaluated once per ghostbox and 
+ * applied to both particles. For a ghostbox with shift s, the pair contributes to 
+ * particle i in ghostbox s and to particle j in ghostbox -s. The set of ghostboxes is
+ * symmetric, thus every ordered pair is counted exactly once. Pairs are processed 
+ * in tiles of two particle blocks. Threads accumulate into private buffers which 
+ * are reduced into the structure-of-arrays buffer at the end. Block pairs are 
+ * assigned to threads statically (round robin), so for a given number of threads 
+ * the result is reproducible.
+ */
+static void reb_gravity_basic_sum_symmetric(struct reb_simulation* const r, const int _N_start, const int _N_active, const int j1){
+	const int Nsoa = r->gravity_soa_allocatedN;
+	const double* restrict const x  = r->gravity_soa;
+	const double* restrict const y  = r->gravity_soa + Nsoa;
+	const double* restrict const z  = r->gravity_soa + 2*Nsoa;
+	const double* restrict const m  = r->gravity_soa + 3*Nsoa;
+	double* restrict const ax = r->gravity_soa + 4*Nsoa;
+	double* restrict const ay = r->gravity_soa + 5*Nsoa;
+	double* restrict const az = r->gravity_soa + 6*Nsoa;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const unsigned int _gravity_ignore_10 = r->gravity_ignore_10;
+	int Npad;
+	double* const buffer = reb_gravity_omp_buffer(r, j1, 3, &Npad);
+	const int nthreads = omp_get_max_threads();
+	int ti, tj, tp;
+	reb_gravity_tile_sizes(&ti, &tj, &tp);
+	const int nbi = (_N_active-_N_start+tp-1)/tp;
+	const int nbj = (j1-_N_start+tp-1)/tp;
+#pragma omp parallel
+	{
+		double* restrict const bx = buffer + 3*Npad*omp_get_thread_num();
+		double* restrict const by = bx + Npad;
+		double* restrict const bz = bx + 2*Npad;
+		for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+		for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+		for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+			const struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+			// Loop over pairs of blocks (Ib<=Jb). The data of both blocks stays in the L1 cache.
+#pragma omp for schedule(static,1) nowait
+			for (int p=0; p<nbi*nbj; p++){
+				const int Ib = p/nbj;
+				const int Jb = p%nbj;
+				if (Jb<Ib) continue;
+				const int ib = _N_start+Ib*tp;
+				const int ie = (ib+tp<_N_active)?(ib+tp):_N_active;
+				const int jb = _N_start+Jb*tp;
+				const int je = (jb+tp<j1)?(jb+tp):j1;
+				for (int i=ib; i<ie; i++){
+					const double xi = x[i] + gb.shiftx;
+					const double yi = y[i] + gb.shifty;
+					const double zi = z[i] + gb.shiftz;
+					const double mi = m[i];
+					double axi = 0.;
+					double ayi = 0.;
+					double azi = 0.;
+					int jstart = (jb>i)?jb:i+1;
+					if (_gravity_ignore_10 && i==0 && jstart<2) jstart = 2;
+#pragma omp simd reduction(+:axi,ayi,azi)
+					for (int j=jstart; j<je; j++){
+						const double dx = xi - x[j];
+						const double dy = yi - y[j];
+						const double dz = zi - z[j];
+						const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+						const double _r = sqrt(r2);
+						const double prefact = G/(r2*_r);
+						const double prefactj = -prefact*m[j];
+						axi   += prefactj*dx;
+						ayi   += prefactj*dy;
+						azi   += prefactj*dz;
+						const double prefacti = prefact*mi;
+						bx[j] += prefacti*dx;
+						by[j] += prefacti*dy;
+						bz[j] += prefacti*dz;
+					}
+					bx[i] += axi;
+					by[i] += ayi;
+					bz[i] += azi;
+				}
+			}
+		}
+		}
+		}
+#pragma omp barrier
+		// Reduction of the thread buffers 
+#pragma omp for schedule(static)
+		for (int k=_N_start; k<j1; k++){
+			for (int t=0; t<nthreads; t++){
+				const double* const b = buffer + 3*Npad*t;
+				ax[k] += b[k];
+				ay[k] += b[k+Npad];
+				az[k] += b[k+2*Npad];
+			}
+		}
+	}
+}
+
+/**
+ * @brief Symmetric COMPENSATED gravity for OpenMP builds.
+ * @details Same pair decomposition as the serial routine (j>i). Each thread keeps 
+ * compensated partial sums (value and error) for all particles. Rows are assigned 
+ * to threads statically (round robin in chunks of 16 to balance the triangular loop) 
+ * and the partial sums are combined with compensated summation in thread order. 
+ * For a given number of threads the result is therefore reproducible. 
+ * The final error terms are stored in gravity_cs.
+ */
+static void reb_gravity_compensated_sum_symmetric(struct reb_simulation* const r, const int _N_start, const int _N_active, const int j1){
+	struct reb_particle* const particles = r->particles;
+	struct reb_vec3d* restrict const cs = r->gravity_cs;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const unsigned int _gravity_ignore_10 = r->gravity_ignore_10;
+	int Npad;
+	double* const buffer = reb_gravity_omp_buffer(r, j1, 6, &Npad);
+	const int nthreads = omp_get_max_threads();
+#pragma omp parallel
+	{
+		double* restrict const bx  = buffer + 6*Npad*omp_get_thread_num();
+		double* restrict const by  = bx + Npad;
+		double* restrict const bz  = bx + 2*Npad;
+		double* restrict const bcx = bx + 3*Npad;
+		double* restrict const bcy = bx + 4*Npad;
+		double* restrict const bcz = bx + 5*Npad;
+#pragma omp for schedule(static,16)
+		for (int i=_N_start; i<_N_active; i++){
+			double axi = 0., ayi = 0., azi = 0.;
+			double csx = 0., csy = 0., csz = 0.;
+			const int jstart = (_gravity_ignore_10 && i==0)?2:i+1;
+			for (int j=jstart; j<j1; j++){
+				const double dx = particles[i].x - particles[j].x;
+				const double dy = particles[i].y - particles[j].y;
+				const double dz = particles[i].z - particles[j].z;
+				const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+				const double _r = sqrt(r2);
+				const double prefact  = G/(r2*_r);
+				const double prefacti = prefact*particles[i].m;
+				const double prefactj = -prefact*particles[j].m;
+				reb_gravity_kahan_add(&axi, &csx, prefactj*dx);
+				reb_gravity_kahan_add(&ayi, &csy, prefactj*dy);
+				reb_gravity_kahan_add(&azi, &csz, prefactj*dz);
+				reb_gravity_kahan_add(&bx[j], &bcx[j], prefacti*dx);
+				reb_gravity_kahan_add(&by[j], &bcy[j], prefacti*dy);
+				reb_gravity_kahan_add(&bz[j], &bcz[j], prefacti*dz);
+			}
+			reb_gravity_kahan_add(&bx[i], &bcx[i], axi);
+			reb_gravity_kahan_add(&bx[i], &bcx[i], -csx);
+			reb_gravity_kahan_add(&by[i], &bcy[i], ayi);
+			reb_gravity_kahan_add(&by[i], &bcy[i], -csy);
+			reb_gravity_kahan_add(&bz[i], &bcz[i], azi);
+			reb_gravity_kahan_add(&bz[i], &bcz[i], -csz);
+		}
+		// Reduction of the thread buffers (implicit barrier above)
+#pragma omp for schedule(static)
+		for (int k=_N_start; k<j1; k++){
+			for (int t=0; t<nthreads; t++){
+				const double* const b = buffer + 6*Npad*t;
+				reb_gravity_kahan_add(&particles[k].ax, &cs[k].x, b[k]);
+				reb_gravity_kahan_add(&particles[k].ax, &cs[k].x, -b[k+3*Npad]);
+				reb_gravity_kahan_add(&particles[k].ay, &cs[k].y, b[k+Npad]);
+				reb_gravity_kahan_add(&particles[k].ay, &cs[k].y, -b[k+4*Npad]);
+				reb_gravity_kahan_add(&particles[k].az, &cs[k].z, b[k+2*Npad]);
+				reb_gravity_kahan_add(&particles[k].az, &cs[k].z, -b[k+5*Npad]);
+			}
+		}
+	}
+}
+#endif // OPENMP
+
+/**
+ * @brief Calculates the accelerations and jerks by direct summation.
+ * @details The jerks are stored in ri_hermite.jerk. If gravity_active_N is not negative, 
+ * only the particles in gravity_active are updated. All ghost boxes are included. As in the 
+ * BASIC kernels, particles do not interact with their own images and gravity_ignore_10 is honoured.
+ * @param r REBOUND simulation to consider
+ * @param _N_active Number of active (massive) particles.
+ * @param _N_real Number of real particles.
+ */
+static void reb_calculate_acceleration_jerk(struct reb_simulation* const r, const int _N_active, const int _N_real){
+	struct reb_particle* const particles = r->particles;
+	double* const jerk = r->ri_hermite.jerk;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const int _testparticle_type = r->testparticle_type;
+	const int* const active = r->gravity_active_N<0?NULL:r->gravity_active;
+	const int N_target = r->gravity_active_N<0?_N_real:r->gravity_active_N;
+	const int nghostx = r->nghostx;
+	const int nghosty = r->nghosty;
+	const int nghostz = r->nghostz;
+	const unsigned int _gravity_ignore_10 = r->gravity_ignore_10;
+#pragma omp parallel for schedule(guided)
+	for (int k=0; k<N_target; k++){
+		const int i = active?active[k]:k;
+		// Testparticles of type 1 only act on massive particles.
+		const int N_source = (i<_N_active && _testparticle_type)?_N_real:_N_active;
+		const struct reb_particle pi = particles[i];
+		double ax = 0., ay = 0., az = 0.;
+		double jx = 0., jy = 0., jz = 0.;
+		for (int gbx=-nghostx; gbx<=nghostx; gbx++){
+		for (int gby=-nghosty; gby<=nghosty; gby++){
+		for (int gbz=-nghostz; gbz<=nghostz; gbz++){
+			const struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+			for (int j=0; j<N_source; j++){
+				if (i==j) continue;
+				if (_gravity_ignore_10 && ((i==1 && j==0) || (i==0 && j==1))) continue;
+				const struct reb_particle pj = particles[j];
+				const double dx = pi.x + gb.shiftx - pj.x;
+				const double dy = pi.y + gb.shifty - pj.y;
+				const double dz = pi.z + gb.shiftz - pj.z;
+				const double dvx = pi.vx + gb.shiftvx - pj.vx;
+				const double dvy = pi.vy + gb.shiftvy - pj.vy;
+				const double dvz = pi.vz + gb.shiftvz - pj.vz;
+				const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+				const double _r = sqrt(r2);
+				const double prefact = G*pj.m/(r2*_r);
+				const double rv = 3.*(dx*dvx + dy*dvy + dz*dvz)/r2;
+				ax -= prefact*dx;
+				ay -= prefact*dy;
+				az -= prefact*dz;
+				jx -= prefact*(dvx - rv*dx);
+				jy -= prefact*(dvy - rv*dy);
+				jz -= prefact*(dvz - rv*dz);
+			}
+		}
+		}
+		}
+		particles[i].ax = ax;
+		particles[i].ay = ay;
+		particles[i].az = az;
+		jerk[3*i]   = jx;
+		jerk[3*i+1] = jy;
+		jerk[3*i+2] = jz;
+	}
+}
 
 /**
  * Main Gravity Routine
@@ -65,61 +645,63 @@ void reb_calculate_acceleration(struct reb_simulation* r){
 	const int _N_active = ((N_active==-1)?N:N_active) - r->N_var;
 	const int _N_real   = N  - r->N_var;
 	const int _testparticle_type   = r->testparticle_type;
+	int gravity_ewald = r->gravity_ewald;
+	if (gravity_ewald){
+		if (r->boundary!=REB_BOUNDARY_PERIODIC || (r->gravity!=REB_GRAVITY_BASIC && r->gravity!=REB_GRAVITY_TREE)){
+			// Fall back for this call only, the user's setting is kept.
+			if (r->gravity_ewald_warning==0){
+				r->gravity_ewald_warning++;
+				reb_warning("Ewald summation requires REB_BOUNDARY_PERIODIC and REB_GRAVITY_BASIC or REB_GRAVITY_TREE. Summing over ghost boxes instead.");
+			}
+			gravity_ewald = 0;
+		}else{
+			reb_gravity_ewald_table_init(r);
+		}
+	}
 	switch (r->gravity){
 		case REB_GRAVITY_NONE: // Do nothing.
 		break;
 		case REB_GRAVITY_BASIC:
 		{
+			if (gravity_ewald){
+				reb_calculate_acceleration_ewald_basic(r, _N_start, _N_active, _N_real);
+				break;
+			}
+			if (r->integrator==REB_INTEGRATOR_HERMITE && r->ri_hermite.allocatedN>=N){
+				// The Hermite integrator needs the jerks together with the accelerations.
+				reb_calculate_acceleration_jerk(r, _N_active, _N_real);
+				break;
+			}
+			// Test particles of type 0 do not need to be staged, they are handled separately.
+			const int _N_soa = _testparticle_type?_N_real:_N_active;
+			reb_gravity_soa_prepare(r, _N_soa);
+#ifdef OPENMP
+			// Pairs of massive particles (and massive/testparticle pairs if testparticle_type==1)
+			reb_gravity_basic_sum_symmetric(r, _N_start, _N_active, _N_soa);
+#else // OPENMP
 			const int nghostx = r->nghostx;
 			const int nghosty = r->nghosty;
 			const int nghostz = r->nghostz;
-#pragma omp parallel for schedule(guided)
-			for (int i=0; i<N; i++){
-				particles[i].ax = 0; 
-				particles[i].ay = 0; 
-				particles[i].az = 0; 
-			}
 			// Summing over all Ghost Boxes
 			for (int gbx=-nghostx; gbx<=nghostx; gbx++){
 			for (int gby=-nghosty; gby<=nghosty; gby++){
 			for (int gbz=-nghostz; gbz<=nghostz; gbz++){
 				struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-				// Summing over all particle pairs
-#pragma omp parallel for schedule(guided)
-				for (int i=_N_start; i<_N_real; i++){
-				for (int j=_N_start; j<_N_active; j++){
-					if (_gravity_ignore_10 && ((j==1 && i==0) || (i==1 && j==0))) continue;
-					if (i==j) continue;
-					const double dx = (gb.shiftx+particles[i].x) - particles[j].x;
-					const double dy = (gb.shifty+particles[i].y) - particles[j].y;
-					const double dz = (gb.shiftz+particles[i].z) - particles[j].z;
-					const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
-					const double prefact = -G/(_r*_r*_r)*particles[j].m;
-					
-					particles[i].ax    += prefact*dx;
-					particles[i].ay    += prefact*dy;
-					particles[i].az    += prefact*dz;
-				}
-				}
-                if (_testparticle_type){
-				for (int i=_N_start; i<_N_active; i++){
-				for (int j=_N_active; j<_N_real; j++){
-					if (_gravity_ignore_10 && j==1 && i==0 ) continue;
-					const double dx = (gb.shiftx+particles[i].x) - particles[j].x;
-					const double dy = (gb.shifty+particles[i].y) - particles[j].y;
-					const double dz = (gb.shiftz+particles[i].z) - particles[j].z;
-					const double _r = sqrt(dx*dx + dy*dy + dz*dz + softening2);
-					const double prefact = -G/(_r*_r*_r)*particles[j].m;
-					
-					particles[i].ax    += prefact*dx;
-					particles[i].ay    += prefact*dy;
-					particles[i].az    += prefact*dz;
-				}
+				// Massive particles act on all staged particles
+				reb_gravity_basic_sum(r, gb, _N_start, _N_soa, _N_start, _N_active);
+				if (_testparticle_type){
+					// Testparticles act on massive particles
+					reb_gravity_basic_sum(r, gb, _N_start, _N_active, _N_active, _N_real);
 				}
-                }
 			}
 			}
 			}
+#endif // OPENMP
+			reb_gravity_soa_finish(r, _N_soa);
+			if (!_testparticle_type && _N_active<_N_real){
+				// Massive particles act on testparticles
+				reb_gravity_basic_testparticles(r, _N_start, _N_active, _N_real);
+			}
 		}
 		break;
 		case REB_GRAVITY_COMPENSATED:
@@ -140,18 +722,55 @@ void reb_calculate_acceleration(struct reb_simulation* r){
 			}
 			// Summing over all massive particle pairs
 #ifdef OPENMP
+			// Pairs of massive particles (and massive/testparticle pairs if testparticle_type==1)
+			reb_gravity_compensated_sum_symmetric(r, _N_start, _N_active, _testparticle_type?_N_real:_N_active);
+			if (!_testparticle_type){
+				// Testparticles
 #pragma omp parallel for schedule(guided)
+				for (int i=_N_active; i<_N_real; i++){
+				for (int j=_N_start; j<_N_active; j++){
+					if (_gravity_ignore_10 && i==1 && j==0 ) continue;
+					const double dx = particles[i].x - particles[j].x;
+					const double dy = particles[i].y - particles[j].y;
+					const double dz = particles[i].z - particles[j].z;
+					const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+					const double r = sqrt(r2);
+					const double prefact  = G/(r2*r);
+					const double prefactj = -prefact*particles[j].m;
+				
+					{
+					double ix = prefactj*dx;
+					double yx = ix - cs[i].x;
+					double tx = particles[i].ax + yx;
+					cs[i].x = (tx - particles[i].ax) - yx;
+					particles[i].ax = tx;
+
+					double iy = prefactj*dy;
+					double yy = iy- cs[i].y;
+					double ty = particles[i].ay + yy;
+					cs[i].y = (ty - particles[i].ay) - yy;
+					particles[i].ay = ty;
+				
+					double iz = prefactj*dz;
+					double yz = iz - cs[i].z;
+					double tz = particles[i].az + yz;
+					cs[i].z = (tz - particles[i].az) - yz;
+					particles[i].az = tz;
+					}
+				}
+				}
+			}
+#else // OPENMP
 			for (int i=_N_start; i<_N_active; i++){
-			for (int j=_N_start; j<_N_active; j++){
+			for (int j=i+1; j<_N_active; j++){
 				if (_gravity_ignore_10 && j==1 && i==0 ) continue;
-				if (_gravity_ignore_10 && i==1 && j==0 ) continue;
-				if (i==j) continue;
 				const double dx = particles[i].x - particles[j].x;
 				const double dy = particles[i].y - particles[j].y;
 				const double dz = particles[i].z - particles[j].z;
 				const double r2 = dx*dx + dy*dy + dz*dz + softening2;
 				const double r = sqrt(r2);
 				const double prefact  = G/(r2*r);
+				const double prefacti = prefact*particles[i].m;
 				const double prefactj = -prefact*particles[j].m;
 				
 				{
@@ -173,11 +792,30 @@ void reb_calculate_acceleration(struct reb_simulation* r){
 				cs[i].z = (tz - particles[i].az) - yz;
 				particles[i].az = tz;
 				}
+				
+				{
+				double ix = prefacti*dx;
+				double yx = ix - cs[j].x;
+				double tx = particles[j].ax + yx;
+				cs[j].x = (tx - particles[j].ax) - yx;
+				particles[j].ax = tx;
+
+				double iy = prefacti*dy;
+				double yy = iy - cs[j].y;
+				double ty = particles[j].ay + yy;
+				cs[j].y = (ty - particles[j].ay) - yy;
+				particles[j].ay = ty;
+				
+				double iz = prefacti*dz;
+				double yz = iz - cs[j].z;
+				double tz = particles[j].az + yz;
+				cs[j].z = (tz - particles[j].az) - yz;
+				particles[j].az = tz;
+				}
 			}
 			}
 
 			// Testparticles
-#pragma omp parallel for schedule(guided)
 			for (int i=_N_active; i<_N_real; i++){
 			for (int j=_N_start; j<_N_active; j++){
 				if (_gravity_ignore_10 && i==1 && j==0 ) continue;
@@ -208,19 +846,7 @@ void reb_calculate_acceleration(struct reb_simulation* r){
 				cs[i].z = (tz - particles[i].az) - yz;
 				particles[i].az = tz;
 				}
-			}
-			}
-			if (_testparticle_type){
-#pragma omp parallel for schedule(guided)
-				for (int j=_N_start; j<_N_active; j++){
-				for (int i=_N_active; i<_N_real; i++){
-					if (_gravity_ignore_10 && i==1 && j==0 ) continue;
-					const double dx = particles[i].x - particles[j].x;
-					const double dy = particles[i].y - particles[j].y;
-					const double dz = particles[i].z - particles[j].z;
-					const double r2 = dx*dx + dy*dy + dz*dz + softening2;
-					const double r = sqrt(r2);
-					const double prefact  = G/(r2*r);
+				if (_testparticle_type){
 					const double prefacti = prefact*particles[i].m;
 					{
 					double ix = prefacti*dx;
@@ -242,154 +868,281 @@ void reb_calculate_acceleration(struct reb_simulation* r){
 					particles[j].az = tz;
 					}
 				}
+			}
+			}
+#endif // OPENMP
+		}
+		break;
+		case REB_GRAVITY_TREE:
+		{
+			// Collision candidates are only valid if recorded during this walk.
+			r->collisions_fused_N = -1;
+#ifndef MPI
+			if (r->tree_opening_tolerance>0. && !gravity_ewald){
+				// The accelerations of the previous step set the allowed errors of the relative opening criterion.
+				if (r->tree_aerr_allocatedN<N){
+					r->tree_aerr = realloc(r->tree_aerr, sizeof(double)*N);
+					r->tree_aerr_allocatedN = N;
+				}
+				const double tolerance = r->tree_opening_tolerance;
+#pragma omp parallel for schedule(guided)
+				for (int i=0; i<N; i++){
+					const struct reb_particle p = particles[i];
+					r->tree_aerr[i] = tolerance*sqrt(p.ax*p.ax + p.ay*p.ay + p.az*p.az);
 				}
 			}
-#else // OPENMP
-			for (int i=_N_start; i<_N_active; i++){
-			for (int j=i+1; j<_N_active; j++){
-				if (_gravity_ignore_10 && j==1 && i==0 ) continue;
-				const double dx = particles[i].x - particles[j].x;
-				const double dy = particles[i].y - particles[j].y;
-				const double dz = particles[i].z - particles[j].z;
-				const double r2 = dx*dx + dy*dy + dz*dz + softening2;
-				const double r = sqrt(r2);
-				const double prefact  = G/(r2*r);
-				const double prefacti = prefact*particles[i].m;
-				const double prefactj = -prefact*particles[j].m;
-				
-				{
-				double ix = prefactj*dx;
-				double yx = ix - cs[i].x;
-				double tx = particles[i].ax + yx;
-				cs[i].x = (tx - particles[i].ax) - yx;
-				particles[i].ax = tx;
-
-				double iy = prefactj*dy;
-				double yy = iy- cs[i].y;
-				double ty = particles[i].ay + yy;
-				cs[i].y = (ty - particles[i].ay) - yy;
-				particles[i].ay = ty;
-				
-				double iz = prefactj*dz;
-				double yz = iz - cs[i].z;
-				double tz = particles[i].az + yz;
-				cs[i].z = (tz - particles[i].az) - yz;
-				particles[i].az = tz;
-				}
-				
-				{
-				double ix = prefacti*dx;
-				double yx = ix - cs[j].x;
-				double tx = particles[j].ax + yx;
-				cs[j].x = (tx - particles[j].ax) - yx;
-				particles[j].ax = tx;
-
-				double iy = prefacti*dy;
-				double yy = iy - cs[j].y;
-				double ty = particles[j].ay + yy;
-				cs[j].y = (ty - particles[j].ay) - yy;
-				particles[j].ay = ty;
-				
-				double iz = prefacti*dz;
-				double yz = iz - cs[j].z;
-				double tz = particles[j].az + yz;
-				cs[j].z = (tz - particles[j].az) - yz;
-				particles[j].az = tz;
-				}
-			}
-			}
-
-			// Testparticles
-			for (int i=_N_active; i<_N_real; i++){
-			for (int j=_N_start; j<_N_active; j++){
-				if (_gravity_ignore_10 && i==1 && j==0 ) continue;
-				const double dx = particles[i].x - particles[j].x;
-				const double dy = particles[i].y - particles[j].y;
-				const double dz = particles[i].z - particles[j].z;
-				const double r2 = dx*dx + dy*dy + dz*dz + softening2;
-				const double r = sqrt(r2);
-				const double prefact  = G/(r2*r);
-				const double prefactj = -prefact*particles[j].m;
-				
-				{
-				double ix = prefactj*dx;
-				double yx = ix - cs[i].x;
-				double tx = particles[i].ax + yx;
-				cs[i].x = (tx - particles[i].ax) - yx;
-				particles[i].ax = tx;
-
-				double iy = prefactj*dy;
-				double yy = iy- cs[i].y;
-				double ty = particles[i].ay + yy;
-				cs[i].y = (ty - particles[i].ay) - yy;
-				particles[i].ay = ty;
-				
-				double iz = prefactj*dz;
-				double yz = iz - cs[i].z;
-				double tz = particles[i].az + yz;
-				cs[i].z = (tz - particles[i].az) - yz;
-				particles[i].az = tz;
-				}
-				if (_testparticle_type){
-					const double prefacti = prefact*particles[i].m;
-					{
-					double ix = prefacti*dx;
-					double yx = ix - cs[j].x;
-					double tx = particles[j].ax + yx;
-					cs[j].x = (tx - particles[j].ax) - yx;
-					particles[j].ax = tx;
-
-					double iy = prefacti*dy;
-					double yy = iy - cs[j].y;
-					double ty = particles[j].ay + yy;
-					cs[j].y = (ty - particles[j].ay) - yy;
-					particles[j].ay = ty;
-					
-					double iz = prefacti*dz;
-					double yz = iz - cs[j].z;
-					double tz = particles[j].az + yz;
-					cs[j].z = (tz - particles[j].az) - yz;
-					particles[j].az = tz;
-					}
+#endif // MPI
+			// With block timesteps, only the accelerations of the active particles are calculated.
+			const int* const active = r->gravity_active_N<0?NULL:r->gravity_active;
+			const int N_target = r->gravity_active_N<0?N:r->gravity_active_N;
+			// Largest speed of any particle over this timestep, estimated with the accelerations of 
+			// the previous step. Used to widen the collision candidates in the fused mode.
+			double vmax = 0.;
+			if (r->collision_fused){
+				const double dt = fabs(r->dt);
+				for (int i=0; i<N; i++){
+					const struct reb_particle p = particles[i];
+					const double v = sqrt(p.vx*p.vx + p.vy*p.vy + p.vz*p.vz) + dt*sqrt(p.ax*p.ax + p.ay*p.ay + p.az*p.az);
+					if (v>vmax) vmax = v;
 				}
 			}
-			}
-#endif // OPENMP
-		}
-		break;
-		case REB_GRAVITY_TREE:
-		{
 #pragma omp parallel for schedule(guided)
-			for (int i=0; i<N; i++){
+			for (int k=0; k<N_target; k++){
+				const int i = active?active[k]:k;
 				particles[i].ax = 0; 
 				particles[i].ay = 0; 
 				particles[i].az = 0; 
 			}
-			// Summing over all Ghost Boxes
+			if (gravity_ewald){
+				reb_calculate_acceleration_ewald_tree(r);
+				break;
+			}
+			if (r->tree_group_size>0 && active==NULL){
+				reb_calculate_acceleration_tree_groups(r);
+				break;
+			}
+			// The ghost boxes are summed in a single walk per particle (per chunk of REB_TREE_IMAGES_MAX images).
+			const int nimg = (2*r->nghostx+1)*(2*r->nghosty+1)*(2*r->nghostz+1);
+			struct reb_ghostbox* const gbs = malloc(sizeof(struct reb_ghostbox)*nimg);
+			const int ny = 2*r->nghosty+1;
+			const int nz = 2*r->nghostz+1;
 			for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
 			for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
 			for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
-				// Summing over all particle pairs
-#pragma omp parallel for schedule(guided)
-				for (int i=0; i<N; i++){
-					struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
-					// Precalculated shifted position
-					gb.shiftx += particles[i].x;
-					gb.shifty += particles[i].y;
-					gb.shiftz += particles[i].z;
-					reb_calculate_acceleration_for_particle(r, i, gb);
-				}
+				gbs[((gbx+r->nghostx)*ny + gby+r->nghosty)*nz + gbz+r->nghostz] = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
 			}
 			}
 			}
+			// Collision candidates are recorded during the walk in the fused mode. Pairs are 
+			// recorded if they can overlap by the end of the timestep, so that the candidates 
+			// contain every collision the tree search would find.
+			double rmargin = -1.;
+#ifndef MPI
+			if (r->collision_fused && r->collision==REB_COLLISION_TREE && active==NULL){
+				double vshift = 0.;
+				for (int k=0; k<nimg; k++){
+					const double v = sqrt(gbs[k].shiftvx*gbs[k].shiftvx + gbs[k].shiftvy*gbs[k].shiftvy + gbs[k].shiftvz*gbs[k].shiftvz);
+					if (v>vshift) vshift = v;
+				}
+				rmargin = (2.*vmax + vshift)*fabs(r->dt);
+				r->collisions_fused_N = 0;
+				reb_collision_buffers_reset(r);
+			}
+#endif // MPI
+#pragma omp parallel for schedule(guided)
+			for (int k=0; k<N_target; k++){
+				reb_calculate_acceleration_for_particle(r, active?active[k]:k, gbs, nimg, rmargin);
+			}
+			free(gbs);
 		}
 		break;
+		case REB_GRAVITY_FMM:
+			reb_gravity_fmm_calculate_acceleration(r);
+		break;
+		case REB_GRAVITY_PM:
+			reb_gravity_pm_calculate_acceleration(r);
+		break;
 		default:
 			reb_exit("Gravity calculation not yet implemented.");
 	}
 
 }
 
+/**
+ * @brief Number of targets per block in the fused variational kernel.
+ * @details Blocks of targets are distributed over OpenMP threads.
+ */
+#define REB_GRAVITY_VAR_BLOCK 16
+
+/**
+ * @brief First order variational acceleration of particle i due to particle j.
+ * @param particles_var1 First order variational particles of the configuration.
+ * @param dx x distance between particle i and particle j (dy and dz analogous).
+ * @param r3inv 1/r^3 of the pair.
+ * @param r2inv 1/r^2 of the pair.
+ */
+static inline void reb_gravity_var1_pair(struct reb_particle* const particles_var1, const int i, const int j, const double G, const double Gmj, const double dx, const double dy, const double dz, const double r3inv, const double r2inv){
+	const double r5inv = 3.*r3inv*r2inv;
+	const double ddx = particles_var1[i].x - particles_var1[j].x;
+	const double ddy = particles_var1[i].y - particles_var1[j].y;
+	const double ddz = particles_var1[i].z - particles_var1[j].z;
+
+	// Variational equations
+	const double dxdx = dx*dx*r5inv - r3inv;
+	const double dydy = dy*dy*r5inv - r3inv;
+	const double dzdz = dz*dz*r5inv - r3inv;
+	const double dxdy = dx*dy*r5inv;
+	const double dxdz = dx*dz*r5inv;
+	const double dydz = dy*dz*r5inv;
+	const double dax =   ddx * dxdx + ddy * dxdy + ddz * dxdz;
+	const double day =   ddx * dxdy + ddy * dydy + ddz * dydz;
+	const double daz =   ddx * dxdz + ddy * dydz + ddz * dzdz;
+
+	// Variational mass contributions
+	const double dGmj = G*particles_var1[j].m;
+
+	particles_var1[i].ax += Gmj * dax - dGmj*r3inv*dx;
+	particles_var1[i].ay += Gmj * day - dGmj*r3inv*dy;
+	particles_var1[i].az += Gmj * daz - dGmj*r3inv*dz;
+}
+
+/**
+ * @brief Second order variational acceleration of particle i due to particle j.
+ * @details Only reads the positions of the first order particles.
+ * @param particles_var2 Second order variational particles of the configuration.
+ * @param particles_var1a First order variational particles the configuration depends on (particles_var1b analogous).
+ * @param dx x distance between particle i and particle j (dy and dz analogous).
+ * @param r3inv 1/r^3 of the pair.
+ * @param r2inv 1/r^2 of the pair.
+ */
+static inline void reb_gravity_var2_pair(struct reb_particle* const particles_var2, const struct reb_particle* const particles_var1a, const struct reb_particle* const particles_var1b, const int i, const int j, const double G, const double Gmj, const double dx, const double dy, const double dz, const double r3inv, const double r2inv){
+	const double r5inv = r3inv*r2inv;
+	const double r7inv = r5inv*r2inv;
+	const double ddx = particles_var2[i].x - particles_var2[j].x;
+	const double ddy = particles_var2[i].y - particles_var2[j].y;
+	const double ddz = particles_var2[i].z - particles_var2[j].z;
+	const double ddGmj = G*particles_var2[j].m;
+
+	// Variational equations
+	// delta^(2) terms
+	double dax =         ddx * ( 3.*dx*dx*r5inv - r3inv )
+		   + ddy * ( 3.*dx*dy*r5inv )
+		   + ddz * ( 3.*dx*dz*r5inv );
+	double day =         ddx * ( 3.*dy*dx*r5inv )
+		   + ddy * ( 3.*dy*dy*r5inv - r3inv )
+		   + ddz * ( 3.*dy*dz*r5inv );
+	double daz =         ddx * ( 3.*dz*dx*r5inv )
+		   + ddy * ( 3.*dz*dy*r5inv )
+		   + ddz * ( 3.*dz*dz*r5inv - r3inv );
+
+	// delta^(1) delta^(1) terms
+	const double dk1dx = particles_var1a[i].x - particles_var1a[j].x;
+	const double dk1dy = particles_var1a[i].y - particles_var1a[j].y;
+	const double dk1dz = particles_var1a[i].z - particles_var1a[j].z;
+	const double dk2dx = particles_var1b[i].x - particles_var1b[j].x;
+	const double dk2dy = particles_var1b[i].y - particles_var1b[j].y;
+	const double dk2dz = particles_var1b[i].z - particles_var1b[j].z;
+
+	const double rdk1 =  dx*dk1dx + dy*dk1dy + dz*dk1dz;
+	const double rdk2 =  dx*dk2dx + dy*dk2dy + dz*dk2dz;
+	const double dk1dk2 =  dk1dx*dk2dx + dk1dy*dk2dy + dk1dz*dk2dz;
+	dax 	+=        3.* r5inv * dk2dx * rdk1
+		+ 3.* r5inv * dk1dx * rdk2
+		+ 3.* r5inv    * dx * dk1dk2  
+		    - 15.      * dx * r7inv * rdk1 * rdk2;
+	day 	+=        3.* r5inv * dk2dy * rdk1
+		+ 3.* r5inv * dk1dy * rdk2
+		+ 3.* r5inv    * dy * dk1dk2  
+		    - 15.      * dy * r7inv * rdk1 * rdk2;
+	daz 	+=        3.* r5inv * dk2dz * rdk1
+		+ 3.* r5inv * dk1dz * rdk2
+		+ 3.* r5inv    * dz * dk1dk2  
+		    - 15.      * dz * r7inv * rdk1 * rdk2;
+
+	const double dk1Gmj = G * particles_var1a[j].m;
+	const double dk2Gmj = G * particles_var1b[j].m;
+
+	particles_var2[i].ax += Gmj * dax 
+		- ddGmj*r3inv*dx 
+		- dk2Gmj*r3inv*dk1dx + 3.*dk2Gmj*r5inv*dx*rdk1
+		- dk1Gmj*r3inv*dk2dx + 3.*dk1Gmj*r5inv*dx*rdk2;
+	particles_var2[i].ay += Gmj * day 
+		- ddGmj*r3inv*dy
+		- dk2Gmj*r3inv*dk1dy + 3.*dk2Gmj*r5inv*dy*rdk1
+		- dk1Gmj*r3inv*dk2dy + 3.*dk1Gmj*r5inv*dy*rdk2;
+	particles_var2[i].az += Gmj * daz 
+		- ddGmj*r3inv*dz
+		- dk2Gmj*r3inv*dk1dz + 3.*dk2Gmj*r5inv*dz*rdk1
+		- dk1Gmj*r3inv*dk2dz + 3.*dk1Gmj*r5inv*dz*rdk2;
+}
+
+/**
+ * @brief Variational equations for all configurations which are not test particles.
+ * @details Fused kernel: the geometry of a pair is calculated once and applied to all 
+ * first and second order configurations straight away, nothing is stored. Blocks of 
+ * targets are distributed over OpenMP threads and every thread only writes to its own 
+ * targets. Each pair is therefore visited from both sides, but the result does not 
+ * depend on the number of threads. Sources are tiled so that they stay in cache while 
+ * a block of targets is processed.
+ * @param r REBOUND simulation to consider
+ * @param _N_real Number of real particles.
+ */
+static void reb_gravity_var_fused(struct reb_simulation* const r, const int _N_real){
+	struct reb_particle* const particles = r->particles;
+	const struct reb_variational_configuration* const var_config = r->var_config;
+	const int var_config_N = r->var_config_N;
+	const double G = r->G;
+	const unsigned int _gravity_ignore_10 = r->gravity_ignore_10;
+	int ti, tj, tp;
+	reb_gravity_tile_sizes(&ti, &tj, &tp);
+	const int nblocks = (_N_real+REB_GRAVITY_VAR_BLOCK-1)/REB_GRAVITY_VAR_BLOCK;
+#pragma omp parallel for schedule(static)
+	for (int b=0; b<nblocks; b++){
+		const int ib = b*REB_GRAVITY_VAR_BLOCK;
+		const int ie = MIN(ib+REB_GRAVITY_VAR_BLOCK, _N_real);
+		for (int v=0; v<var_config_N; v++){
+			if (var_config[v].testparticle>=0) continue;
+			struct reb_particle* const particles_var = particles + var_config[v].index;
+			for (int i=ib; i<ie; i++){
+				particles_var[i].ax = 0.; 
+				particles_var[i].ay = 0.; 
+				particles_var[i].az = 0.; 
+			}
+		}
+		for (int jb=0; jb<_N_real; jb+=tj){
+			const int je = MIN(jb+tj, _N_real);
+			for (int i=ib; i<ie; i++){
+				const double xi = particles[i].x;
+				const double yi = particles[i].y;
+				const double zi = particles[i].z;
+				for (int j=jb; j<je; j++){
+					if (i==j) continue;
+					const double dx = xi - particles[j].x;
+					const double dy = yi - particles[j].y;
+					const double dz = zi - particles[j].z;
+					const double r2 = dx*dx + dy*dy + dz*dz;
+					const double _r = sqrt(r2);
+					const double r3inv = 1./(r2*_r);
+					const double r2inv = 1./r2;
+					const double Gmj = G * particles[j].m;
+					const int ignore = _gravity_ignore_10 && i+j==1;
+					for (int v=0; v<var_config_N; v++){
+						const struct reb_variational_configuration* const vc = &var_config[v];
+						if (vc->testparticle>=0) continue;
+						if (vc->order==1){
+							if (ignore) continue;
+							reb_gravity_var1_pair(particles + vc->index, i, j, G, Gmj, dx, dy, dz, r3inv, r2inv);
+						}else if (vc->order==2){
+							// TODO: Need to implement WH skipping
+							reb_gravity_var2_pair(particles + vc->index, particles + vc->index_1st_order_a, particles + vc->index_1st_order_b, i, j, G, Gmj, dx, dy, dz, r3inv, r2inv);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
 void reb_calculate_acceleration_var(struct reb_simulation* r){
 	struct reb_particle* const particles = r->particles;
 	const double G = r->G;
@@ -410,6 +1163,16 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
 			}
         }
 		case REB_GRAVITY_BASIC:
+        {
+            // All configurations which are not test particles share one pair loop.
+            for (int v=0;v<r->var_config_N;v++){
+                if (r->var_config[v].testparticle<0){
+                    reb_gravity_var_fused(r, _N_real);
+                    break;
+                }
+            }
+            // Test particle configurations only write to their own particles.
+#pragma omp parallel for schedule(dynamic)
             for (int v=0;v<r->var_config_N;v++){
                 struct reb_variational_configuration const vc = r->var_config[v];
                 if (vc.order==1){
@@ -417,53 +1180,7 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                     /// 1st order  ///
                     //////////////////
                     struct reb_particle* const particles_var1 = particles + vc.index;
-                    if (vc.testparticle<0){
-                        for (int i=0; i<_N_real; i++){
-                            particles_var1[i].ax = 0.; 
-                            particles_var1[i].ay = 0.; 
-                            particles_var1[i].az = 0.; 
-                        }
-                        for (int i=0; i<_N_real; i++){
-                        for (int j=i+1; j<_N_real; j++){
-                            if (_gravity_ignore_10 && ((i==1 && j==0) || (j==1 && i==0)) ) continue;
-                            const double dx = particles[i].x - particles[j].x;
-                            const double dy = particles[i].y - particles[j].y;
-                            const double dz = particles[i].z - particles[j].z;
-                            const double r2 = dx*dx + dy*dy + dz*dz;
-                            const double _r  = sqrt(r2);
-                            const double r3inv = 1./(r2*_r);
-                            const double r5inv = 3.*r3inv/r2;
-                            const double ddx = particles_var1[i].x - particles_var1[j].x;
-                            const double ddy = particles_var1[i].y - particles_var1[j].y;
-                            const double ddz = particles_var1[i].z - particles_var1[j].z;
-                            const double Gmi = G * particles[i].m;
-                            const double Gmj = G * particles[j].m;
-
-                            // Variational equations
-                            const double dxdx = dx*dx*r5inv - r3inv;
-                            const double dydy = dy*dy*r5inv - r3inv;
-                            const double dzdz = dz*dz*r5inv - r3inv;
-                            const double dxdy = dx*dy*r5inv;
-                            const double dxdz = dx*dz*r5inv;
-                            const double dydz = dy*dz*r5inv;
-                            const double dax =   ddx * dxdx + ddy * dxdy + ddz * dxdz;
-                            const double day =   ddx * dxdy + ddy * dydy + ddz * dydz;
-                            const double daz =   ddx * dxdz + ddy * dydz + ddz * dzdz;
-
-                            // Variational mass contributions
-                            const double dGmi = G*particles_var1[i].m;
-                            const double dGmj = G*particles_var1[j].m;
-
-                            particles_var1[i].ax += Gmj * dax - dGmj*r3inv*dx;
-                            particles_var1[i].ay += Gmj * day - dGmj*r3inv*dy;
-                            particles_var1[i].az += Gmj * daz - dGmj*r3inv*dz;
-
-                            particles_var1[j].ax -= Gmi * dax - dGmi*r3inv*dx;
-                            particles_var1[j].ay -= Gmi * day - dGmi*r3inv*dy;
-                            particles_var1[j].az -= Gmi * daz - dGmi*r3inv*dz; 
-                        }
-                        }
-                    }else{ //testparticle
+                    if (vc.testparticle>=0){ //testparticle
                         int i = vc.testparticle;
                         particles_var1[0].ax = 0.; 
                         particles_var1[0].ay = 0.; 
@@ -509,101 +1226,7 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                     struct reb_particle* const particles_var2 = particles + vc.index;
                     struct reb_particle* const particles_var1a = particles + vc.index_1st_order_a;
                     struct reb_particle* const particles_var1b = particles + vc.index_1st_order_b;
-                    if (vc.testparticle<0){
-                        for (int i=0; i<_N_real; i++){
-                            particles_var2[i].ax = 0.; 
-                            particles_var2[i].ay = 0.; 
-                            particles_var2[i].az = 0.; 
-                        }
-                        for (int i=0; i<_N_real; i++){
-                        for (int j=i+1; j<_N_real; j++){
-                            // TODO: Need to implement WH skipping
-                            //if (_gravity_ignore_10 && ((i==1 && j==0) || (j==1 && i==0)) ) continue;
-                            const double dx = particles[i].x - particles[j].x;
-                            const double dy = particles[i].y - particles[j].y;
-                            const double dz = particles[i].z - particles[j].z;
-                            const double r2 = dx*dx + dy*dy + dz*dz;
-                            const double r  = sqrt(r2);
-                            const double r3inv = 1./(r2*r);
-                            const double r5inv = r3inv/r2;
-                            const double r7inv = r5inv/r2;
-                            const double ddx = particles_var2[i].x - particles_var2[j].x;
-                            const double ddy = particles_var2[i].y - particles_var2[j].y;
-                            const double ddz = particles_var2[i].z - particles_var2[j].z;
-                            const double Gmi = G * particles[i].m;
-                            const double Gmj = G * particles[j].m;
-                            const double ddGmi = G*particles_var2[i].m;
-                            const double ddGmj = G*particles_var2[j].m;
-                            
-                            // Variational equations
-                            // delta^(2) terms
-                            double dax =         ddx * ( 3.*dx*dx*r5inv - r3inv )
-                                       + ddy * ( 3.*dx*dy*r5inv )
-                                       + ddz * ( 3.*dx*dz*r5inv );
-                            double day =         ddx * ( 3.*dy*dx*r5inv )
-                                       + ddy * ( 3.*dy*dy*r5inv - r3inv )
-                                       + ddz * ( 3.*dy*dz*r5inv );
-                            double daz =         ddx * ( 3.*dz*dx*r5inv )
-                                       + ddy * ( 3.*dz*dy*r5inv )
-                                       + ddz * ( 3.*dz*dz*r5inv - r3inv );
-                            
-                            // delta^(1) delta^(1) terms
-                            const double dk1dx = particles_var1a[i].x - particles_var1a[j].x;
-                            const double dk1dy = particles_var1a[i].y - particles_var1a[j].y;
-                            const double dk1dz = particles_var1a[i].z - particles_var1a[j].z;
-                            const double dk2dx = particles_var1b[i].x - particles_var1b[j].x;
-                            const double dk2dy = particles_var1b[i].y - particles_var1b[j].y;
-                            const double dk2dz = particles_var1b[i].z - particles_var1b[j].z;
-
-                            const double rdk1 =  dx*dk1dx + dy*dk1dy + dz*dk1dz;
-                            const double rdk2 =  dx*dk2dx + dy*dk2dy + dz*dk2dz;
-                            const double dk1dk2 =  dk1dx*dk2dx + dk1dy*dk2dy + dk1dz*dk2dz;
-                            dax 	+=        3.* r5inv * dk2dx * rdk1
-                                    + 3.* r5inv * dk1dx * rdk2
-                                    + 3.* r5inv    * dx * dk1dk2  
-                                        - 15.      * dx * r7inv * rdk1 * rdk2;
-                            day 	+=        3.* r5inv * dk2dy * rdk1
-                                    + 3.* r5inv * dk1dy * rdk2
-                                    + 3.* r5inv    * dy * dk1dk2  
-                                        - 15.      * dy * r7inv * rdk1 * rdk2;
-                            daz 	+=        3.* r5inv * dk2dz * rdk1
-                                    + 3.* r5inv * dk1dz * rdk2
-                                    + 3.* r5inv    * dz * dk1dk2  
-                                        - 15.      * dz * r7inv * rdk1 * rdk2;
-                            
-                            const double dk1Gmi = G * particles_var1a[i].m;
-                            const double dk1Gmj = G * particles_var1a[j].m;
-                            const double dk2Gmi = G * particles_var1b[i].m;
-                            const double dk2Gmj = G * particles_var1b[j].m;
-
-                            particles_var2[i].ax += Gmj * dax 
-                                - ddGmj*r3inv*dx 
-                                - dk2Gmj*r3inv*dk1dx + 3.*dk2Gmj*r5inv*dx*rdk1
-                                - dk1Gmj*r3inv*dk2dx + 3.*dk1Gmj*r5inv*dx*rdk2;
-                            particles_var2[i].ay += Gmj * day 
-                                - ddGmj*r3inv*dy
-                                - dk2Gmj*r3inv*dk1dy + 3.*dk2Gmj*r5inv*dy*rdk1
-                                - dk1Gmj*r3inv*dk2dy + 3.*dk1Gmj*r5inv*dy*rdk2;
-                            particles_var2[i].az += Gmj * daz 
-                                - ddGmj*r3inv*dz
-                                - dk2Gmj*r3inv*dk1dz + 3.*dk2Gmj*r5inv*dz*rdk1
-                                - dk1Gmj*r3inv*dk2dz + 3.*dk1Gmj*r5inv*dz*rdk2;
-                                                                                 
-                            particles_var2[j].ax -= Gmi * dax 
-                                - ddGmi*r3inv*dx
-                                - dk2Gmi*r3inv*dk1dx + 3.*dk2Gmi*r5inv*dx*rdk1
-                                - dk1Gmi*r3inv*dk2dx + 3.*dk1Gmi*r5inv*dx*rdk2;
-                            particles_var2[j].ay -= Gmi * day 
-                                - ddGmi*r3inv*dy
-                                - dk2Gmi*r3inv*dk1dy + 3.*dk2Gmi*r5inv*dy*rdk1
-                                - dk1Gmi*r3inv*dk2dy + 3.*dk1Gmi*r5inv*dy*rdk2;
-                            particles_var2[j].az -= Gmi * daz 
-                                - ddGmi*r3inv*dz
-                                - dk2Gmi*r3inv*dk1dz + 3.*dk2Gmi*r5inv*dz*rdk1
-                                - dk1Gmi*r3inv*dk2dz + 3.*dk1Gmi*r5inv*dz*rdk2;
-                        }
-                        }
-                    }else{ //testparticle
+                    if (vc.testparticle>=0){ //testparticle
                         int i = vc.testparticle;
                         particles_var2[0].ax = 0.; 
                         particles_var2[0].ay = 0.; 
@@ -670,6 +1293,7 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
                     }
                 }
             }
+        }
 			break;
 		default:
 			reb_exit("Variational gravity calculation not yet implemented.");
@@ -682,26 +1306,148 @@ void reb_calculate_acceleration_var(struct reb_simulation* r){
 
 
 /**
-  * @brief The function calls itself recursively using cell breaking criterion to check whether it can use center of mass (and mass quadrupole tensor) to calculate forces.
+  * @brief The function calls itself recursively using cell breaking criterion to check whether it can use center of mass (and higher multipole moments) to calculate forces.
   * Calculate the acceleration for a particle from a given cell and all its daughter cells.
   *
   * @param r REBOUND simulation to consider
   * @param pt Index of the particle the force is calculated for.
   * @param node Pointer to the cell the force is calculated from.
   * @param gb Ghostbox plus position of the particle (precalculated). 
+  * @param rcol Radius of the particle plus the collision margin, negative if no collision candidates are recorded.
+  * @param order Multipole order (0, 2 or 3). Only called with constant values, see below.
   */
-static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb);
+static inline void reb_calculate_acceleration_for_particle_from_cell(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb, const double rcol, const int order);
 
-static void reb_calculate_acceleration_for_particle(const struct reb_simulation* const r, const int pt, const struct reb_ghostbox gb) {
-	for(int i=0;i<r->root_n;i++){
-		struct reb_treecell* node = r->tree_root[i];
-		if (node!=NULL){
-			reb_calculate_acceleration_for_particle_from_cell(r, pt, node, gb);
-		}
+/**
+  * @brief Tree walks specialized for one multipole order each.
+  * @details The order is a compile time constant in each of these functions. 
+  * Monopole runs therefore do not evaluate any of the higher order terms.
+  */
+static void reb_calculate_acceleration_for_particle_from_cell_monopole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb, const double rcol){
+	reb_calculate_acceleration_for_particle_from_cell(r, pt, node, gb, rcol, 0);
+}
+static void reb_calculate_acceleration_for_particle_from_cell_quadrupole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb, const double rcol){
+	reb_calculate_acceleration_for_particle_from_cell(r, pt, node, gb, rcol, 2);
+}
+static void reb_calculate_acceleration_for_particle_from_cell_octupole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb, const double rcol){
+	reb_calculate_acceleration_for_particle_from_cell(r, pt, node, gb, rcol, 3);
+}
+
+
+/**
+  * @brief Adds the acceleration due to the multipole expansion of a cell.
+  * @param node Cell the acceleration is calculated from.
+  * @param dx x position of the target relative to the center of mass of the cell (dy and dz analogous).
+  * @param order Multipole order (0, 2 or 3). Only called with constant values.
+  * @param ax Acceleration in x is added to this variable (ay and az analogous).
+  */
+static inline void reb_gravity_cell_acceleration(const struct reb_treecell* const node, const double G, const double softening2, const double dx, const double dy, const double dz, const int order, double* const ax, double* const ay, double* const az){
+	const double r2 = dx*dx + dy*dy + dz*dz;
+	double _r = sqrt(r2 + softening2);
+	double prefact = -G/(_r*_r*_r)*node->m;
+	if (order>=2){
+		const double* const Q = node->mp;
+		const double qprefact = G/(_r*_r*_r*_r*_r);
+		const double qx = dx*Q[0] + dy*Q[1] + dz*Q[2];
+		const double qy = dx*Q[1] + dy*Q[3] + dz*Q[4];
+		const double qz = dx*Q[2] + dy*Q[4] + dz*Q[5];
+		const double mrr = dx*qx + dy*qy + dz*qz;
+		*ax += qprefact*qx; 
+		*ay += qprefact*qy; 
+		*az += qprefact*qz; 
+		prefact += -5.0/(2.0*_r*_r)*mrr*qprefact;
+	}
+	if (order>=3){
+		const double* const O = node->mp+6;
+		const double oprefact = G/(_r*_r*_r*_r*_r*_r*_r);
+		// O_ijk r_j r_k
+		const double ox = O[0]*dx*dx + O[3]*dy*dy + O[5]*dz*dz + 2.*(O[1]*dx*dy + O[2]*dx*dz + O[4]*dy*dz);
+		const double oy = O[1]*dx*dx + O[6]*dy*dy + O[8]*dz*dz + 2.*(O[3]*dx*dy + O[4]*dx*dz + O[7]*dy*dz);
+		const double oz = O[2]*dx*dx + O[7]*dy*dy + O[9]*dz*dz + 2.*(O[4]*dx*dy + O[5]*dx*dz + O[8]*dy*dz);
+		const double mrrr = dx*ox + dy*oy + dz*oz;
+		*ax += 0.5*oprefact*ox; 
+		*ay += 0.5*oprefact*oy; 
+		*az += 0.5*oprefact*oz; 
+		prefact += -7.0/(6.0*_r*_r)*mrrr*oprefact;
 	}
+	*ax += prefact*dx; 
+	*ay += prefact*dy; 
+	*az += prefact*dz; 
 }
 
-static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_simulation* r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb) {
+/**
+  * @brief Opening criterion of the tree walks.
+  * @details Without an allowed error (aerr<=0), a cell is opened if w^2 > opening_angle2*r^2. 
+  * Otherwise the relative criterion is used: the cell is opened if the target lies within 
+  * the bounding sphere of the cell or if the estimated error of the multipole expansion,
+  * G m/r^2 (w/r)^(p+1) for an expansion truncated after order p (p=1 for monopoles), exceeds aerr. 
+  * @param node Cell to test (not a leaf).
+  * @param r2 Squared distance between the target and the center of mass of the cell.
+  * @param aerr Allowed acceleration error of the target, see tree_opening_tolerance.
+  * @param order Multipole order (0, 2 or 3). Only called with constant values.
+  * @return 1 if the cell needs to be opened, 0 if its multipole expansion can be used.
+  */
+static inline int reb_gravity_tree_open(const struct reb_simulation* const r, const struct reb_treecell* const node, const double r2, const double aerr, const int order){
+	const double w2 = node->w*node->w;
+	if (aerr<=0.){
+		return w2 > r->opening_angle2*r2;
+	}
+	if (r2 <= node->b*node->b){
+		return 1;
+	}
+	const double q = w2/r2;
+	double err = r->G*node->m/r2*q;
+	if (order==2){
+		err *= sqrt(q);
+	}else if (order>=3){
+		err *= q;
+	}
+	return err > aerr;
+}
+
+/**
+  * @brief Returns the allowed acceleration error of a particle for the relative opening criterion.
+  * @details Returns 0 (geometric criterion) if tree_opening_tolerance is not set.
+  */
+static inline double reb_gravity_tree_aerr(const struct reb_simulation* const r, const int pt){
+	if (r->tree_opening_tolerance<=0. || r->tree_aerr==NULL){
+		return 0.;
+	}
+	return r->tree_aerr[pt];
+}
+
+/**
+  * @brief Checks if a cell needs to be opened to find collision candidates.
+  * @details Same criterion as the collision search in collision.c.
+  * @param r REBOUND simulation to consider
+  * @param node Pointer to the cell (not a leaf).
+  * @param gb Ghostbox plus position of the particle (precalculated). 
+  * @param rcol Radius of the particle plus the collision margin, negative if no collision candidates are recorded.
+  */
+static inline int reb_gravity_tree_open_collision(const struct reb_simulation* const r, const struct reb_treecell* const node, const struct reb_ghostbox gb, const double rcol){
+	if (rcol<0.){
+		return 0;
+	}
+	const double dx = gb.shiftx - node->x;
+	const double dy = gb.shifty - node->y;
+	const double dz = gb.shiftz - node->z;
+	const double rp = rcol + r->max_radius[1] + 0.86602540378443*node->w;
+	return dx*dx + dy*dy + dz*dz < rp*rp;
+}
+
+/**
+  * @brief Adds a collision candidate found during the tree walk.
+  * @details The candidates are checked again in reb_collision_search() with the positions and velocities at the end of the timestep.
+  * @param r REBOUND simulation to consider
+  * @param p1 Index of the particle the walk is done for.
+  * @param p2 Index of the particle in the leaf.
+  */
+static void reb_gravity_tree_record_collision(struct reb_simulation* const r, const int p1, const int p2){
+	const struct reb_collision c = {.p1 = p1, .p2 = p2};
+	reb_collision_buffer_add(r, c);
+}
+
+static inline void reb_calculate_acceleration_for_particle_from_cell(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox gb, const double rcol, const int order) {
 	const double G = r->G;
 	const double softening2 = r->softening*r->softening;
 	struct reb_particle* const particles = r->particles;
@@ -710,34 +1456,39 @@ static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_s
 	const double dz = gb.shiftz - node->mz;
 	const double r2 = dx*dx + dy*dy + dz*dz;
 	if ( node->pt < 0 ) { // Not a leaf
-		if ( node->w*node->w > r->opening_angle2*r2 ){
+		if ( reb_gravity_tree_open(r, node, r2, reb_gravity_tree_aerr(r, pt), order) || reb_gravity_tree_open_collision(r, node, gb, rcol) ){
 			for (int o=0; o<8; o++) {
 				if (node->oct[o] != NULL) {
-					reb_calculate_acceleration_for_particle_from_cell(r, pt, node->oct[o], gb);
+					switch (order){
+						case 0:
+							reb_calculate_acceleration_for_particle_from_cell_monopole(r, pt, node->oct[o], gb, rcol);
+							break;
+						case 2:
+							reb_calculate_acceleration_for_particle_from_cell_quadrupole(r, pt, node->oct[o], gb, rcol);
+							break;
+						default:
+							reb_calculate_acceleration_for_particle_from_cell_octupole(r, pt, node->oct[o], gb, rcol);
+							break;
+					}
 				}
 			}
 		} else {
-			double _r = sqrt(r2 + softening2);
-			double prefact = -G/(_r*_r*_r)*node->m;
-#ifdef QUADRUPOLE
-			double qprefact = G/(_r*_r*_r*_r*_r);
-			particles[pt].ax += qprefact*(dx*node->mxx + dy*node->mxy + dz*node->mxz); 
-			particles[pt].ay += qprefact*(dx*node->mxy + dy*node->myy + dz*node->myz); 
-			particles[pt].az += qprefact*(dx*node->mxz + dy*node->myz + dz*node->mzz); 
-			double mrr 	= dx*dx*node->mxx 	+ dy*dy*node->myy 	+ dz*dz*node->mzz
-					+ 2.*dx*dy*node->mxy 	+ 2.*dx*dz*node->mxz 	+ 2.*dy*dz*node->myz; 
-			qprefact *= -5.0/(2.0*_r*_r)*mrr;
-			particles[pt].ax += (qprefact + prefact) * dx; 
-			particles[pt].ay += (qprefact + prefact) * dy; 
-			particles[pt].az += (qprefact + prefact) * dz; 
-#else
-			particles[pt].ax += prefact*dx; 
-			particles[pt].ay += prefact*dy; 
-			particles[pt].az += prefact*dz; 
-#endif
+			double ax = 0.;
+			double ay = 0.;
+			double az = 0.;
+			reb_gravity_cell_acceleration(node, G, softening2, dx, dy, dz, order, &ax, &ay, &az);
+			particles[pt].ax += ax; 
+			particles[pt].ay += ay; 
+			particles[pt].az += az; 
 		}
 	} else { // It's a leaf node
 		if (node->pt == pt) return;
+		if (rcol>=0.){
+			const double rp = rcol + particles[node->pt].r;
+			if (r2 < rp*rp){
+				reb_gravity_tree_record_collision(r, pt, node->pt);
+			}
+		}
 		double _r = sqrt(r2 + softening2);
 		double prefact = -G/(_r*_r*_r)*node->m;
 		particles[pt].ax += prefact*dx; 
@@ -746,3 +1497,916 @@ static void reb_calculate_acceleration_for_particle_from_cell(const struct reb_s
 	}
 }
 
+static void reb_calculate_acceleration_for_particle_from_cell_images_monopole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol);
+static void reb_calculate_acceleration_for_particle_from_cell_images_quadrupole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol);
+static void reb_calculate_acceleration_for_particle_from_cell_images_octupole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol);
+
+/**
+  * @brief Calculate the acceleration of one particle from a cell for several images of the particle.
+  * @details Every cell is tested against all images which still need it. Images for which 
+  * the multipole expansion of the cell is accepted are not passed on to the daughters. Once only 
+  * a single image remains, the walk continues with reb_calculate_acceleration_for_particle_from_cell().
+  * @param r REBOUND simulation to consider
+  * @param pt Index of the particle the force is calculated for.
+  * @param node Pointer to the cell the force is calculated from.
+  * @param gbs Ghostboxes plus position of the particle (precalculated). 
+  * @param act Indices of the images which need this cell.
+  * @param nact Number of images which need this cell.
+  * @param rcol Radius of the particle plus the collision margin, negative if no collision candidates are recorded.
+  * @param order Multipole order (0, 2 or 3). Only called with constant values.
+  */
+static inline void reb_calculate_acceleration_for_particle_from_cell_images(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol, const int order) {
+	if (nact==1){
+		switch (order){
+			case 0:
+				reb_calculate_acceleration_for_particle_from_cell_monopole(r, pt, node, gbs[act[0]], rcol);
+				break;
+			case 2:
+				reb_calculate_acceleration_for_particle_from_cell_quadrupole(r, pt, node, gbs[act[0]], rcol);
+				break;
+			default:
+				reb_calculate_acceleration_for_particle_from_cell_octupole(r, pt, node, gbs[act[0]], rcol);
+				break;
+		}
+		return;
+	}
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	if (node->pt>=0){ // It's a leaf node
+		if (node->pt == pt) return;
+		const double Gm = G*node->m;
+		double ax = 0.;
+		double ay = 0.;
+		double az = 0.;
+		const double rp = rcol + r->particles[node->pt].r;
+		for (int k=0; k<nact; k++){
+			const double dx = gbs[act[k]].shiftx - node->mx;
+			const double dy = gbs[act[k]].shifty - node->my;
+			const double dz = gbs[act[k]].shiftz - node->mz;
+			const double r2 = dx*dx + dy*dy + dz*dz;
+			if (rcol>=0. && r2 < rp*rp){
+				reb_gravity_tree_record_collision(r, pt, node->pt);
+			}
+			const double _r = sqrt(r2 + softening2);
+			const double prefact = -Gm/(_r*_r*_r);
+			ax += prefact*dx; 
+			ay += prefact*dy; 
+			az += prefact*dz; 
+		}
+		r->particles[pt].ax += ax; 
+		r->particles[pt].ay += ay; 
+		r->particles[pt].az += az; 
+		return;
+	}
+	const double aerr = reb_gravity_tree_aerr(r, pt);
+	double ax = 0.;
+	double ay = 0.;
+	double az = 0.;
+	int open[REB_TREE_IMAGES_MAX];
+	int nopen = 0;
+	for (int k=0; k<nact; k++){
+		const double dx = gbs[act[k]].shiftx - node->mx;
+		const double dy = gbs[act[k]].shifty - node->my;
+		const double dz = gbs[act[k]].shiftz - node->mz;
+		const double r2 = dx*dx + dy*dy + dz*dz;
+		if ( reb_gravity_tree_open(r, node, r2, aerr, order) || reb_gravity_tree_open_collision(r, node, gbs[act[k]], rcol) ){
+			open[nopen++] = act[k];
+		} else {
+			reb_gravity_cell_acceleration(node, G, softening2, dx, dy, dz, order, &ax, &ay, &az);
+		}
+	}
+	if (nopen<nact){
+		r->particles[pt].ax += ax; 
+		r->particles[pt].ay += ay; 
+		r->particles[pt].az += az; 
+	}
+	for (int o=0; o<8 && nopen>0; o++) {
+		if (node->oct[o] != NULL) {
+			switch (order){
+				case 0:
+					reb_calculate_acceleration_for_particle_from_cell_images_monopole(r, pt, node->oct[o], gbs, open, nopen, rcol);
+					break;
+				case 2:
+					reb_calculate_acceleration_for_particle_from_cell_images_quadrupole(r, pt, node->oct[o], gbs, open, nopen, rcol);
+					break;
+				default:
+					reb_calculate_acceleration_for_particle_from_cell_images_octupole(r, pt, node->oct[o], gbs, open, nopen, rcol);
+					break;
+			}
+		}
+	}
+}
+static void reb_calculate_acceleration_for_particle_from_cell_images_monopole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol){
+	reb_calculate_acceleration_for_particle_from_cell_images(r, pt, node, gbs, act, nact, rcol, 0);
+}
+static void reb_calculate_acceleration_for_particle_from_cell_images_quadrupole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol){
+	reb_calculate_acceleration_for_particle_from_cell_images(r, pt, node, gbs, act, nact, rcol, 2);
+}
+static void reb_calculate_acceleration_for_particle_from_cell_images_octupole(struct reb_simulation* const r, const int pt, const struct reb_treecell *node, const struct reb_ghostbox* const gbs, const int* const act, const int nact, const double rcol){
+	reb_calculate_acceleration_for_particle_from_cell_images(r, pt, node, gbs, act, nact, rcol, 3);
+}
+
+static void reb_calculate_acceleration_for_particle(struct reb_simulation* const r, const int pt, const struct reb_ghostbox* const gbs, const int nimg, const double rmargin) {
+	const struct reb_particle p = r->particles[pt];
+	// Collision candidates are only recorded if rcol is not negative.
+	const double rcol = rmargin<0.?-1.:p.r+rmargin;
+	// Precalculated shifted positions
+	struct reb_ghostbox img[REB_TREE_IMAGES_MAX];
+	int act[REB_TREE_IMAGES_MAX];
+	for (int k0=0; k0<nimg; k0+=REB_TREE_IMAGES_MAX){
+		const int n = MIN(REB_TREE_IMAGES_MAX, nimg-k0);
+		for (int k=0; k<n; k++){
+			img[k] = gbs[k0+k];
+			img[k].shiftx += p.x;
+			img[k].shifty += p.y;
+			img[k].shiftz += p.z;
+			act[k] = k;
+		}
+		for(int i=0;i<r->root_n;i++){
+			struct reb_treecell* node = r->tree_root[i];
+			if (node!=NULL){
+				// Dispatch on the moments the cells have been allocated with.
+				switch (r->tree_multipole_N){
+					case 0:
+						reb_calculate_acceleration_for_particle_from_cell_images_monopole(r, pt, node, img, act, n, rcol);
+						break;
+					case 6:
+						reb_calculate_acceleration_for_particle_from_cell_images_quadrupole(r, pt, node, img, act, n, rcol);
+						break;
+					default:
+						reb_calculate_acceleration_for_particle_from_cell_images_octupole(r, pt, node, img, act, n, rcol);
+						break;
+				}
+			}
+		}
+	}
+}
+
+/**
+  * @brief Interaction lists of one group of particles, used by the group tree walk.
+  * @details One instance per thread. The arrays grow as needed.
+  */
+struct reb_gravity_tree_lists {
+	int targets_N;		/**< Number of particles in the group */
+	int targets_Nmax;	/**< Allocated length of the target arrays */
+	int* targets;		/**< Indices of the particles in the group */
+	double* t;		/**< Shifted positions and accelerations of the targets (x, y, z, ax, ay, az), each of length targets_Nmax */
+	float* tf;		/**< Shifted positions relative to the first target and partial accelerations of the targets in single precision (x, y, z, ax, ay, az), used if gravity_mixed_precision is set */
+	int cells_N;		/**< Number of accepted cells */
+	int cells_Nmax;		/**< Allocated length of cells */
+	const struct reb_treecell** cells;	/**< Accepted cells, evaluated with their multipole expansion */
+	int sources_N;		/**< Number of accepted particles (leaves) */
+	int sources_Nmax;	/**< Allocated length of the source arrays */
+	double* s;		/**< Positions and masses of the accepted particles (x, y, z, m), each of length sources_Nmax */
+	int self;		/**< 1 if the group interacts with itself */
+};
+
+/**
+  * @brief Collects the indices of all particles in the leaves below node.
+  */
+static void reb_gravity_tree_collect_targets(struct reb_gravity_tree_lists* const l, const struct reb_treecell* const node){
+	if (node->pt>=0){
+		if (l->targets_N>=l->targets_Nmax){
+			l->targets_Nmax = l->targets_Nmax?2*l->targets_Nmax:64;
+			l->targets = realloc(l->targets, sizeof(int)*l->targets_Nmax);
+			free(l->t);
+			l->t = malloc(sizeof(double)*6*l->targets_Nmax);
+			free(l->tf);
+			l->tf = malloc(sizeof(float)*6*l->targets_Nmax);
+		}
+		l->targets[l->targets_N++] = node->pt;
+		return;
+	}
+	for (int o=0;o<8;o++){
+		if (node->oct[o]!=NULL){
+			reb_gravity_tree_collect_targets(l, node->oct[o]);
+		}
+	}
+}
+
+/**
+  * @brief Collects the groups of the group tree walk.
+  * @details A group is the largest cell that contains at most tree_group_size particles.
+  */
+static void reb_gravity_tree_collect_groups(const struct reb_simulation* const r, const struct reb_treecell* const node, const struct reb_treecell*** const groups, int* const groups_N, int* const groups_Nmax){
+	if (node->pt>=0 || -node->pt<=r->tree_group_size){
+		if (*groups_N>=*groups_Nmax){
+			*groups_Nmax = *groups_Nmax?2**groups_Nmax:128;
+			*groups = realloc(*groups, sizeof(struct reb_treecell*)**groups_Nmax);
+		}
+		(*groups)[(*groups_N)++] = node;
+		return;
+	}
+	for (int o=0;o<8;o++){
+		if (node->oct[o]!=NULL){
+			reb_gravity_tree_collect_groups(r, node->oct[o], groups, groups_N, groups_Nmax);
+		}
+	}
+}
+
+/**
+  * @brief Walks the tree once for a whole group and fills the interaction lists.
+  * @details A cell is accepted if the opening criterion w^2 <= opening_angle2*r^2 holds for
+  * the smallest distance r between its center of mass and the bounding sphere of the group.
+  * It then holds for every particle in the group, so the accuracy is at least that of the 
+  * walk per particle.
+  * @param group The cell containing the group. If reached without a ghostbox shift, the group interacts with itself.
+  * @param cx Center of the bounding sphere of the shifted group (cy, cz analogous).
+  * @param R Radius of the bounding sphere of the group.
+  * @param aerr Smallest allowed acceleration error in the group (relative opening criterion), 0 to use opening_angle2.
+  */
+static void reb_gravity_tree_walk_group(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l, const struct reb_treecell* const node, const struct reb_treecell* const group, const int shifted, const double cx, const double cy, const double cz, const double R, const double aerr){
+	if (node==group && !shifted){
+		l->self = 1;
+		return;
+	}
+	if (node->pt<0){ // Not a leaf
+		const double dx = cx - node->mx;
+		const double dy = cy - node->my;
+		const double dz = cz - node->mz;
+		const double d = sqrt(dx*dx + dy*dy + dz*dz) - R;
+		// Multipole order the cells have been allocated with.
+		const int order = r->tree_multipole_N>=16?3:(r->tree_multipole_N>=6?2:0);
+		if (d<=0. || reb_gravity_tree_open(r, node, d*d, aerr, order)){
+			for (int o=0; o<8; o++) {
+				if (node->oct[o] != NULL) {
+					reb_gravity_tree_walk_group(r, l, node->oct[o], group, shifted, cx, cy, cz, R, aerr);
+				}
+			}
+		}else{
+			if (l->cells_N>=l->cells_Nmax){
+				l->cells_Nmax = l->cells_Nmax?2*l->cells_Nmax:256;
+				l->cells = realloc(l->cells, sizeof(struct reb_treecell*)*l->cells_Nmax);
+			}
+			l->cells[l->cells_N++] = node;
+		}
+	}else{ // Leaf
+		if (l->sources_N>=l->sources_Nmax){
+			const int Nmax_old = l->sources_Nmax;
+			l->sources_Nmax = l->sources_Nmax?2*l->sources_Nmax:256;
+			l->s = realloc(l->s, sizeof(double)*4*l->sources_Nmax);
+			// Move components to their new offsets, last one first.
+			for (int k=3;k>0;k--){
+				memmove(l->s+k*l->sources_Nmax, l->s+k*Nmax_old, sizeof(double)*Nmax_old);
+			}
+		}
+		const int Nmax = l->sources_Nmax;
+		l->s[l->sources_N]        = node->mx;
+		l->s[l->sources_N+Nmax]   = node->my;
+		l->s[l->sources_N+2*Nmax] = node->mz;
+		l->s[l->sources_N+3*Nmax] = node->m;
+		l->sources_N++;
+	}
+}
+
+/**
+  * @brief Evaluates the interaction lists of one group.
+  * @details The loops over the targets are innermost and free of branches so that the compiler can vectorize them.
+  * @param order Multipole order (0, 2 or 3). Only called with constant values, see below.
+  */
+static inline void reb_gravity_tree_evaluate_lists(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l, const int order){
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const int n = l->targets_N;
+	const int Nt = l->targets_Nmax;
+	double* restrict const x  = l->t;
+	double* restrict const y  = l->t + Nt;
+	double* restrict const z  = l->t + 2*Nt;
+	double* restrict const ax = l->t + 3*Nt;
+	double* restrict const ay = l->t + 4*Nt;
+	double* restrict const az = l->t + 5*Nt;
+	for (int c=0; c<l->cells_N; c++){
+		const struct reb_treecell* const node = l->cells[c];
+		for (int i=0; i<n; i++){
+			reb_gravity_cell_acceleration(node, G, softening2, x[i]-node->mx, y[i]-node->my, z[i]-node->mz, order, &ax[i], &ay[i], &az[i]);
+		}
+	}
+	const int Ns = l->sources_Nmax;
+	const double* restrict const sx = l->s;
+	const double* restrict const sy = l->s + Ns;
+	const double* restrict const sz = l->s + 2*Ns;
+	const double* restrict const sm = l->s + 3*Ns;
+	for (int j=0; j<l->sources_N; j++){
+		reb_gravity_basic_kernel(0, n, x, y, z, ax, ay, az, sx[j], sy[j], sz[j], G*sm[j], softening2);
+	}
+}
+static void reb_gravity_tree_evaluate_lists_monopole(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l){
+	reb_gravity_tree_evaluate_lists(r, l, 0);
+}
+static void reb_gravity_tree_evaluate_lists_quadrupole(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l){
+	reb_gravity_tree_evaluate_lists(r, l, 2);
+}
+static void reb_gravity_tree_evaluate_lists_octupole(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l){
+	reb_gravity_tree_evaluate_lists(r, l, 3);
+}
+
+/**
+ * @brief Number of interactions summed in single precision before the partial sums are added to the double precision accelerations.
+ */
+#define REB_GRAVITY_MIXED_BLOCK 64
+
+/**
+  * @brief Single precision version of reb_gravity_basic_kernel().
+  * @details Positions are relative to the first target of the group, so that single precision suffices for the separations.
+  */
+static inline void reb_gravity_basic_kernel_float(const int i0, const int i1, const float* restrict const x, const float* restrict const y, const float* restrict const z, float* restrict const ax, float* restrict const ay, float* restrict const az, const float xj, const float yj, const float zj, const float Gmj, const float softening2){
+	for (int i=i0; i<i1; i++){
+		const float dx = x[i] - xj;
+		const float dy = y[i] - yj;
+		const float dz = z[i] - zj;
+		const float r2 = dx*dx + dy*dy + dz*dz + softening2;
+		const float _r = sqrtf(r2);
+		const float prefact = -Gmj/(r2*_r);
+		ax[i] += prefact*dx;
+		ay[i] += prefact*dy;
+		az[i] += prefact*dz;
+	}
+}
+
+/**
+  * @brief Adds the acceleration of one cell to all n targets in single precision.
+  * @details Same expansion as reb_gravity_cell_acceleration(). The loop body contains no function
+  * calls so that the compiler can vectorize it.
+  * @param c Moments of the cell in single precision: G*m, followed by G times the quadrupole (6) and octupole (10) components.
+  * @param cx Position of the center of mass of the cell relative to the first target (cy, cz analogous).
+  * @param order Multipole order (0, 2 or 3). Only called with constant values.
+  */
+static inline void reb_gravity_cell_kernel_float(const int n, const float* restrict const x, const float* restrict const y, const float* restrict const z, float* restrict const ax, float* restrict const ay, float* restrict const az, const float* restrict const c, const float cx, const float cy, const float cz, const float softening2, const int order){
+	const float Gm = c[0];
+	const float* const Q = c+1;
+	const float* const O = c+7;
+	for (int i=0; i<n; i++){
+		const float dx = x[i] - cx;
+		const float dy = y[i] - cy;
+		const float dz = z[i] - cz;
+		const float r2 = dx*dx + dy*dy + dz*dz;
+		const float _r = sqrtf(r2 + softening2);
+		const float _r2 = _r*_r;
+		const float r3inv = 1.f/(_r2*_r);
+		float prefact = -Gm*r3inv;
+		float fx = 0.f;
+		float fy = 0.f;
+		float fz = 0.f;
+		if (order>=2){
+			const float qprefact = r3inv/_r2;
+			const float qx = dx*Q[0] + dy*Q[1] + dz*Q[2];
+			const float qy = dx*Q[1] + dy*Q[3] + dz*Q[4];
+			const float qz = dx*Q[2] + dy*Q[4] + dz*Q[5];
+			const float mrr = dx*qx + dy*qy + dz*qz;
+			fx += qprefact*qx; 
+			fy += qprefact*qy; 
+			fz += qprefact*qz; 
+			prefact += -2.5f/_r2*mrr*qprefact;
+		}
+		if (order>=3){
+			const float oprefact = r3inv/(_r2*_r2);
+			// O_ijk r_j r_k
+			const float ox = O[0]*dx*dx + O[3]*dy*dy + O[5]*dz*dz + 2.f*(O[1]*dx*dy + O[2]*dx*dz + O[4]*dy*dz);
+			const float oy = O[1]*dx*dx + O[6]*dy*dy + O[8]*dz*dz + 2.f*(O[3]*dx*dy + O[4]*dx*dz + O[7]*dy*dz);
+			const float oz = O[2]*dx*dx + O[7]*dy*dy + O[9]*dz*dz + 2.f*(O[4]*dx*dy + O[5]*dx*dz + O[8]*dy*dz);
+			const float mrrr = dx*ox + dy*oy + dz*oz;
+			fx += 0.5f*oprefact*ox; 
+			fy += 0.5f*oprefact*oy; 
+			fz += 0.5f*oprefact*oz; 
+			prefact += -7.f/(6.f*_r2)*mrrr*oprefact;
+		}
+		ax[i] += fx + prefact*dx; 
+		ay[i] += fy + prefact*dy; 
+		az[i] += fz + prefact*dz; 
+	}
+}
+
+/**
+  * @brief Adds the single precision partial accelerations to the double precision accelerations and resets them.
+  */
+static inline void reb_gravity_tree_flush_float(struct reb_gravity_tree_lists* const l){
+	const int n = l->targets_N;
+	const int Nt = l->targets_Nmax;
+	double* restrict const ax = l->t + 3*Nt;
+	double* restrict const ay = l->t + 4*Nt;
+	double* restrict const az = l->t + 5*Nt;
+	float* restrict const axf = l->tf + 3*Nt;
+	float* restrict const ayf = l->tf + 4*Nt;
+	float* restrict const azf = l->tf + 5*Nt;
+	for (int i=0; i<n; i++){
+		ax[i] += axf[i];
+		ay[i] += ayf[i];
+		az[i] += azf[i];
+		axf[i] = 0.f;
+		ayf[i] = 0.f;
+		azf[i] = 0.f;
+	}
+}
+
+/**
+  * @brief Single precision version of reb_gravity_tree_evaluate_lists(), used if gravity_mixed_precision is set.
+  * @details Targets, cells and sources are converted to positions relative to the first target once per list.
+  * The loops over the targets are then evaluated entirely in single precision. The partial sums are
+  * added to the double precision accelerations every REB_GRAVITY_MIXED_BLOCK interactions.
+  * @param order Multipole order (0, 2 or 3). Only called with constant values, see below.
+  */
+static inline void reb_gravity_tree_evaluate_lists_float(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l, const int order){
+	const double G = r->G;
+	const float softening2 = (float)(r->softening*r->softening);
+	const int n = l->targets_N;
+	const int Nt = l->targets_Nmax;
+	const double* restrict const x  = l->t;
+	const double* restrict const y  = l->t + Nt;
+	const double* restrict const z  = l->t + 2*Nt;
+	float* restrict const xf = l->tf;
+	float* restrict const yf = l->tf + Nt;
+	float* restrict const zf = l->tf + 2*Nt;
+	float* restrict const axf = l->tf + 3*Nt;
+	float* restrict const ayf = l->tf + 4*Nt;
+	float* restrict const azf = l->tf + 5*Nt;
+	const double ox = x[0];
+	const double oy = y[0];
+	const double oz = z[0];
+	for (int i=0; i<n; i++){
+		xf[i] = (float)(x[i]-ox);
+		yf[i] = (float)(y[i]-oy);
+		zf[i] = (float)(z[i]-oz);
+		axf[i] = 0.f;
+		ayf[i] = 0.f;
+		azf[i] = 0.f;
+	}
+	int k = 0;
+	for (int c=0; c<l->cells_N; c++){
+		const struct reb_treecell* const node = l->cells[c];
+		float cf[17];
+		cf[0] = (float)(G*node->m);
+		if (order>=2){
+			for (int q=0; q<6; q++){
+				cf[1+q] = (float)(G*node->mp[q]);
+			}
+		}
+		if (order>=3){
+			for (int q=0; q<10; q++){
+				cf[7+q] = (float)(G*node->mp[6+q]);
+			}
+		}
+		const float cx = (float)(node->mx-ox);
+		const float cy = (float)(node->my-oy);
+		const float cz = (float)(node->mz-oz);
+		reb_gravity_cell_kernel_float(n, xf, yf, zf, axf, ayf, azf, cf, cx, cy, cz, softening2, order);
+		if (++k==REB_GRAVITY_MIXED_BLOCK){
+			reb_gravity_tree_flush_float(l);
+			k = 0;
+		}
+	}
+	const int Ns = l->sources_Nmax;
+	const double* restrict const sx = l->s;
+	const double* restrict const sy = l->s + Ns;
+	const double* restrict const sz = l->s + 2*Ns;
+	const double* restrict const sm = l->s + 3*Ns;
+	for (int j=0; j<l->sources_N; j++){
+		reb_gravity_basic_kernel_float(0, n, xf, yf, zf, axf, ayf, azf, (float)(sx[j]-ox), (float)(sy[j]-oy), (float)(sz[j]-oz), (float)(G*sm[j]), softening2);
+		if (++k==REB_GRAVITY_MIXED_BLOCK){
+			reb_gravity_tree_flush_float(l);
+			k = 0;
+		}
+	}
+	reb_gravity_tree_flush_float(l);
+}
+static void reb_gravity_tree_evaluate_lists_float_monopole(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l){
+	reb_gravity_tree_evaluate_lists_float(r, l, 0);
+}
+static void reb_gravity_tree_evaluate_lists_float_quadrupole(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l){
+	reb_gravity_tree_evaluate_lists_float(r, l, 2);
+}
+static void reb_gravity_tree_evaluate_lists_float_octupole(const struct reb_simulation* const r, struct reb_gravity_tree_lists* const l){
+	reb_gravity_tree_evaluate_lists_float(r, l, 3);
+}
+
+static void reb_calculate_acceleration_tree_groups(struct reb_simulation* const r){
+	struct reb_particle* const particles = r->particles;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	const struct reb_treecell** groups = NULL;
+	int groups_N = 0;
+	int groups_Nmax = 0;
+	for(int i=0;i<r->root_n;i++){
+#ifdef MPI
+		if (reb_communication_mpi_rootbox_is_local(r, i)==0) continue;
+#endif // MPI
+		if (r->tree_root[i]!=NULL){
+			reb_gravity_tree_collect_groups(r, r->tree_root[i], &groups, &groups_N, &groups_Nmax);
+		}
+	}
+#pragma omp parallel
+	{
+	struct reb_gravity_tree_lists l = {0};
+#pragma omp for schedule(dynamic)
+	for (int g=0; g<groups_N; g++){
+		const struct reb_treecell* const group = groups[g];
+		l.targets_N = 0;
+		reb_gravity_tree_collect_targets(&l, group);
+		const int n = l.targets_N;
+		// The relative opening criterion uses the smallest allowed error in the group.
+		double aerr = INFINITY;
+		for (int i=0; i<n; i++){
+			aerr = fmin(aerr, reb_gravity_tree_aerr(r, l.targets[i]));
+		}
+		const int Nt = l.targets_Nmax;
+		double* const x  = l.t;
+		double* const y  = l.t + Nt;
+		double* const z  = l.t + 2*Nt;
+		double* const ax = l.t + 3*Nt;
+		double* const ay = l.t + 4*Nt;
+		double* const az = l.t + 5*Nt;
+		for (int i=0; i<n; i++){
+			ax[i] = 0.;
+			ay[i] = 0.;
+			az[i] = 0.;
+		}
+		for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+		for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+		for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+			const struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+			// Bounding sphere of the shifted targets
+			double min[3] = {INFINITY, INFINITY, INFINITY};
+			double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+			for (int i=0; i<n; i++){
+				const struct reb_particle p = particles[l.targets[i]];
+				x[i] = p.x + gb.shiftx;
+				y[i] = p.y + gb.shifty;
+				z[i] = p.z + gb.shiftz;
+				min[0] = fmin(min[0], x[i]); max[0] = fmax(max[0], x[i]);
+				min[1] = fmin(min[1], y[i]); max[1] = fmax(max[1], y[i]);
+				min[2] = fmin(min[2], z[i]); max[2] = fmax(max[2], z[i]);
+			}
+			const double cx = 0.5*(min[0]+max[0]);
+			const double cy = 0.5*(min[1]+max[1]);
+			const double cz = 0.5*(min[2]+max[2]);
+			const double R = 0.5*sqrt((max[0]-min[0])*(max[0]-min[0]) + (max[1]-min[1])*(max[1]-min[1]) + (max[2]-min[2])*(max[2]-min[2]));
+			const int shifted = (gbx!=0 || gby!=0 || gbz!=0);
+			l.cells_N = 0;
+			l.sources_N = 0;
+			l.self = 0;
+			for(int i=0;i<r->root_n;i++){
+				if (r->tree_root[i]!=NULL){
+					reb_gravity_tree_walk_group(r, &l, r->tree_root[i], group, shifted, cx, cy, cz, R, aerr);
+				}
+			}
+			if (r->gravity_mixed_precision){
+				switch (r->tree_multipole_N){
+					case 0:
+						reb_gravity_tree_evaluate_lists_float_monopole(r, &l);
+						break;
+					case 6:
+						reb_gravity_tree_evaluate_lists_float_quadrupole(r, &l);
+						break;
+					default:
+						reb_gravity_tree_evaluate_lists_float_octupole(r, &l);
+						break;
+				}
+			}else{
+				switch (r->tree_multipole_N){
+					case 0:
+						reb_gravity_tree_evaluate_lists_monopole(r, &l);
+						break;
+					case 6:
+						reb_gravity_tree_evaluate_lists_quadrupole(r, &l);
+						break;
+					default:
+						reb_gravity_tree_evaluate_lists_octupole(r, &l);
+						break;
+				}
+			}
+			if (l.self && r->gravity_mixed_precision){
+				// Direct summation within the group in single precision, the relative positions are still in tf.
+				// Groups are small (tree_group_size), the partial sums are added once at the end.
+				const float* const xf = l.tf;
+				const float* const yf = l.tf + Nt;
+				const float* const zf = l.tf + 2*Nt;
+				float* const axf = l.tf + 3*Nt;
+				float* const ayf = l.tf + 4*Nt;
+				float* const azf = l.tf + 5*Nt;
+				const float softening2f = (float)softening2;
+				for (int j=0; j<n; j++){
+					const float Gmj = (float)(G*particles[l.targets[j]].m);
+					reb_gravity_basic_kernel_float(0, j, xf, yf, zf, axf, ayf, azf, xf[j], yf[j], zf[j], Gmj, softening2f);
+					reb_gravity_basic_kernel_float(j+1, n, xf, yf, zf, axf, ayf, azf, xf[j], yf[j], zf[j], Gmj, softening2f);
+				}
+				reb_gravity_tree_flush_float(&l);
+			}else if (l.self){
+				// Direct summation within the group, skipping the target itself.
+				for (int j=0; j<n; j++){
+					const struct reb_particle pj = particles[l.targets[j]];
+					const double Gmj = G*pj.m;
+					reb_gravity_basic_kernel(0, j, x, y, z, ax, ay, az, pj.x, pj.y, pj.z, Gmj, softening2);
+					reb_gravity_basic_kernel(j+1, n, x, y, z, ax, ay, az, pj.x, pj.y, pj.z, Gmj, softening2);
+				}
+			}
+		}
+		}
+		}
+		for (int i=0; i<n; i++){
+			particles[l.targets[i]].ax = ax[i];
+			particles[l.targets[i]].ay = ay[i];
+			particles[l.targets[i]].az = az[i];
+		}
+	}
+	free(l.targets);
+	free(l.t);
+	free(l.tf);
+	free(l.cells);
+	free(l.s);
+	}
+	free(groups);
+}
+
+static void reb_gravity_ewald_table_init(struct reb_simulation* const r){
+	const struct reb_vec3d L = r->boxsize;
+	if (r->gravity_ewald_table!=NULL && L.x==r->gravity_ewald_table_boxsize.x && L.y==r->gravity_ewald_table_boxsize.y && L.z==r->gravity_ewald_table_boxsize.z){
+		return;
+	}
+	const int n = REB_EWALD_N+1;
+	r->gravity_ewald_table = realloc(r->gravity_ewald_table, sizeof(double)*3*n*n*n);
+	r->gravity_ewald_table_boxsize = L;
+	double* const table = r->gravity_ewald_table;
+	// Splitting parameter and cutoffs. Both sums converge well below the interpolation
+	// error of the table: erfc(alpha*rcut) = erfc(4) and exp(-kcut^2/(4*alpha^2)) = exp(-16).
+	const double alpha = 2./MIN(L.x,MIN(L.y,L.z));
+	const double rcut = 4./alpha;
+	const double kcut = 8.*alpha;
+	const int nx = (int)ceil(rcut/L.x)+1;
+	const int ny = (int)ceil(rcut/L.y)+1;
+	const int nz = (int)ceil(rcut/L.z)+1;
+	const int hx = (int)ceil(kcut*L.x/(2.*M_PI));
+	const int hy = (int)ceil(kcut*L.y/(2.*M_PI));
+	const int hz = (int)ceil(kcut*L.z/(2.*M_PI));
+	const double V = L.x*L.y*L.z;
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<n*n*n; i++){
+		const int ix = i/(n*n);
+		const int iy = (i/n)%n;
+		const int iz = i%n;
+		const double x = 0.5*L.x*(double)ix/(double)REB_EWALD_N;
+		const double y = 0.5*L.y*(double)iy/(double)REB_EWALD_N;
+		const double z = 0.5*L.z*(double)iz/(double)REB_EWALD_N;
+		double ax = 0.;
+		double ay = 0.;
+		double az = 0.;
+		if (ix || iy || iz){ // The correction vanishes at the origin by symmetry.
+			// Real space sum over all images
+			for (int bx=-nx; bx<=nx; bx++){
+			for (int by=-ny; by<=ny; by++){
+			for (int bz=-nz; bz<=nz; bz++){
+				const double dx = x - L.x*bx;
+				const double dy = y - L.y*by;
+				const double dz = z - L.z*bz;
+				const double r2 = dx*dx + dy*dy + dz*dz;
+				if (r2>rcut*rcut) continue;
+				const double _r = sqrt(r2);
+				const double g = 2.*alpha*_r/sqrt(M_PI)*exp(-alpha*alpha*r2);
+				double f;
+				if (bx==0 && by==0 && bz==0){
+					// The nearest image itself is not part of the correction.
+					f = (g - erf(alpha*_r))/(r2*_r);
+				}else{
+					f = (g + erfc(alpha*_r))/(r2*_r);
+				}
+				ax -= f*dx;
+				ay -= f*dy;
+				az -= f*dz;
+			}
+			}
+			}
+			// Fourier space sum
+			for (int kx=-hx; kx<=hx; kx++){
+			for (int ky=-hy; ky<=hy; ky++){
+			for (int kz=-hz; kz<=hz; kz++){
+				if (kx==0 && ky==0 && kz==0) continue;
+				const double Kx = 2.*M_PI*kx/L.x;
+				const double Ky = 2.*M_PI*ky/L.y;
+				const double Kz = 2.*M_PI*kz/L.z;
+				const double k2 = Kx*Kx + Ky*Ky + Kz*Kz;
+				if (k2>kcut*kcut) continue;
+				const double f = 4.*M_PI/V*exp(-k2/(4.*alpha*alpha))/k2*sin(Kx*x + Ky*y + Kz*z);
+				ax -= f*Kx;
+				ay -= f*Ky;
+				az -= f*Kz;
+			}
+			}
+			}
+		}
+		table[3*i+0] = ax;
+		table[3*i+1] = ay;
+		table[3*i+2] = az;
+	}
+}
+
+/**
+  * @brief Constants and accumulators used while evaluating Ewald summation for one particle.
+  * @details Copied from the simulation so that the compiler does not need to reload them 
+  * after every update of the accumulated acceleration.
+  */
+struct reb_gravity_ewald {
+	const double* table;	/**< Ewald correction table */
+	double L[3];		/**< Box size */
+	double s[3];		/**< Number of table grid intervals per unit length */
+	double G;		/**< Gravitational constant */
+	double softening2;	/**< Square of the softening length */
+	double opening_angle2;	/**< Square of the opening angle (tree only) */
+	double w_correction;	/**< Cells up to this width get the correction for their periodic images as a whole (tree only) */
+	int pt;			/**< Index of the particle the acceleration is calculated for */
+	double x, y, z;		/**< Position of the particle */
+	double ax, ay, az;	/**< Accumulated acceleration */
+};
+
+static struct reb_gravity_ewald reb_gravity_ewald_init(const struct reb_simulation* const r){
+	struct reb_gravity_ewald e;
+	e.table = r->gravity_ewald_table;
+	e.L[0] = r->boxsize.x;
+	e.L[1] = r->boxsize.y;
+	e.L[2] = r->boxsize.z;
+	for (int k=0; k<3; k++){
+		e.s[k] = 2.*REB_EWALD_N/e.L[k];
+	}
+	e.G = r->G;
+	e.softening2 = r->softening*r->softening;
+	e.opening_angle2 = r->opening_angle2;
+	e.w_correction = 0.25*MIN(e.L[0],MIN(e.L[1],e.L[2]));
+	e.pt = -1;
+	e.x = 0.;
+	e.y = 0.;
+	e.z = 0.;
+	return e;
+}
+
+/**
+  * @brief Returns the nearest periodic image of a coordinate difference.
+  * @details Positions are inside the box (up to one drift step), so one shift suffices.
+  */
+static inline double reb_gravity_ewald_nearest(double d, const double L){
+	if (d>0.5*L){
+		d -= L;
+	}else if (d<-0.5*L){
+		d += L;
+	}
+	return d;
+}
+
+/**
+  * @brief Adds the acceleration due to the periodic images of a point mass, except for the nearest one.
+  * @details Trilinear interpolation in the Ewald table. The table only covers positive 
+  * coordinates, the x component of the correction is odd in dx and even in dy and dz.
+  * @param dx Nearest image of the position of the target relative to the source (dy and dz analogous).
+  * @param m Mass of the source.
+  */
+static inline void reb_gravity_ewald_correction(struct reb_gravity_ewald* const e, const double dx, const double dy, const double dz, const double m){
+	const double Gm = e->G*m;
+	const double ux = fabs(dx)*e->s[0];
+	const double uy = fabs(dy)*e->s[1];
+	const double uz = fabs(dz)*e->s[2];
+	const int i = MIN((int)ux, REB_EWALD_N-1);
+	const int j = MIN((int)uy, REB_EWALD_N-1);
+	const int k = MIN((int)uz, REB_EWALD_N-1);
+	const double fx = ux - i;
+	const double fy = uy - j;
+	const double fz = uz - k;
+	const int n = REB_EWALD_N+1;
+	const double* const t = e->table + 3*((i*n+j)*n+k);
+	const int di = 3*n*n;
+	const int dj = 3*n;
+	double c[3];
+	for (int d=0; d<3; d++){
+		// Interpolate in z, then y, then x.
+		const double c00 = t[d]       + fz*(t[3+d]       - t[d]);
+		const double c01 = t[dj+d]    + fz*(t[dj+3+d]    - t[dj+d]);
+		const double c10 = t[di+d]    + fz*(t[di+3+d]    - t[di+d]);
+		const double c11 = t[di+dj+d] + fz*(t[di+dj+3+d] - t[di+dj+d]);
+		const double c0 = c00 + fy*(c01 - c00);
+		const double c1 = c10 + fy*(c11 - c10);
+		c[d] = Gm*(c0 + fx*(c1 - c0));
+	}
+	e->ax += dx<0.?-c[0]:c[0];
+	e->ay += dy<0.?-c[1]:c[1];
+	e->az += dz<0.?-c[2]:c[2];
+}
+
+/**
+  * @brief Adds the acceleration due to the nearest image of a point mass.
+  * @param dx Nearest image of the position of the target relative to the source (dy and dz analogous).
+  * @param r2 Square of the distance.
+  * @param m Mass of the source.
+  */
+static inline void reb_gravity_ewald_nearest_point(struct reb_gravity_ewald* const e, const double dx, const double dy, const double dz, const double r2, const double m){
+	const double _r = sqrt(r2 + e->softening2);
+	const double prefact = -e->G*m/(_r*_r*_r);
+	e->ax += prefact*dx;
+	e->ay += prefact*dy;
+	e->az += prefact*dz;
+}
+
+static void reb_calculate_acceleration_ewald_basic(struct reb_simulation* const r, const int _N_start, const int _N_active, const int _N_real){
+	struct reb_particle* const particles = r->particles;
+	const unsigned int _gravity_ignore_10 = r->gravity_ignore_10;
+	const int _testparticle_type = r->testparticle_type;
+	const struct reb_gravity_ewald e0 = reb_gravity_ewald_init(r);
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<_N_real; i++){
+		struct reb_gravity_ewald e = e0;
+		e.ax = 0.;
+		e.ay = 0.;
+		e.az = 0.;
+		if (i>=_N_start){
+			// Testparticles only act on massive particles if testparticle_type is 1.
+			const int j1 = (_testparticle_type && i<_N_active)?_N_real:_N_active;
+			for (int j=_N_start; j<j1; j++){
+				if (j==i) continue;
+				if (_gravity_ignore_10 && ((i==1 && j==0) || (i==0 && j==1))) continue;
+				const double dx = reb_gravity_ewald_nearest(particles[i].x - particles[j].x, e.L[0]);
+				const double dy = reb_gravity_ewald_nearest(particles[i].y - particles[j].y, e.L[1]);
+				const double dz = reb_gravity_ewald_nearest(particles[i].z - particles[j].z, e.L[2]);
+				reb_gravity_ewald_nearest_point(&e, dx, dy, dz, dx*dx + dy*dy + dz*dz, particles[j].m);
+				reb_gravity_ewald_correction(&e, dx, dy, dz, particles[j].m);
+			}
+		}
+		particles[i].ax = e.ax;
+		particles[i].ay = e.ay;
+		particles[i].az = e.az;
+	}
+}
+
+/**
+  * @brief Walks the tree for one particle, using the nearest image of every cell.
+  * @details The correction for the periodic images is smooth on the scale of the box. It is 
+  * therefore applied once for the first cell on the way down that is smaller than w_correction 
+  * and does not contain the particle, or for accepted cells and particles if no such cell was found.
+  * @param order Multipole order (0, 2 or 3).
+  * @param corrected 1 if the correction has already been applied for a parent cell.
+  */
+static void reb_gravity_ewald_tree_walk(struct reb_gravity_ewald* const e, const struct reb_treecell* const node, const int order, int corrected){
+	const double dx = reb_gravity_ewald_nearest(e->x - node->mx, e->L[0]);
+	const double dy = reb_gravity_ewald_nearest(e->y - node->my, e->L[1]);
+	const double dz = reb_gravity_ewald_nearest(e->z - node->mz, e->L[2]);
+	const double r2 = dx*dx + dy*dy + dz*dz;
+	if (node->pt < 0){ // Not a leaf
+		if (node->w*node->w > e->opening_angle2*r2){
+			if (!corrected && node->w<=e->w_correction){
+				// The correction is only smooth if all particles of the cell have the same
+				// nearest image. The cell must therefore neither contain the particle nor 
+				// straddle the boundary of the nearest image box.
+				const double h = 0.5*node->w;
+				const double cx = fabs(reb_gravity_ewald_nearest(e->x - node->x, e->L[0]));
+				const double cy = fabs(reb_gravity_ewald_nearest(e->y - node->y, e->L[1]));
+				const double cz = fabs(reb_gravity_ewald_nearest(e->z - node->z, e->L[2]));
+				if ((cx>h || cy>h || cz>h) && cx+h<0.5*e->L[0] && cy+h<0.5*e->L[1] && cz+h<0.5*e->L[2]){
+					reb_gravity_ewald_correction(e, dx, dy, dz, node->m);
+					corrected = 1;
+				}
+			}
+			for (int o=0; o<8; o++){
+				if (node->oct[o] != NULL){
+					reb_gravity_ewald_tree_walk(e, node->oct[o], order, corrected);
+				}
+			}
+		}else{
+			// The correction is smooth across the nearest image boundary, so cells 
+			// straddling it are accepted. See gravity_ewald in rebound.h for the error.
+			if (order>=2){
+				reb_gravity_cell_acceleration(node, e->G, e->softening2, dx, dy, dz, order, &e->ax, &e->ay, &e->az);
+			}else{
+				reb_gravity_ewald_nearest_point(e, dx, dy, dz, r2, node->m);
+			}
+			if (!corrected){
+				reb_gravity_ewald_correction(e, dx, dy, dz, node->m);
+			}
+		}
+	}else{ // It's a leaf node
+		if (node->pt == e->pt) return;
+		reb_gravity_ewald_nearest_point(e, dx, dy, dz, r2, node->m);
+		if (!corrected){
+			reb_gravity_ewald_correction(e, dx, dy, dz, node->m);
+		}
+	}
+}
+
+static void reb_calculate_acceleration_ewald_tree(struct reb_simulation* const r){
+	struct reb_particle* const particles = r->particles;
+	const int N = r->N;
+	const int order = r->tree_multipole_N==0?0:(r->tree_multipole_N==6?2:3);
+	const struct reb_gravity_ewald e0 = reb_gravity_ewald_init(r);
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<N; i++){
+		struct reb_gravity_ewald e = e0;
+		e.pt = i;
+		e.x = particles[i].x;
+		e.y = particles[i].y;
+		e.z = particles[i].z;
+		e.ax = 0.;
+		e.ay = 0.;
+		e.az = 0.;
+		for (int k=0; k<r->root_n; k++){
+			const struct reb_treecell* const node = r->tree_root[k];
+			if (node!=NULL){
+				reb_gravity_ewald_tree_walk(&e, node, order, 0);
+			}
+		}
+		particles[i].ax = e.ax;
+		particles[i].ay = e.ay;
+		particles[i].az = e.az;
+	}
+}
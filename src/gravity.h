@@ -38,4 +38,10 @@ void reb_calculate_acceleration(struct reb_simulation* r);
   */
 void reb_calculate_acceleration_var(struct reb_simulation* r);
 
+/**
+  * @brief Number of grid intervals per half box length of the Ewald correction table.
+  * @details The table has (REB_EWALD_N+1)^3 entries with three components each.
+  */
+#define REB_EWALD_N 32
+
 #endif
@@ -0,0 +1,676 @@
+/**
+ * @file 	gravity_fmm.c
+ * @brief 	Fast multipole method for self-gravity, O(N).
+ * @author 	agent <agent@local>
+ *
+ * @details 	This file implements a Cartesian fast multipole method
+ * (see e.g. Dehnen 2002, J. Comput. Phys. 179, 27). It uses the same
+ * oct-tree and root boxes as REB_GRAVITY_TREE. The tree is first
+ * copied into a flat array of cells. Cells with at most REB_FMM_LEAF_SIZE
+ * particles are leaves. Multipole moments are calculated in an upward
+ * pass. A dual tree walk then lets cells interact with each other. Well separated
+ * cells contribute to the local expansion of the sink cell (M2L),
+ * nearby or small leaves interact directly (P2P). Finally, the local expansions are
+ * propagated down the tree and evaluated at the particle positions.
+ *
+ * Expansions are Taylor series in Cartesian coordinates up to total order
+ * fmm_order. All symmetric tensors are stored as lists of multi-indices
+ * \f$\alpha=(\alpha_x,\alpha_y,\alpha_z)\f$ sorted by degree.
+ * Two cells A and B interact via their expansions if
+ * \f$ r_A + r_B < \theta |z_A - z_B| \f$ where r is the radius of a cell
+ * around its centre of mass z and \f$\theta\f$ is fmm_opening_angle.
+ * The expansions use the same softened kernel \f$ (R^2+\epsilon^2)^{-1/2} \f$ 
+ * as the direct summation, so near and far field are consistent.
+ *
+ * With ghost boxes, the expansions also contain the images of a particle 
+ * itself. As in REB_GRAVITY_BASIC, particles must not interact with their
+ * own images. The direct part therefore includes them as well and their exact 
+ * contribution is subtracted at the end.
+ *
+ * The work is distributed using OpenMP tasks. Each task owns the
+ * sink cells it updates, thus no locks are required.
+ *
+ * @section LICENSE
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "particle.h"
+#include "rebound.h"
+#include "tree.h"
+#include "boundary.h"
+#include "gravity_fmm.h"
+
+/**
+ * @brief Number of coefficients of an expansion of order p.
+ */
+#define REB_FMM_NCOEF(p) (((p)+1)*((p)+2)*((p)+3)/6)
+#define REB_FMM_NCOEF_MAX REB_FMM_NCOEF(REB_FMM_ORDER_MAX)
+
+/**
+ * @brief Maximum number of particles in a leaf cell.
+ */
+#define REB_FMM_LEAF_SIZE 16
+
+/**
+ * @brief Pairs of leaves with at most this many particle pairs always interact directly.
+ */
+#define REB_FMM_P2P_MAX 64
+
+/**
+ * @brief Cells with fewer particles are processed by the current OpenMP task rather than spawning new tasks.
+ */
+#define REB_FMM_TASK_SIZE 512
+
+/**
+ * @brief One cell of the flattened tree used by the fast multipole method.
+ */
+struct reb_fmm_cell {
+	double x;	/**< x position of the expansion centre (centre of mass) */
+	double y;	/**< y position of the expansion centre (centre of mass) */
+	double z;	/**< z position of the expansion centre (centre of mass) */
+	double m;	/**< Total mass */
+	double rmax;	/**< Radius around the expansion centre which contains all particles */
+	double cx;	/**< x position of the geometric centre */
+	double cy;	/**< y position of the geometric centre */
+	double cz;	/**< z position of the geometric centre */
+	int first;	/**< Index of the first child in fmm_cells or, for leaves, of the first particle in fmm_particles */
+	int n;		/**< Number of children or, for leaves, number of particles */
+	int np;		/**< Total number of particles in the cell */
+	int leaf;	/**< 1 if the cell is a leaf */
+};
+
+/**
+ * @brief Multi-index tables shared by all simulations.
+ * @details Filled once by reb_fmm_table_init().
+ */
+static struct {
+	int initialized;				/**< 1 once the tables are filled */
+	int deg[REB_FMM_NCOEF_MAX];			/**< Degree of multi-index k */
+	int e[REB_FMM_NCOEF_MAX][3];			/**< Components of multi-index k */
+	int nm1[REB_FMM_NCOEF_MAX][3];			/**< Index of k-e_i, or -1 */
+	int nm2[REB_FMM_NCOEF_MAX][3];			/**< Index of k-2e_i, or -1 */
+	int pdir[REB_FMM_NCOEF_MAX];			/**< Direction used to calculate powers recursively */
+	int sum[REB_FMM_NCOEF_MAX][REB_FMM_NCOEF_MAX];	/**< Index of a+b, or -1 */
+	double csum[REB_FMM_NCOEF_MAX][REB_FMM_NCOEF_MAX];	/**< Product of binomial coefficients binom(a_i+b_i, a_i) */
+	int diff[REB_FMM_NCOEF_MAX][REB_FMM_NCOEF_MAX];	/**< Index of a-b, or -1 if b is not smaller than a */
+	double cdiff[REB_FMM_NCOEF_MAX][REB_FMM_NCOEF_MAX];	/**< Product of binomial coefficients binom(a_i, b_i) */
+} reb_fmm_table;
+
+static double reb_fmm_binomial(int n, int k){
+	double b = 1.;
+	for (int i=1; i<=k; i++){
+		b = b*(n-k+i)/i;
+	}
+	return b;
+}
+
+/**
+ * @brief Fills the multi-index tables.
+ */
+static void reb_fmm_table_fill(void){
+	int index[REB_FMM_ORDER_MAX+1][REB_FMM_ORDER_MAX+1][REB_FMM_ORDER_MAX+1];
+	int k = 0;
+	for (int d=0; d<=REB_FMM_ORDER_MAX; d++){
+		for (int a=d; a>=0; a--){
+			for (int b=d-a; b>=0; b--){
+				const int c = d-a-b;
+				reb_fmm_table.deg[k] = d;
+				reb_fmm_table.e[k][0] = a;
+				reb_fmm_table.e[k][1] = b;
+				reb_fmm_table.e[k][2] = c;
+				index[a][b][c] = k;
+				k++;
+			}
+		}
+	}
+	for (k=0; k<REB_FMM_NCOEF_MAX; k++){
+		const int* e = reb_fmm_table.e[k];
+		reb_fmm_table.pdir[k] = -1;
+		for (int i=2; i>=0; i--){
+			int f[3] = {e[0], e[1], e[2]};
+			f[i] -= 1;
+			reb_fmm_table.nm1[k][i] = f[i]>=0?index[f[0]][f[1]][f[2]]:-1;
+			if (f[i]>=0) reb_fmm_table.pdir[k] = i;
+			f[i] -= 1;
+			reb_fmm_table.nm2[k][i] = f[i]>=0?index[f[0]][f[1]][f[2]]:-1;
+		}
+		for (int l=0; l<REB_FMM_NCOEF_MAX; l++){
+			const int* g = reb_fmm_table.e[l];
+			if (reb_fmm_table.deg[k]+reb_fmm_table.deg[l]<=REB_FMM_ORDER_MAX){
+				reb_fmm_table.sum[k][l] = index[e[0]+g[0]][e[1]+g[1]][e[2]+g[2]];
+				reb_fmm_table.csum[k][l] = reb_fmm_binomial(e[0]+g[0],g[0])*reb_fmm_binomial(e[1]+g[1],g[1])*reb_fmm_binomial(e[2]+g[2],g[2]);
+			}else{
+				reb_fmm_table.sum[k][l] = -1;
+				reb_fmm_table.csum[k][l] = 0.;
+			}
+			if (g[0]<=e[0] && g[1]<=e[1] && g[2]<=e[2]){
+				reb_fmm_table.diff[k][l] = index[e[0]-g[0]][e[1]-g[1]][e[2]-g[2]];
+				reb_fmm_table.cdiff[k][l] = reb_fmm_binomial(e[0],g[0])*reb_fmm_binomial(e[1],g[1])*reb_fmm_binomial(e[2],g[2]);
+			}else{
+				reb_fmm_table.diff[k][l] = -1;
+				reb_fmm_table.cdiff[k][l] = 0.;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Fills the multi-index tables if this has not been done yet.
+ * @details Simulations running in different threads can call this at the same time. 
+ * The tables are filled inside a critical section and the flag is only set afterwards.
+ */
+static void reb_fmm_table_init(void){
+	int initialized;
+#pragma omp atomic read
+	initialized = reb_fmm_table.initialized;
+	if (initialized) return;
+#pragma omp critical (reb_fmm_table)
+	{
+		if (!reb_fmm_table.initialized){
+			reb_fmm_table_fill();
+#pragma omp flush
+#pragma omp atomic write
+			reb_fmm_table.initialized = 1;
+		}
+	}
+}
+
+/**
+ * @brief Calculates all monomials s^k up to degree p.
+ */
+static void reb_fmm_powers(double* const pw, const double sx, const double sy, const double sz, const int p){
+	const double s[3] = {sx, sy, sz};
+	const int nc = REB_FMM_NCOEF(p);
+	pw[0] = 1.;
+	for (int k=1; k<nc; k++){
+		const int d = reb_fmm_table.pdir[k];
+		pw[k] = pw[reb_fmm_table.nm1[k][d]]*s[d];
+	}
+}
+
+/**
+ * @brief Calculates the Taylor coefficients D^k((R^2+eps^2)^{-1/2})/k! up to degree p.
+ * @details Uses the recurrence relation
+ * \f$ |k| (R^2+\epsilon^2) b_k = -(2|k|-1) \sum_i R_i b_{k-e_i} - (|k|-1) \sum_i b_{k-2e_i} \f$,
+ * which follows from \f$ (R^2+\epsilon^2) \partial_i b_0 = -R_i b_0 \f$ and therefore
+ * holds for the softened kernel as well.
+ */
+static void reb_fmm_derivatives(double* const b, const double dx, const double dy, const double dz, const double softening2, const int p){
+	const double R[3] = {dx, dy, dz};
+	const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+	const double _r2 = 1./r2;
+	const int nc = REB_FMM_NCOEF(p);
+	b[0] = sqrt(_r2);
+	for (int k=1; k<nc; k++){
+		const int d = reb_fmm_table.deg[k];
+		double s1 = 0.;
+		double s2 = 0.;
+		for (int i=0; i<3; i++){
+			const int k1 = reb_fmm_table.nm1[k][i];
+			const int k2 = reb_fmm_table.nm2[k][i];
+			if (k1>=0) s1 += R[i]*b[k1];
+			if (k2>=0) s2 += b[k2];
+		}
+		b[k] = -((2*d-1)*s1 + (d-1)*s2)*_r2/d;
+	}
+}
+
+static inline double* reb_fmm_multipole(const struct reb_simulation* const r, const int c){
+	return r->fmm_coeffs + 2*REB_FMM_NCOEF(r->fmm_order)*c;
+}
+
+static inline double* reb_fmm_local(const struct reb_simulation* const r, const int c){
+	return r->fmm_coeffs + 2*REB_FMM_NCOEF(r->fmm_order)*c + REB_FMM_NCOEF(r->fmm_order);
+}
+
+/**
+ * @brief Returns the index of a new block of n consecutive cells.
+ */
+static int reb_fmm_allocate_cells(struct reb_simulation* const r, int* const Ncells, const int n){
+	const int c = *Ncells;
+	*Ncells += n;
+	if (r->fmm_cells_allocatedN<*Ncells){
+		r->fmm_cells_allocatedN = 2*(*Ncells);
+		r->fmm_cells = realloc(r->fmm_cells, sizeof(struct reb_fmm_cell)*r->fmm_cells_allocatedN);
+		if (r->fmm_cells==NULL){
+			reb_exit("Cannot allocate memory for FMM gravity calculation.");
+		}
+	}
+	return c;
+}
+
+static void reb_fmm_collect_particles(struct reb_simulation* const r, const struct reb_treecell* const node, int* const Nparticles){
+	if (node->pt>=0){
+		r->fmm_particles[(*Nparticles)++] = node->pt;
+		return;
+	}
+	for (int o=0; o<8; o++){
+		if (node->oct[o]!=NULL){
+			reb_fmm_collect_particles(r, node->oct[o], Nparticles);
+		}
+	}
+}
+
+/**
+ * @brief Copies the tree cell node into the flat array at index c.
+ */
+static void reb_fmm_build_cell(struct reb_simulation* const r, const struct reb_treecell* const node, const int c, int* const Ncells, int* const Nparticles){
+	struct reb_fmm_cell* cell = &(r->fmm_cells[c]);
+	cell->cx = node->x;
+	cell->cy = node->y;
+	cell->cz = node->z;
+	cell->np = node->pt<0?-node->pt:1;
+	if (cell->np<=REB_FMM_LEAF_SIZE){
+		cell->leaf  = 1;
+		cell->first = *Nparticles;
+		reb_fmm_collect_particles(r, node, Nparticles);
+		cell->n = *Nparticles - cell->first;
+		return;
+	}
+	int n = 0;
+	for (int o=0; o<8; o++){
+		if (node->oct[o]!=NULL) n++;
+	}
+	cell->leaf  = 0;
+	cell->n     = n;
+	const int first = reb_fmm_allocate_cells(r, Ncells, n);
+	// Array might have moved.
+	r->fmm_cells[c].first = first;
+	int k = first;
+	for (int o=0; o<8; o++){
+		if (node->oct[o]!=NULL){
+			reb_fmm_build_cell(r, node->oct[o], k, Ncells, Nparticles);
+			k++;
+		}
+	}
+}
+
+/**
+ * @brief Calculates centre of mass, radius and multipole moments (P2M and M2M). Clears the local expansion.
+ */
+static void reb_fmm_upward(struct reb_simulation* const r, const int c){
+	struct reb_fmm_cell* const cells = r->fmm_cells;
+	struct reb_fmm_cell* const cell = &(cells[c]);
+	const struct reb_particle* const particles = r->particles;
+	const int p = r->fmm_order;
+	const int nc = REB_FMM_NCOEF(p);
+	double* const M = reb_fmm_multipole(r, c);
+	double* const L = reb_fmm_local(r, c);
+	for (int k=0; k<nc; k++){
+		M[k] = 0.;
+		L[k] = 0.;
+	}
+	double m = 0., mx = 0., my = 0., mz = 0.;
+	if (cell->leaf){
+		for (int l=cell->first; l<cell->first+cell->n; l++){
+			const struct reb_particle pl = particles[r->fmm_particles[l]];
+			m  += pl.m;
+			mx += pl.m*pl.x;
+			my += pl.m*pl.y;
+			mz += pl.m*pl.z;
+		}
+	}else{
+		for (int l=cell->first; l<cell->first+cell->n; l++){
+			if (cells[l].np>REB_FMM_TASK_SIZE){
+#pragma omp task firstprivate(l)
+				reb_fmm_upward(r, l);
+			}else{
+				reb_fmm_upward(r, l);
+			}
+		}
+#pragma omp taskwait
+		for (int l=cell->first; l<cell->first+cell->n; l++){
+			m  += cells[l].m;
+			mx += cells[l].m*cells[l].x;
+			my += cells[l].m*cells[l].y;
+			mz += cells[l].m*cells[l].z;
+		}
+	}
+	cell->m = m;
+	if (m>0.){
+		cell->x = mx/m;
+		cell->y = my/m;
+		cell->z = mz/m;
+	}else{
+		cell->x = cell->cx;
+		cell->y = cell->cy;
+		cell->z = cell->cz;
+	}
+	// The radius is calculated from the particle positions rather than the cell geometry.
+	// Integrators such as IAS15 move particles between tree updates.
+	double pw[REB_FMM_NCOEF_MAX];
+	if (cell->leaf){
+		double rp2 = 0.;
+		for (int l=cell->first; l<cell->first+cell->n; l++){
+			const struct reb_particle pl = particles[r->fmm_particles[l]];
+			const double dx = cell->x - pl.x;
+			const double dy = cell->y - pl.y;
+			const double dz = cell->z - pl.z;
+			const double d2 = dx*dx + dy*dy + dz*dz;
+			if (d2>rp2) rp2 = d2;
+			if (pl.m==0.) continue;
+			// P2M
+			reb_fmm_powers(pw, dx, dy, dz, p);
+			for (int k=0; k<nc; k++){
+				M[k] += pl.m*pw[k];
+			}
+		}
+		cell->rmax = sqrt(rp2);
+	}else{
+		double rc = 0.;
+		for (int l=cell->first; l<cell->first+cell->n; l++){
+			const double dx = cell->x - cells[l].x;
+			const double dy = cell->y - cells[l].y;
+			const double dz = cell->z - cells[l].z;
+			const double d = sqrt(dx*dx + dy*dy + dz*dz) + cells[l].rmax;
+			if (d>rc) rc = d;
+			if (cells[l].m==0.) continue;
+			// M2M
+			const double* const Mc = reb_fmm_multipole(r, l);
+			reb_fmm_powers(pw, dx, dy, dz, p);
+			for (int ka=0; ka<nc; ka++){
+				double s = 0.;
+				for (int kg=0; kg<=ka; kg++){
+					const int kd = reb_fmm_table.diff[ka][kg];
+					if (kd<0) continue;
+					s += reb_fmm_table.cdiff[ka][kg]*pw[kd]*Mc[kg];
+				}
+				M[ka] += s;
+			}
+		}
+		cell->rmax = rc;
+	}
+}
+
+/**
+ * @brief Direct interaction of the particles in leaf A (source) with the particles in leaf B (sink, shifted by s).
+ * @details A particle interacts with its own images, see reb_fmm_remove_self_images().
+ */
+static void reb_fmm_p2p(struct reb_simulation* const r, const struct reb_fmm_cell* const A, const struct reb_fmm_cell* const B, const double sx, const double sy, const double sz){
+	struct reb_particle* const particles = r->particles;
+	const int* const fmm_particles = r->fmm_particles;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+	for (int li=B->first; li<B->first+B->n; li++){
+		const int i = fmm_particles[li];
+		const double xi = particles[i].x + sx;
+		const double yi = particles[i].y + sy;
+		const double zi = particles[i].z + sz;
+		double ax = 0., ay = 0., az = 0.;
+		const int central = sx==0. && sy==0. && sz==0.;
+		for (int lj=A->first; lj<A->first+A->n; lj++){
+			const int j = fmm_particles[lj];
+			if (central && i==j) continue;
+			const double dx = xi - particles[j].x;
+			const double dy = yi - particles[j].y;
+			const double dz = zi - particles[j].z;
+			const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+			const double _r = sqrt(r2);
+			const double prefact = -G*particles[j].m/(r2*_r);
+			ax += prefact*dx;
+			ay += prefact*dy;
+			az += prefact*dz;
+		}
+		particles[i].ax += ax;
+		particles[i].ay += ay;
+		particles[i].az += az;
+	}
+}
+
+/**
+ * @brief Dual tree walk. Adds the field of source cell a to sink cell b (shifted by s).
+ */
+static void reb_fmm_interact(struct reb_simulation* const r, const int a, const int b, const double sx, const double sy, const double sz){
+	const struct reb_fmm_cell* const A = &(r->fmm_cells[a]);
+	const struct reb_fmm_cell* const B = &(r->fmm_cells[b]);
+	if (A->m==0.) return;
+	const double dx = B->x - A->x + sx;
+	const double dy = B->y - A->y + sy;
+	const double dz = B->z - A->z + sz;
+	const double r2 = dx*dx + dy*dy + dz*dz;
+	const double rs = A->rmax + B->rmax;
+	// Direct summation is cheaper for pairs of small leaves.
+	const int direct = A->leaf && B->leaf && A->n*B->n<=REB_FMM_P2P_MAX;
+	if (!direct && rs*rs < r->fmm_opening_angle*r->fmm_opening_angle*r2){
+		// M2L
+		const int p = r->fmm_order;
+		const int nc = REB_FMM_NCOEF(p);
+		const double G = r->G;
+		const double* const M = reb_fmm_multipole(r, a);
+		double* const L = reb_fmm_local(r, b);
+		double D[REB_FMM_NCOEF_MAX];
+		reb_fmm_derivatives(D, dx, dy, dz, r->softening*r->softening, p);
+		for (int kb=0; kb<nc; kb++){
+			const int na = REB_FMM_NCOEF(p-reb_fmm_table.deg[kb]);
+			double s = 0.;
+			for (int ka=0; ka<na; ka++){
+				s += M[ka]*reb_fmm_table.csum[kb][ka]*D[reb_fmm_table.sum[kb][ka]];
+			}
+			L[kb] -= G*s;
+		}
+		return;
+	}
+	if (A->leaf && B->leaf){
+		reb_fmm_p2p(r, A, B, sx, sy, sz);
+		return;
+	}
+	if (A->leaf || (!B->leaf && B->rmax>=A->rmax)){
+		// Split sink. Children of b are independent.
+		for (int l=B->first; l<B->first+B->n; l++){
+			if (r->fmm_cells[l].np>REB_FMM_TASK_SIZE){
+#pragma omp task firstprivate(l)
+				reb_fmm_interact(r, a, l, sx, sy, sz);
+			}else{
+				reb_fmm_interact(r, a, l, sx, sy, sz);
+			}
+		}
+#pragma omp taskwait
+	}else{
+		// Split source
+		for (int l=A->first; l<A->first+A->n; l++){
+			reb_fmm_interact(r, l, b, sx, sy, sz);
+		}
+	}
+}
+
+/**
+ * @brief Shifts local expansions to the children (L2L) and evaluates them at the particle positions of leaves (L2P).
+ */
+static void reb_fmm_downward(struct reb_simulation* const r, const int c){
+	const struct reb_fmm_cell* const cell = &(r->fmm_cells[c]);
+	const int p = r->fmm_order;
+	const int nc = REB_FMM_NCOEF(p);
+	const double* const L = reb_fmm_local(r, c);
+	double pw[REB_FMM_NCOEF_MAX];
+	if (cell->leaf){
+		struct reb_particle* const particles = r->particles;
+		for (int l=cell->first; l<cell->first+cell->n; l++){
+			const int i = r->fmm_particles[l];
+			reb_fmm_powers(pw, particles[i].x - cell->x, particles[i].y - cell->y, particles[i].z - cell->z, p);
+			double a[3] = {0., 0., 0.};
+			for (int kb=1; kb<nc; kb++){
+				for (int d=0; d<3; d++){
+					const int k1 = reb_fmm_table.nm1[kb][d];
+					if (k1<0) continue;
+					a[d] -= L[kb]*reb_fmm_table.e[kb][d]*pw[k1];
+				}
+			}
+			particles[i].ax += a[0];
+			particles[i].ay += a[1];
+			particles[i].az += a[2];
+		}
+		return;
+	}
+	for (int l=cell->first; l<cell->first+cell->n; l++){
+		const struct reb_fmm_cell* const child = &(r->fmm_cells[l]);
+		double* const Lc = reb_fmm_local(r, l);
+		reb_fmm_powers(pw, child->x - cell->x, child->y - cell->y, child->z - cell->z, p);
+		for (int kg=0; kg<nc; kg++){
+			double s = 0.;
+			for (int kb=kg; kb<nc; kb++){
+				const int kd = reb_fmm_table.diff[kb][kg];
+				if (kd<0) continue;
+				s += reb_fmm_table.cdiff[kb][kg]*pw[kd]*L[kb];
+			}
+			Lc[kg] += s;
+		}
+		if (child->np>REB_FMM_TASK_SIZE){
+#pragma omp task firstprivate(l)
+			reb_fmm_downward(r, l);
+		}else{
+			reb_fmm_downward(r, l);
+		}
+	}
+#pragma omp taskwait
+}
+
+/**
+ * @brief Subtracts the acceleration of every particle due to its own images.
+ * @details The expansions cannot exclude single particles. Images of a particle itself 
+ * are therefore included everywhere and removed here, so that the result agrees with REB_GRAVITY_BASIC.
+ */
+static void reb_fmm_remove_self_images(struct reb_simulation* const r){
+	const int nimg = (2*r->nghostx+1)*(2*r->nghosty+1)*(2*r->nghostz+1);
+	if (nimg==1) return;
+	struct reb_ghostbox* const gbs = malloc(sizeof(struct reb_ghostbox)*nimg);
+	int n = 0;
+	for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+	for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+	for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+		if (gbx==0 && gby==0 && gbz==0) continue;
+		gbs[n++] = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+	}
+	}
+	}
+	struct reb_particle* const particles = r->particles;
+	const int N = r->N;
+	const double G = r->G;
+	const double softening2 = r->softening*r->softening;
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<N; i++){
+		double ax = 0., ay = 0., az = 0.;
+		for (int k=0; k<n; k++){
+			const double dx = gbs[k].shiftx;
+			const double dy = gbs[k].shifty;
+			const double dz = gbs[k].shiftz;
+			const double r2 = dx*dx + dy*dy + dz*dz + softening2;
+			const double _r = sqrt(r2);
+			const double prefact = -G*particles[i].m/(r2*_r);
+			ax += prefact*dx;
+			ay += prefact*dy;
+			az += prefact*dz;
+		}
+		particles[i].ax -= ax;
+		particles[i].ay -= ay;
+		particles[i].az -= az;
+	}
+	free(gbs);
+}
+
+void reb_gravity_fmm_calculate_acceleration(struct reb_simulation* const r){
+#ifdef MPI
+	reb_exit("REB_GRAVITY_FMM is not supported with MPI.");
+#endif // MPI
+	if (r->fmm_order<1 || r->fmm_order>REB_FMM_ORDER_MAX){
+		reb_exit("fmm_order needs to be between 1 and REB_FMM_ORDER_MAX.");
+	}
+	if (r->fmm_opening_angle<=0. || r->fmm_opening_angle>=1.){
+		reb_exit("fmm_opening_angle needs to be between 0 and 1.");
+	}
+	struct reb_particle* const particles = r->particles;
+	const int N = r->N;
+#pragma omp parallel for schedule(guided)
+	for (int i=0; i<N; i++){
+		particles[i].ax = 0;
+		particles[i].ay = 0;
+		particles[i].az = 0;
+	}
+	if (r->tree_root==NULL) return;
+	reb_fmm_table_init();
+
+	// Flatten tree. The first root_n cells are the root boxes.
+	const int root_n = r->root_n;
+	if (r->fmm_particles_allocatedN<N){
+		r->fmm_particles = realloc(r->fmm_particles, sizeof(int)*N);
+		r->fmm_particles_allocatedN = N;
+	}
+	int Ncells = 0;
+	int Nparticles = 0;
+	reb_fmm_allocate_cells(r, &Ncells, root_n);
+	for (int i=0; i<root_n; i++){
+		if (r->tree_root[i]==NULL){
+			struct reb_fmm_cell* const cell = &(r->fmm_cells[i]);
+			cell->np   = 0;
+			cell->n    = 0;
+			cell->leaf = 1;
+			cell->m    = 0.;
+		}else{
+			reb_fmm_build_cell(r, r->tree_root[i], i, &Ncells, &Nparticles);
+		}
+	}
+	const int Ncoeffs = 2*REB_FMM_NCOEF(r->fmm_order)*Ncells;
+	if (r->fmm_coeffs_allocatedN<Ncoeffs){
+		r->fmm_coeffs = realloc(r->fmm_coeffs, sizeof(double)*Ncoeffs);
+		r->fmm_coeffs_allocatedN = Ncoeffs;
+		if (r->fmm_coeffs==NULL){
+			reb_exit("Cannot allocate memory for FMM gravity calculation.");
+		}
+	}
+
+#pragma omp parallel
+#pragma omp single
+	{
+		// Upward pass
+		for (int i=0; i<root_n; i++){
+			if (r->fmm_cells[i].np==0) continue;
+#pragma omp task firstprivate(i)
+			reb_fmm_upward(r, i);
+		}
+#pragma omp taskwait
+		// Interactions. Each task owns one root box as a sink.
+		for (int i=0; i<root_n; i++){
+			if (r->fmm_cells[i].np==0) continue;
+#pragma omp task firstprivate(i)
+			{
+				for (int gbx=-r->nghostx; gbx<=r->nghostx; gbx++){
+				for (int gby=-r->nghosty; gby<=r->nghosty; gby++){
+				for (int gbz=-r->nghostz; gbz<=r->nghostz; gbz++){
+					const struct reb_ghostbox gb = reb_boundary_get_ghostbox(r, gbx,gby,gbz);
+					for (int j=0; j<root_n; j++){
+						if (r->fmm_cells[j].np==0) continue;
+						reb_fmm_interact(r, j, i, gb.shiftx, gb.shifty, gb.shiftz);
+					}
+				}
+				}
+				}
+			}
+		}
+#pragma omp taskwait
+		// Downward pass
+		for (int i=0; i<root_n; i++){
+			if (r->fmm_cells[i].np==0) continue;
+#pragma omp task firstprivate(i)
+			reb_fmm_downward(r, i);
+		}
+#pragma omp taskwait
+	}
+	reb_fmm_remove_self_images(r);
+}
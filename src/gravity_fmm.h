@@ -0,0 +1,41 @@
+/**
+ * @file 	gravity_fmm.h
+ * @brief 	Fast multipole method for self-gravity.
+ * @author 	agent <agent@local>
+ *
+ * @section 	LICENSE
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _GRAVITY_FMM_H
+#define _GRAVITY_FMM_H
+struct reb_simulation;
+
+/**
+ * @brief Maximum expansion order supported by REB_GRAVITY_FMM.
+ */
+#define REB_FMM_ORDER_MAX 6
+
+/**
+  * @brief Calculates the gravitational acceleration of all particles using the fast multipole method.
+  * @details Uses the tree structure of REB_GRAVITY_TREE. The tree needs to be up to date.
+  * @param r REBOUND simulation to operate on
+  */
+void reb_gravity_fmm_calculate_acceleration(struct reb_simulation* const r);
+
+#endif // _GRAVITY_FMM_H
@@ -0,0 +1,438 @@
+/**
+ * @file 	gravity_pm.c
+ * @brief 	Particle-mesh method for self-gravity, O(N + M log M).
+ * @author 	agent <agent@local>
+ *
+ * @details 	This file implements a particle-mesh (PM) Poisson solver
+ * for periodic and shearing sheet boxes (see Hockney & Eastwood 1981).
+ * The mass of the particles is assigned to a grid of pm_nx*pm_ny*pm_nz
+ * points with the cloud-in-cell (CIC) or triangular-shaped cloud (TSC)
+ * scheme. The potential is calculated in Fourier space, the assignment
+ * window is deconvolved and the acceleration is differentiated spectrally.
+ * The acceleration is interpolated back to the particles with the same scheme,
+ * so that particles do not accelerate themselves and momentum is conserved.
+ * If pm_nz is 1, the particles are treated as a razor thin sheet and only
+ * the acceleration in the x and y direction is calculated.
+ *
+ * Shearing sheet boxes are periodic in the sheared coordinates
+ * \f$ (x, y') \f$ with \f$ y' = y - s (x/L_x+1/2) \f$, where s is the
+ * shift of the ghostbox at \f$ x+L_x \f$ given by reb_boundary_get_ghostbox().
+ * The grid is aligned with the sheared coordinates. In Fourier space, the
+ * x component of the wave vector then depends on time: \f$ K_x = k_x - s k_y / L_x \f$.
+ * This treatment of the shearing sheet follows the time dependent wave vectors of 
+ * legacy/gravity_fft.c by Hanno Rein and Geoffroy Lesur.
+ *
+ * With FFTW=1 the transforms are performed by FFTW. Otherwise a bundled
+ * radix-2 transform is used, which requires all grid dimensions to be powers of two.
+ * Forces are not softened beyond the grid resolution, r->softening is ignored.
+ *
+ * @section LICENSE
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "particle.h"
+#include "rebound.h"
+#include "boundary.h"
+#include "gravity_pm.h"
+#ifdef FFTW
+#include <fftw3.h>
+#endif // FFTW
+
+/**
+ * @brief Maximum number of grid points per dimension covered by the assignment stencil (TSC).
+ */
+#define REB_PM_STENCIL_MAX 3
+
+#ifndef FFTW
+/**
+ * @brief In place radix-2 transform of n complex numbers (interleaved real and imaginary parts).
+ * @details Unnormalized, with the same sign convention as FFTW.
+ * @param a Data, 2*n doubles.
+ * @param n Length of the transform, a power of two.
+ * @param w Twiddle factors \f$ e^{\pm 2\pi i k/n} \f$ for k<n/2 (interleaved), with the sign of the transform.
+ */
+static void reb_pm_fft_1d(double* const a, const int n, const double* const w){
+	// Bit reversal permutation
+	for (int i=1, j=0; i<n; i++){
+		int bit = n>>1;
+		for (; j&bit; bit>>=1){
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i<j){
+			const double tr = a[2*i];
+			const double ti = a[2*i+1];
+			a[2*i]   = a[2*j];
+			a[2*i+1] = a[2*j+1];
+			a[2*j]   = tr;
+			a[2*j+1] = ti;
+		}
+	}
+	// Butterflies
+	for (int len=2; len<=n; len<<=1){
+		const int half = len/2;
+		const int step = n/len;
+		for (int i=0; i<n; i+=len){
+			for (int k=0; k<half; k++){
+				const double wr = w[2*k*step];
+				const double wi = w[2*k*step+1];
+				double* const u = a+2*(i+k);
+				double* const v = a+2*(i+k+half);
+				const double vr = v[0]*wr - v[1]*wi;
+				const double vi = v[0]*wi + v[1]*wr;
+				v[0] = u[0] - vr;
+				v[1] = u[1] - vi;
+				u[0] += vr;
+				u[1] += vi;
+			}
+		}
+	}
+}
+
+/**
+ * @brief In place transform of one dimension of the grid.
+ * @param data Complex grid of size nx*ny*nz, z is the fastest index.
+ * @param n Length of the dimension.
+ * @param stride Distance (in complex numbers) of neighbouring points in this dimension.
+ * @param lines Number of lines in this dimension.
+ * @param sign -1 for the forward, +1 for the backward transform.
+ */
+static void reb_pm_fft_dimension(double* const data, const int n, const int stride, const int lines, const int sign){
+	if (n==1) return;
+	double* const w = malloc(sizeof(double)*n);
+	for (int k=0; k<n/2; k++){
+		w[2*k]   = cos(2.*M_PI*k/n);
+		w[2*k+1] = sign*sin(2.*M_PI*k/n);
+	}
+#pragma omp parallel
+	{
+	double* const line = malloc(sizeof(double)*2*n);
+#pragma omp for schedule(guided)
+	for (int l=0; l<lines; l++){
+		// Lines are enumerated by the index in the slower and the faster dimensions.
+		const int offset = stride==1?l*n:((l/stride)*n*stride + l%stride);
+		double* const d = data + 2*offset;
+		for (int i=0; i<n; i++){
+			line[2*i]   = d[2*i*stride];
+			line[2*i+1] = d[2*i*stride+1];
+		}
+		reb_pm_fft_1d(line, n, w);
+		for (int i=0; i<n; i++){
+			d[2*i*stride]   = line[2*i];
+			d[2*i*stride+1] = line[2*i+1];
+		}
+	}
+	free(line);
+	}
+	free(w);
+}
+#endif // FFTW
+
+/**
+ * @brief In place three dimensional transform of one of the grids.
+ * @param data r->pm_grid or r->pm_work.
+ * @param sign -1 for the forward, +1 for the backward transform (unnormalized).
+ */
+static void reb_pm_fft(struct reb_simulation* const r, double* const data, const int sign){
+#ifdef FFTW
+	fftw_execute((fftw_plan)(data==r->pm_grid?r->pm_fftw_plan_forward:r->pm_fftw_plan_backward));
+#else // FFTW
+	const int nx = r->pm_nx;
+	const int ny = r->pm_ny;
+	const int nz = r->pm_nz;
+	reb_pm_fft_dimension(data, nz, 1, nx*ny, sign);
+	reb_pm_fft_dimension(data, ny, nz, nx*nz, sign);
+	reb_pm_fft_dimension(data, nx, ny*nz, ny*nz, sign);
+#endif // FFTW
+}
+
+void reb_gravity_pm_free(struct reb_simulation* const r){
+#ifdef FFTW
+	if (r->pm_fftw_plan_forward){
+		fftw_destroy_plan((fftw_plan)r->pm_fftw_plan_forward);
+	}
+	if (r->pm_fftw_plan_backward){
+		fftw_destroy_plan((fftw_plan)r->pm_fftw_plan_backward);
+	}
+#endif // FFTW
+	r->pm_fftw_plan_forward = NULL;
+	r->pm_fftw_plan_backward = NULL;
+	free(r->pm_grid);
+	free(r->pm_work);
+	r->pm_grid = NULL;
+	r->pm_work = NULL;
+	r->pm_grid_nx = 0;
+	r->pm_grid_ny = 0;
+	r->pm_grid_nz = 0;
+}
+
+/**
+ * @brief Allocates the grids and FFT plans if they do not exist or the grid dimensions have changed.
+ */
+static void reb_pm_init(struct reb_simulation* const r){
+	const int nx = r->pm_nx;
+	const int ny = r->pm_ny;
+	const int nz = r->pm_nz;
+	if (r->pm_grid!=NULL && r->pm_grid_nx==nx && r->pm_grid_ny==ny && r->pm_grid_nz==nz){
+		return;
+	}
+	reb_gravity_pm_free(r);
+	r->pm_grid = malloc(sizeof(double)*2*nx*ny*nz);
+	r->pm_work = malloc(sizeof(double)*2*nx*ny*nz);
+	r->pm_grid_nx = nx;
+	r->pm_grid_ny = ny;
+	r->pm_grid_nz = nz;
+#ifdef FFTW
+	r->pm_fftw_plan_forward  = fftw_plan_dft_3d(nx, ny, nz, (fftw_complex*)r->pm_grid, (fftw_complex*)r->pm_grid, FFTW_FORWARD, FFTW_ESTIMATE);
+	r->pm_fftw_plan_backward = fftw_plan_dft_3d(nx, ny, nz, (fftw_complex*)r->pm_work, (fftw_complex*)r->pm_work, FFTW_BACKWARD, FFTW_ESTIMATE);
+#endif // FFTW
+}
+
+/**
+ * @brief Calculates the assignment weights in one dimension.
+ * @param u Position in units of the grid spacing. Grid point i is at u=i.
+ * @param order 1 for CIC (two points), 2 for TSC (three points).
+ * @param w The weights are stored in this array.
+ * @return Index of the first grid point of the stencil (not wrapped).
+ */
+static inline int reb_pm_weights(const double u, const int order, double* const w){
+	if (order==1){
+		const int i = (int)floor(u);
+		const double f = u - i;
+		w[0] = 1.-f;
+		w[1] = f;
+		return i;
+	}else{
+		const int i = (int)floor(u+0.5);
+		const double d = u - i;
+		w[0] = 0.5*(0.5-d)*(0.5-d);
+		w[1] = 0.75-d*d;
+		w[2] = 0.5*(0.5+d)*(0.5+d);
+		return i-1;
+	}
+}
+
+/**
+ * @brief Stencil of one particle in the sheared grid coordinates.
+ */
+struct reb_pm_stencil {
+	int i[3];				/**< First grid point in each dimension (not wrapped) */
+	double w[3][REB_PM_STENCIL_MAX];	/**< Weights in each dimension */
+};
+
+static inline void reb_pm_stencil(const struct reb_simulation* const r, const struct reb_particle* const p, const double shift, struct reb_pm_stencil* const s){
+	const struct reb_vec3d L = r->boxsize;
+	const double xi = p->x/L.x + 0.5;
+	const double ux = xi*r->pm_nx - 0.5;
+	const double uy = ((p->y - shift*xi)/L.y + 0.5)*r->pm_ny - 0.5;
+	s->i[0] = reb_pm_weights(ux, r->pm_assignment, s->w[0]);
+	s->i[1] = reb_pm_weights(uy, r->pm_assignment, s->w[1]);
+	if (r->pm_nz>1){
+		const double uz = (p->z/L.z + 0.5)*r->pm_nz - 0.5;
+		s->i[2] = reb_pm_weights(uz, r->pm_assignment, s->w[2]);
+	}else{
+		s->i[2] = 0;
+		s->w[2][0] = 1.;
+	}
+}
+
+/**
+ * @brief Wraps a grid index periodically.
+ */
+static inline int reb_pm_wrap(const int i, const int n){
+	const int j = i%n;
+	return j<0?j+n:j;
+}
+
+/**
+ * @brief Signed wave number of grid index i (in units of 2 pi/L).
+ */
+static inline int reb_pm_wave_number(const int i, const int n){
+	return i<=n/2?i:i-n;
+}
+
+/**
+ * @brief Returns the Fourier transform of the assignment window in one dimension.
+ */
+static inline double reb_pm_window(const double k, const double d, const int order){
+	const double x = 0.5*k*d;
+	const double sinc = x==0.?1.:sin(x)/x;
+	return order==1?sinc*sinc:sinc*sinc*sinc;
+}
+
+void reb_gravity_pm_calculate_acceleration(struct reb_simulation* const r){
+#ifdef MPI
+	reb_exit("REB_GRAVITY_PM is not supported with MPI.");
+#endif // MPI
+	const int nx = r->pm_nx;
+	const int ny = r->pm_ny;
+	const int nz = r->pm_nz;
+	if (nx<2 || ny<2 || nz<1){
+		reb_exit("REB_GRAVITY_PM needs pm_nx and pm_ny to be at least 2 and pm_nz to be at least 1.");
+	}
+#ifndef FFTW
+	if ((nx&(nx-1)) || (ny&(ny-1)) || (nz&(nz-1))){
+		reb_exit("Without FFTW, the grid dimensions of REB_GRAVITY_PM need to be powers of two.");
+	}
+#endif // FFTW
+	if (r->pm_assignment!=1 && r->pm_assignment!=2){
+		reb_exit("pm_assignment needs to be 1 (CIC) or 2 (TSC).");
+	}
+	if (r->boundary!=REB_BOUNDARY_PERIODIC && r->boundary!=REB_BOUNDARY_SHEAR){
+		reb_exit("REB_GRAVITY_PM requires REB_BOUNDARY_PERIODIC or REB_BOUNDARY_SHEAR.");
+	}
+	reb_pm_init(r);
+	struct reb_particle* const particles = r->particles;
+	const int N = r->N;
+	const int _N_active = ((r->N_active==-1)?N:r->N_active) - r->N_var;
+	const int _N_real   = N - r->N_var;
+	const int order = r->pm_assignment;
+	const int ns = order+1;
+	const int nsz = nz>1?ns:1;
+	const struct reb_vec3d L = r->boxsize;
+	const double dx = L.x/nx;
+	const double dy = L.y/ny;
+	const double dz = L.z/nz;
+	const double shift = r->boundary==REB_BOUNDARY_SHEAR?reb_boundary_get_ghostbox(r,1,0,0).shifty:0.;
+	double* const grid = r->pm_grid;
+	double* const work = r->pm_work;
+	const int Ng = nx*ny*nz;
+
+	// Mass assignment (density in 3D, surface density in 2D)
+	memset(grid, 0, sizeof(double)*2*Ng);
+	const double vol = nz>1?dx*dy*dz:dx*dy;
+#pragma omp parallel for schedule(guided)
+	for (int p=0; p<_N_active; p++){
+		struct reb_pm_stencil s;
+		reb_pm_stencil(r, &(particles[p]), shift, &s);
+		const double rho = particles[p].m/vol;
+		for (int a=0; a<ns; a++){
+		const int i = reb_pm_wrap(s.i[0]+a, nx);
+		for (int b=0; b<ns; b++){
+		const int j = reb_pm_wrap(s.i[1]+b, ny);
+		for (int c=0; c<nsz; c++){
+			const int k = reb_pm_wrap(s.i[2]+c, nz);
+#pragma omp atomic
+			grid[2*((i*ny+j)*nz+k)] += rho*s.w[0][a]*s.w[1][b]*s.w[2][c];
+		}
+		}
+		}
+	}
+
+	reb_pm_fft(r, grid, -1);
+
+	// Potential in Fourier space, normalized for the backward transform.
+	// The window of the assignment and the interpolation is deconvolved.
+#pragma omp parallel for schedule(guided)
+	for (int l=0; l<Ng; l++){
+		const int i = l/(ny*nz);
+		const int j = (l/nz)%ny;
+		const int k = l%nz;
+		const double kx = 2.*M_PI/L.x*reb_pm_wave_number(i, nx);
+		const double ky = 2.*M_PI/L.y*reb_pm_wave_number(j, ny);
+		const double kz = nz>1?2.*M_PI/L.z*reb_pm_wave_number(k, nz):0.;
+		const double Kx = kx - shift/L.x*ky;
+		const double K2 = Kx*Kx + ky*ky + kz*kz;
+		double g = 0.;
+		if (K2>0.){
+			double W = reb_pm_window(kx, dx, order)*reb_pm_window(ky, dy, order);
+			if (nz>1){
+				W *= reb_pm_window(kz, dz, order);
+				g = -4.*M_PI*r->G/K2;
+			}else{
+				g = -2.*M_PI*r->G/sqrt(K2);
+			}
+			g /= W*W*(double)Ng;
+		}
+		grid[2*l]   *= g;
+		grid[2*l+1] *= g;
+	}
+
+	// Acceleration a = -grad(phi), one component at a time.
+	const int ncomp = nz>1?3:2;
+	for (int d=0; d<ncomp; d++){
+#pragma omp parallel for schedule(guided)
+		for (int l=0; l<Ng; l++){
+			const int i = l/(ny*nz);
+			const int j = (l/nz)%ny;
+			const int k = l%nz;
+			double Kd = 0.;
+			// The derivative of the Nyquist modes is not defined.
+			if (!(nx%2==0 && i==nx/2) && !(ny%2==0 && j==ny/2) && !(nz>1 && nz%2==0 && k==nz/2)){
+				const double kx = 2.*M_PI/L.x*reb_pm_wave_number(i, nx);
+				const double ky = 2.*M_PI/L.y*reb_pm_wave_number(j, ny);
+				const double kz = nz>1?2.*M_PI/L.z*reb_pm_wave_number(k, nz):0.;
+				switch (d){
+					case 0:
+						Kd = kx - shift/L.x*ky;
+						break;
+					case 1:
+						Kd = ky;
+						break;
+					default:
+						Kd = kz;
+						break;
+				}
+			}
+			// -i*Kd*phi
+			work[2*l]   =  Kd*grid[2*l+1];
+			work[2*l+1] = -Kd*grid[2*l];
+		}
+
+		reb_pm_fft(r, work, 1);
+
+		// Interpolation
+#pragma omp parallel for schedule(guided)
+		for (int p=0; p<_N_real; p++){
+			struct reb_pm_stencil s;
+			reb_pm_stencil(r, &(particles[p]), shift, &s);
+			double a_p = 0.;
+			for (int a=0; a<ns; a++){
+			const int i = reb_pm_wrap(s.i[0]+a, nx);
+			for (int b=0; b<ns; b++){
+			const int j = reb_pm_wrap(s.i[1]+b, ny);
+			for (int c=0; c<nsz; c++){
+				const int k = reb_pm_wrap(s.i[2]+c, nz);
+				a_p += work[2*((i*ny+j)*nz+k)]*s.w[0][a]*s.w[1][b]*s.w[2][c];
+			}
+			}
+			}
+			switch (d){
+				case 0:
+					particles[p].ax = a_p;
+					break;
+				case 1:
+					particles[p].ay = a_p;
+					break;
+				default:
+					particles[p].az = a_p;
+					break;
+			}
+		}
+	}
+	if (ncomp==2){
+#pragma omp parallel for schedule(guided)
+		for (int p=0; p<_N_real; p++){
+			particles[p].az = 0.;
+		}
+	}
+}
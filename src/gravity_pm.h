@@ -0,0 +1,42 @@
+/**
+ * @file 	gravity_pm.h
+ * @brief 	Particle-mesh method for self-gravity.
+ * @author 	agent <agent@local>
+ *
+ * @section 	LICENSE
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _GRAVITY_PM_H
+#define _GRAVITY_PM_H
+struct reb_simulation;
+
+/**
+  * @brief Calculates the gravitational acceleration of all particles on a grid using FFTs.
+  * @details Requires REB_BOUNDARY_PERIODIC or REB_BOUNDARY_SHEAR.
+  * @param r REBOUND simulation to operate on
+  */
+void reb_gravity_pm_calculate_acceleration(struct reb_simulation* const r);
+
+/**
+  * @brief Frees the grids and FFT plans used by REB_GRAVITY_PM.
+  * @param r REBOUND simulation to operate on
+  */
+void reb_gravity_pm_free(struct reb_simulation* const r);
+
+#endif // _GRAVITY_PM_H
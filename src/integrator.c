@@ -42,6 +42,7 @@
 #include "integrator_sei.h"
 #include "integrator_wh.h"
 #include "integrator_hybrid.h"
+#include "integrator_hermite.h"
 
 void reb_integrator_part1(struct reb_simulation* r){
 	switch(r->integrator){
@@ -63,6 +64,9 @@ void reb_integrator_part1(struct reb_simulation* r){
 		case REB_INTEGRATOR_HYBRID:
 			reb_integrator_hybrid_part1(r);
 			break;
+		case REB_INTEGRATOR_HERMITE:
+			reb_integrator_hermite_part1(r);
+			break;
 		default:
 			break;
 	}
@@ -88,6 +92,9 @@ void reb_integrator_part2(struct reb_simulation* r){
 		case REB_INTEGRATOR_HYBRID:
 			reb_integrator_hybrid_part2(r);
 			break;
+		case REB_INTEGRATOR_HERMITE:
+			reb_integrator_hermite_part2(r);
+			break;
 		default:
 			break;
 	}
@@ -113,6 +120,9 @@ void reb_integrator_synchronize(struct reb_simulation* r){
 		case REB_INTEGRATOR_HYBRID:
 			reb_integrator_hybrid_synchronize(r);
 			break;
+		case REB_INTEGRATOR_HERMITE:
+			reb_integrator_hermite_synchronize(r);
+			break;
 		default:
 			break;
 	}
@@ -127,6 +137,7 @@ void reb_integrator_reset(struct reb_simulation* r){
 	reb_integrator_sei_reset(r);
 	reb_integrator_whfast_reset(r);
 	reb_integrator_hybrid_reset(r);
+	reb_integrator_hermite_reset(r);
 }
 
 void reb_update_acceleration(struct reb_simulation* r){
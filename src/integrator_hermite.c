@@ -0,0 +1,334 @@
+/**
+ * @file 	integrator_hermite.c
+ * @brief 	Fourth order Hermite integration scheme.
+ * @author 	agent <agent@local>
+ * @details	This file implements the fourth order Hermite predictor-corrector
+ * scheme (Makino & Aarseth 1992, PASJ 44, 141). The accelerations and their 
+ * time derivatives (jerks) are calculated by direct summation. Positions and 
+ * velocities are predicted with a Taylor series, the accelerations and jerks 
+ * are evaluated at the predicted positions, and the prediction is corrected
+ * using the time-symmetric form of Hut & Makino. The timestep follows 
+ * Aarseth's criterion.
+ *
+ * If ri_hermite.block_levels is 1, all particles share one adaptive timestep.
+ * Otherwise, dt is the largest timestep and every particle is advanced with 
+ * its own timestep dt/2^k. On each substep, all particles are predicted but
+ * only the particles whose step ends get their accelerations calculated and 
+ * are corrected.
+ * 
+ * @section 	LICENSE
+ * Copyright (c) 2026 agent
+ *
+ * This file is part of rebound.
+ *
+ * rebound is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * rebound is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with rebound.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "rebound.h"
+#include "integrator.h"
+#include "integrator_hermite.h"
+
+static int reb_integrator_hermite_needs_init(const struct reb_simulation* const r);
+static void reb_integrator_hermite_init(struct reb_simulation* const r);
+static void reb_integrator_hermite_predict(struct reb_simulation* const r, const unsigned int tick);
+static double reb_integrator_hermite_correct(struct reb_simulation* const r, const int i, const double dt);
+static void reb_integrator_hermite_set_level(struct reb_simulation* const r, const int i, const double dt_new, const unsigned int tick);
+
+void reb_integrator_hermite_part1(struct reb_simulation* r){
+	const unsigned int levels = r->ri_hermite.block_levels;
+	if (levels<1 || levels>31){
+		reb_exit("The number of timestep levels of the Hermite integrator must be between 1 and 31.");
+	}
+	if (r->gravity!=REB_GRAVITY_BASIC || r->gravity_ewald){
+		reb_exit("The Hermite integrator requires REB_GRAVITY_BASIC without Ewald summation.");
+	}
+	if (r->N_var){
+		reb_exit("The Hermite integrator does not support variational particles.");
+	}
+#ifdef MPI
+	reb_exit("The Hermite integrator is not supported with MPI.");
+#endif // MPI
+	const int N = r->N;
+	struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	if (ri->allocatedN<N){
+		ri->x0 = realloc(ri->x0, sizeof(double)*3*N);
+		ri->v0 = realloc(ri->v0, sizeof(double)*3*N);
+		ri->a0 = realloc(ri->a0, sizeof(double)*3*N);
+		ri->j0 = realloc(ri->j0, sizeof(double)*3*N);
+		ri->jerk = realloc(ri->jerk, sizeof(double)*3*N);
+		ri->level = realloc(ri->level, sizeof(int)*N);
+		ri->tick = realloc(ri->tick, sizeof(unsigned int)*N);
+		ri->active = realloc(ri->active, sizeof(int)*N);
+		ri->allocatedN = N;
+	}
+	if (reb_integrator_hermite_needs_init(r)){
+		reb_integrator_hermite_init(r);
+	}
+	
+	// Substeps of particles on smaller timesteps.
+	const unsigned int M = 1u<<(levels-1);
+	const double h = r->dt/(double)M;
+	const double t0 = r->t;
+	while(1){
+		unsigned int tick = M;
+		for (int i=0;i<N;i++){
+			const unsigned int end = ri->tick[i] + (M>>ri->level[i]);
+			if (end<tick){
+				tick = end;
+			}
+		}
+		if (tick==M){
+			break;
+		}
+		int N_active = 0;
+		for (int i=0;i<N;i++){
+			if (ri->tick[i] + (M>>ri->level[i])==tick){
+				ri->active[N_active++] = i;
+			}
+		}
+		reb_integrator_hermite_predict(r, tick);
+		r->t = t0 + h*(double)tick;
+		r->gravity_active = ri->active;
+		r->gravity_active_N = N_active;
+		reb_update_acceleration(r);
+		r->gravity_active_N = -1;
+#pragma omp parallel for schedule(guided)
+		for (int k=0;k<N_active;k++){
+			const int i = ri->active[k];
+			const double dt_new = reb_integrator_hermite_correct(r, i, h*(double)(tick-ri->tick[i]));
+			reb_integrator_hermite_set_level(r, i, dt_new, tick);
+			ri->tick[i] = tick;
+		}
+	}
+
+	// All particles are corrected at the end of the timestep.
+	// Their accelerations are calculated in reb_step().
+	reb_integrator_hermite_predict(r, M);
+	r->t = t0 + r->dt;
+}
+
+void reb_integrator_hermite_part2(struct reb_simulation* r){
+	const int N = r->N;
+	const unsigned int levels = r->ri_hermite.block_levels;
+	const unsigned int M = 1u<<(levels-1);
+	const double dt = r->dt;
+	const double h = dt/(double)M;
+	struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	double dt_min = INFINITY;
+#pragma omp parallel for schedule(guided) reduction(min:dt_min)
+	for (int i=0;i<N;i++){
+		const double dt_new = reb_integrator_hermite_correct(r, i, h*(double)(M-ri->tick[i]));
+		if (levels>1){
+			reb_integrator_hermite_set_level(r, i, dt_new, M);
+		}
+		ri->tick[i] = 0;
+		if (dt_new<dt_min){
+			dt_min = dt_new;
+		}
+	}
+	ri->N_last = N;
+	r->dt_last_done = dt;
+	if (levels==1 && N>0){
+		// Shared timestep, allowed to grow by at most a factor of 2 per step.
+		const double dt_abs = fabs(dt);
+		const double dt_next = dt_min<2.*dt_abs?dt_min:2.*dt_abs;
+		r->dt = dt>=0.?dt_next:-dt_next;
+	}
+}
+
+void reb_integrator_hermite_synchronize(struct reb_simulation* r){
+	// Do nothing. Particles are synchronized at the end of every timestep.
+}
+
+void reb_integrator_hermite_reset(struct reb_simulation* r){
+	struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	ri->allocatedN = 0;
+	ri->N_last = 0;
+	free(ri->x0);
+	ri->x0 = NULL;
+	free(ri->v0);
+	ri->v0 = NULL;
+	free(ri->a0);
+	ri->a0 = NULL;
+	free(ri->j0);
+	ri->j0 = NULL;
+	free(ri->jerk);
+	ri->jerk = NULL;
+	free(ri->level);
+	ri->level = NULL;
+	free(ri->tick);
+	ri->tick = NULL;
+	free(ri->active);
+	ri->active = NULL;
+}
+
+// Only static routines below
+
+/**
+ * @brief Checks if the particles have changed since the end of the last timestep.
+ * @details This is the case if particles were added, removed, reordered or modified,
+ * for example by collisions or by the user.
+ * @return 1 if the accelerations and jerks need to be recalculated.
+ */
+static int reb_integrator_hermite_needs_init(const struct reb_simulation* const r){
+	const struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	if (ri->N_last!=r->N){
+		return 1;
+	}
+	const struct reb_particle* const particles = r->particles;
+	for (int i=0;i<r->N;i++){
+		const struct reb_particle p = particles[i];
+		if (p.x!=ri->x0[3*i] || p.y!=ri->x0[3*i+1] || p.z!=ri->x0[3*i+2] || p.vx!=ri->v0[3*i] || p.vy!=ri->v0[3*i+1] || p.vz!=ri->v0[3*i+2]){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Calculates accelerations and jerks at the current positions and sets the initial timesteps.
+ * @details The initial timestep of a particle is eta/2*|a|/|j| (Aarseth 1985).
+ */
+static void reb_integrator_hermite_init(struct reb_simulation* const r){
+	const int N = r->N;
+	struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	struct reb_particle* const particles = r->particles;
+	r->gravity_active_N = -1;
+	reb_update_acceleration(r);
+	double dt_min = INFINITY;
+	for (int i=0;i<N;i++){
+		const struct reb_particle p = particles[i];
+		ri->x0[3*i]   = p.x;  ri->x0[3*i+1] = p.y;  ri->x0[3*i+2] = p.z;
+		ri->v0[3*i]   = p.vx; ri->v0[3*i+1] = p.vy; ri->v0[3*i+2] = p.vz;
+		ri->a0[3*i]   = p.ax; ri->a0[3*i+1] = p.ay; ri->a0[3*i+2] = p.az;
+		ri->j0[3*i]   = ri->jerk[3*i];
+		ri->j0[3*i+1] = ri->jerk[3*i+1];
+		ri->j0[3*i+2] = ri->jerk[3*i+2];
+		const double* const j = &(ri->jerk[3*i]);
+		const double a2 = p.ax*p.ax + p.ay*p.ay + p.az*p.az;
+		const double j2 = j[0]*j[0] + j[1]*j[1] + j[2]*j[2];
+		const double dt_i = j2>0.?0.5*ri->eta*sqrt(a2/j2):INFINITY;
+		ri->tick[i] = 0;
+		ri->level[i] = 0;
+		reb_integrator_hermite_set_level(r, i, dt_i, 0);
+		if (dt_i<dt_min){
+			dt_min = dt_i;
+		}
+	}
+	if (ri->block_levels==1 && dt_min<fabs(r->dt)){
+		r->dt = r->dt>=0.?dt_min:-dt_min;
+	}
+}
+
+/**
+ * @brief Predicts the positions and velocities of all particles.
+ * @param r REBOUND simulation to operate on
+ * @param tick Time in units of dt/2^(block_levels-1) since the beginning of the timestep.
+ */
+static void reb_integrator_hermite_predict(struct reb_simulation* const r, const unsigned int tick){
+	const int N = r->N;
+	const struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	struct reb_particle* const particles = r->particles;
+	const double h = r->dt/(double)(1u<<(ri->block_levels-1));
+#pragma omp parallel for schedule(guided)
+	for (int i=0;i<N;i++){
+		const double dt = h*(double)(tick-ri->tick[i]);
+		const double* const x0 = &(ri->x0[3*i]);
+		const double* const v0 = &(ri->v0[3*i]);
+		const double* const a0 = &(ri->a0[3*i]);
+		const double* const j0 = &(ri->j0[3*i]);
+		particles[i].x  = x0[0] + dt*(v0[0] + dt*0.5*(a0[0] + dt/3.*j0[0]));
+		particles[i].y  = x0[1] + dt*(v0[1] + dt*0.5*(a0[1] + dt/3.*j0[1]));
+		particles[i].z  = x0[2] + dt*(v0[2] + dt*0.5*(a0[2] + dt/3.*j0[2]));
+		particles[i].vx = v0[0] + dt*(a0[0] + dt*0.5*j0[0]);
+		particles[i].vy = v0[1] + dt*(a0[1] + dt*0.5*j0[1]);
+		particles[i].vz = v0[2] + dt*(a0[2] + dt*0.5*j0[2]);
+	}
+}
+
+/**
+ * @brief Corrects the position and velocity of a particle with the acceleration and jerk at the predicted position.
+ * @param r REBOUND simulation to operate on
+ * @param i Index of the particle
+ * @param dt Timestep of the particle
+ * @return The new timestep of the particle according to Aarseth's criterion.
+ */
+static double reb_integrator_hermite_correct(struct reb_simulation* const r, const int i, const double dt){
+	struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	struct reb_particle* const p = &(r->particles[i]);
+	double* const x0 = &(ri->x0[3*i]);
+	double* const v0 = &(ri->v0[3*i]);
+	double* const a0 = &(ri->a0[3*i]);
+	double* const j0 = &(ri->j0[3*i]);
+	const double a1[3] = {p->ax, p->ay, p->az};
+	const double* const j1 = &(ri->jerk[3*i]);
+	const double dt2 = dt*dt;
+	double a1_2 = 0., j1_2 = 0., a2_2 = 0., a3_2 = 0.;
+	for (int k=0;k<3;k++){
+		const double v1 = v0[k] + 0.5*dt*(a0[k] + a1[k]) + dt2/12.*(j0[k] - j1[k]);
+		const double x1 = x0[k] + 0.5*dt*(v0[k] + v1) + dt2/12.*(a0[k] - a1[k]);
+		// Second and third derivatives of the acceleration at the end of the step.
+		const double a3 = (12.*(a0[k]-a1[k]) + 6.*dt*(j0[k]+j1[k]))/(dt2*dt);
+		const double a2 = (-6.*(a0[k]-a1[k]) - dt*(4.*j0[k]+2.*j1[k]))/dt2 + dt*a3;
+		a1_2 += a1[k]*a1[k];
+		j1_2 += j1[k]*j1[k];
+		a2_2 += a2*a2;
+		a3_2 += a3*a3;
+		x0[k] = x1;
+		v0[k] = v1;
+		a0[k] = a1[k];
+		j0[k] = j1[k];
+	}
+	p->x  = x0[0]; p->y  = x0[1]; p->z  = x0[2];
+	p->vx = v0[0]; p->vy = v0[1]; p->vz = v0[2];
+	const double num = sqrt(a1_2*a2_2) + j1_2;
+	const double den = sqrt(j1_2*a3_2) + a2_2;
+	return den>0.?sqrt(ri->eta*num/den):INFINITY;
+}
+
+/**
+ * @brief Sets the level of a particle after a step.
+ * @details The level is the smallest k for which dt/2^k is not larger than dt_new. 
+ * A particle can move to a larger timestep by one level if the new step is 
+ * commensurate with the current time.
+ * @param r REBOUND simulation to operate on
+ * @param i Index of the particle
+ * @param dt_new Timestep suggested by the timestep criterion
+ * @param tick Current time of the particle in units of dt/2^(block_levels-1).
+ */
+static void reb_integrator_hermite_set_level(struct reb_simulation* const r, const int i, const double dt_new, const unsigned int tick){
+	struct reb_simulation_integrator_hermite* const ri = &(r->ri_hermite);
+	const int levels = ri->block_levels;
+	int k = 0;
+	double hk = fabs(r->dt);
+	while (k<levels-1 && hk>dt_new){
+		hk *= 0.5;
+		k++;
+	}
+	const int level = ri->level[i];
+	if (k>level){
+		ri->level[i] = k;
+	}else if (k<level){
+		const unsigned int M = 1u<<(levels-1);
+		if (tick%(2u*(M>>level))==0){
+			ri->level[i] = level-1;
+		}
+	}
+}
@@ -6,6 +6,15 @@
  * This scheme is second order accurate, symplectic and well suited for 
  * non-rotating coordinate systems. Note that the scheme is formally only
  * first order accurate when velocity dependent forces are present.
+ *
+ * With block timesteps (ri_leapfrog.block_levels>1), each particle is 
+ * assigned a level k at the beginning of the timestep and is kicked with
+ * the timestep dt/2^k. All particles are drifted together on the finest 
+ * substeps. Kicks of particles on level k happen at odd multiples of 
+ * dt/2^(k+1), so only particles on one level are kicked at a time and 
+ * only their accelerations are calculated. The tree is not rebuilt during 
+ * the timestep, only its multipole moments are updated before each kick.
+ * With one level, the scheme is identical to the standard leap-frog.
  * 
  * @section 	LICENSE
  * Copyright (c) 2011 Hanno Rein, Shangfei Liu
@@ -33,10 +42,19 @@
 #include <math.h>
 #include <time.h>
 #include "rebound.h"
+#include "integrator.h"
+#include "tree.h"
+
+static void reb_integrator_leapfrog_block_part1(struct reb_simulation* r);
+static void reb_integrator_leapfrog_block_part2(struct reb_simulation* r);
 
 // Leapfrog integrator (Drift-Kick-Drift)
 // for non-rotating frame.
 void reb_integrator_leapfrog_part1(struct reb_simulation* r){
+	if (r->ri_leapfrog.block_levels>1){
+		reb_integrator_leapfrog_block_part1(r);
+		return;
+	}
 	const int N = r->N;
 	struct reb_particle* restrict const particles = r->particles;
 	const double dt = r->dt;
@@ -49,6 +67,10 @@ void reb_integrator_leapfrog_part1(struct reb_simulation* r){
 	r->t+=dt/2.;
 }
 void reb_integrator_leapfrog_part2(struct reb_simulation* r){
+	if (r->ri_leapfrog.block_levels>1){
+		reb_integrator_leapfrog_block_part2(r);
+		return;
+	}
 	const int N = r->N;
 	struct reb_particle* restrict const particles = r->particles;
 	const double dt = r->dt;
@@ -70,5 +92,170 @@ void reb_integrator_leapfrog_synchronize(struct reb_simulation* r){
 }
 
 void reb_integrator_leapfrog_reset(struct reb_simulation* r){
-	// Do nothing.
+	r->ri_leapfrog.allocatedN = 0;
+	r->ri_leapfrog.rung_N = 0;
+	free(r->ri_leapfrog.rung);
+	r->ri_leapfrog.rung = NULL;
+	free(r->ri_leapfrog.active);
+	r->ri_leapfrog.active = NULL;
+	r->gravity_active = NULL;
+	r->gravity_active_N = -1;
+}
+
+// Only static routines below
+
+/**
+ * @brief Drifts all particles.
+ * @param r REBOUND simulation to operate on
+ * @param h Length of the drift
+ */
+static void reb_integrator_leapfrog_block_drift(struct reb_simulation* r, const double h){
+	const int N = r->N;
+	struct reb_particle* restrict const particles = r->particles;
+#pragma omp parallel for schedule(guided)
+	for (int i=0;i<N;i++){
+		particles[i].x  += h * particles[i].vx;
+		particles[i].y  += h * particles[i].vy;
+		particles[i].z  += h * particles[i].vz;
+	}
+	r->t+=h;
+}
+
+/**
+ * @brief Collects the particles on level k in ri_leapfrog.active.
+ * @param r REBOUND simulation to operate on
+ * @param k Level
+ * @return Number of particles on level k
+ */
+static int reb_integrator_leapfrog_block_collect(struct reb_simulation* r, const int k){
+	const int N = r->N;
+	const int* const rung = r->ri_leapfrog.rung;
+	int* const active = r->ri_leapfrog.active;
+	int N_active = 0;
+	for (int i=0;i<N;i++){
+		if (rung[i]==k){
+			active[N_active++] = i;
+		}
+	}
+	return N_active;
+}
+
+/**
+ * @brief Kicks the particles in ri_leapfrog.active.
+ * @param r REBOUND simulation to operate on
+ * @param N_active Number of particles in ri_leapfrog.active
+ * @param dt Length of the kick
+ */
+static void reb_integrator_leapfrog_block_kick(struct reb_simulation* r, const int N_active, const double dt){
+	struct reb_particle* restrict const particles = r->particles;
+	const int* const active = r->ri_leapfrog.active;
+#pragma omp parallel for schedule(guided)
+	for (int k=0;k<N_active;k++){
+		struct reb_particle* const p = &particles[active[k]];
+		p->vx += dt * p->ax;
+		p->vy += dt * p->ay;
+		p->vz += dt * p->az;
+	}
+}
+
+/**
+ * @brief Performs the substeps j0 to j1-1.
+ * @details Substep j drifts all particles by dt/2^block_levels and then kicks 
+ * the particles on level k, where j is an odd multiple of 2^(block_levels-1-k).
+ * @param r REBOUND simulation to operate on
+ * @param j0 First substep
+ * @param j1 Last substep plus one
+ */
+static void reb_integrator_leapfrog_block_substeps(struct reb_simulation* r, const unsigned int j0, const unsigned int j1){
+	const unsigned int levels = r->ri_leapfrog.block_levels;
+	const double h = r->dt/(double)(1u<<levels);
+	for (unsigned int j=j0;j<j1;j++){
+		reb_integrator_leapfrog_block_drift(r, h);
+		int k = levels-1;
+		for (unsigned int jj=j;(jj&1u)==0;jj>>=1){
+			k--;
+		}
+		const int N_active = reb_integrator_leapfrog_block_collect(r, k);
+		if (N_active==0){
+			continue;
+		}
+		r->gravity_active = r->ri_leapfrog.active;
+		r->gravity_active_N = N_active;
+		reb_tree_update_gravity_data(r);
+		reb_update_acceleration(r);
+		r->gravity_active_N = -1;
+		reb_integrator_leapfrog_block_kick(r, N_active, r->dt/(double)(1u<<k));
+	}
+}
+
+static void reb_integrator_leapfrog_block_part1(struct reb_simulation* r){
+	const unsigned int levels = r->ri_leapfrog.block_levels;
+	if (levels>30){
+		reb_exit("The number of timestep levels must not be larger than 30.");
+	}
+	if (r->gravity!=REB_GRAVITY_TREE || r->gravity_ewald){
+		reb_exit("Block timesteps are only supported with REB_GRAVITY_TREE without Ewald summation.");
+	}
+	if (r->N_var || r->additional_forces){
+		reb_exit("Block timesteps are not supported with variational particles or additional forces.");
+	}
+	if (r->softening<=0.){
+		reb_exit("Block timesteps require a softening length larger than 0.");
+	}
+#ifdef MPI
+	reb_exit("Block timesteps are not supported with MPI.");
+#endif // MPI
+	const int N = r->N;
+	if (r->ri_leapfrog.allocatedN<N){
+		r->ri_leapfrog.rung = realloc(r->ri_leapfrog.rung, sizeof(int)*N);
+		r->ri_leapfrog.active = realloc(r->ri_leapfrog.active, sizeof(int)*N);
+		r->ri_leapfrog.allocatedN = N;
+	}
+	if (r->ri_leapfrog.rung_N!=N && r->tree_root!=NULL){
+		// The accelerations of the last timestep are used for the timestep criterion.
+		// They are calculated if particles were added or removed.
+		r->gravity_active_N = -1;
+		reb_tree_update_gravity_data(r);
+		reb_update_acceleration(r);
+	}
+	
+	// Assign levels.
+	const struct reb_particle* const particles = r->particles;
+	int* const rung = r->ri_leapfrog.rung;
+	const double dt = fabs(r->dt);
+	const double eps = 2.*r->ri_leapfrog.block_eta*r->softening;
+#pragma omp parallel for schedule(guided)
+	for (int i=0;i<N;i++){
+		const struct reb_particle p = particles[i];
+		const double a = sqrt(p.ax*p.ax + p.ay*p.ay + p.az*p.az);
+		int k = 0;
+		double hk = dt;
+		while (k<(int)levels-1 && hk*hk*a>eps){
+			hk *= 0.5;
+			k++;
+		}
+		rung[i] = k;
+	}
+
+	// Substeps until the middle of the timestep.
+	const unsigned int M = 1u<<levels;
+	reb_integrator_leapfrog_block_substeps(r, 1, M/2);
+	reb_integrator_leapfrog_block_drift(r, r->dt/(double)M);
+	
+	// Only particles on level 0 are kicked in the middle of the timestep.
+	r->gravity_active = r->ri_leapfrog.active;
+	r->gravity_active_N = reb_integrator_leapfrog_block_collect(r, 0);
+}
+
+static void reb_integrator_leapfrog_block_part2(struct reb_simulation* r){
+	reb_integrator_leapfrog_block_kick(r, r->gravity_active_N, r->dt);
+	r->gravity_active_N = -1;
+	
+	// Substeps until the end of the timestep.
+	const unsigned int M = 1u<<r->ri_leapfrog.block_levels;
+	reb_integrator_leapfrog_block_substeps(r, M/2+1, M);
+	reb_integrator_leapfrog_block_drift(r, r->dt/(double)M);
+	
+	r->ri_leapfrog.rung_N = r->N;
+	r->dt_last_done = r->dt;
 }
@@ -56,7 +56,9 @@ static void reb_add_local(struct reb_simulation* const r, struct reb_particle pt
 
 	r->particles[r->N] = pt;
 	r->particles[r->N].sim = r;
-	if (r->gravity==REB_GRAVITY_TREE || r->collision==REB_COLLISION_TREE){
+	// Collision candidates from the gravity walk do not include the new particle.
+	r->collisions_fused_N = -1;
+	if (r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE){
 		reb_tree_add_particle_to_tree(r, r->N);
 	}
 	(r->N)++;
@@ -108,6 +110,10 @@ void reb_remove_all(struct reb_simulation* const r){
 	r->N_var 	= 0;
 	free(r->particles);
 	r->particles 	= NULL;
+	free(r->removed);
+	r->removed 	= NULL;
+	r->removed_allocatedN 	= 0;
+	r->removed_N 	= 0;
 }
 
 int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
@@ -124,6 +130,8 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
 		fprintf(stderr, "\nRemoving particles not supported when calculating MEGNO.  Did not remove particle.\n");
 		return 0;
 	}
+	// Collision candidates from the gravity walk refer to the old particle indices.
+	r->collisions_fused_N = -1;
 	if(keepSorted){
 	    r->N--;
 		for(int j=index; j<r->N; j++){
@@ -146,6 +154,113 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted){
 	return 1;
 }
 
+/**
+ * @brief Makes sure the removal flags cover all particles.
+ */
+static void reb_remove_reserve(struct reb_simulation* const r){
+	if (r->removed_allocatedN<r->N){
+		r->removed = realloc(r->removed, sizeof(int)*r->allocatedN);
+		for (int i=r->removed_allocatedN;i<r->allocatedN;i++){
+			r->removed[i] = 0;
+		}
+		r->removed_allocatedN = r->allocatedN;
+	}
+}
+
+int reb_remove_mark(struct reb_simulation* const r, int index){
+	if (index<0 || index >= r->N){
+		fprintf(stderr, "\nIndex %d passed to reb_remove_mark was out of range (N=%d).  Did not mark particle.\n", index, r->N);
+		return 0;
+	}
+	reb_remove_reserve(r);
+	if (!r->removed[index]){
+		r->removed[index] = 1;
+		r->removed_N++;
+	}
+	return 1;
+}
+
+int reb_remove_marked(struct reb_simulation* const r, int keepSorted){
+	if (r->removed_N==0){
+		return 0;
+	}
+	reb_remove_reserve(r);
+	int* const removed = r->removed;
+	const int N = r->N;
+	if (r->N_var){
+		fprintf(stderr, "\nRemoving particles not supported when calculating MEGNO.  Did not remove particles.\n");
+		for (int i=0;i<N;i++){
+			removed[i] = 0;
+		}
+		r->removed_N = 0;
+		return 0;
+	}
+	if (r->removed_map_allocatedN<N){
+		r->removed_map = realloc(r->removed_map, sizeof(int)*N);
+		r->removed_map_allocatedN = N;
+	}
+	int* const map = r->removed_map;
+	struct reb_particle* const particles = r->particles;
+	// Collision candidates from the gravity walk refer to the old particle indices.
+	r->collisions_fused_N = -1;
+	int Nnew = 0;
+	if (r->tree_root){
+		// Just flag particles, they will be removed in tree_update.
+		for (int i=0;i<N;i++){
+			map[i] = i;
+			if (removed[i]){
+				particles[i].y = nan("");
+				removed[i] = 0;
+			}
+		}
+		r->tree_needs_update = 1;
+		Nnew = N - r->removed_N;
+	}else if (keepSorted){
+		for (int i=0;i<N;i++){
+			if (removed[i]){
+				map[i] = -1;
+				removed[i] = 0;
+				continue;
+			}
+			map[i] = Nnew;
+			if (i!=Nnew){
+				particles[Nnew] = particles[i];
+			}
+			Nnew++;
+		}
+		r->N = Nnew;
+	}else{
+		for (int i=0;i<N;i++){
+			map[i] = i;
+		}
+		Nnew = N;
+		for (int i=0;i<Nnew;i++){
+			if (!removed[i]) continue;
+			map[i] = -1;
+			removed[i] = 0;
+			// Fill the hole with the last particle which is not removed.
+			while (Nnew-1>i && removed[Nnew-1]){
+				map[Nnew-1] = -1;
+				removed[Nnew-1] = 0;
+				Nnew--;
+			}
+			Nnew--;
+			if (Nnew>i){
+				particles[i] = particles[Nnew];
+				map[Nnew] = i;
+			}
+		}
+		r->N = Nnew;
+	}
+	r->removed_map_N = N;
+	const int removed_N = r->removed_N;
+	r->removed_N = 0;
+	if (Nnew==0){
+		fprintf(stderr, "Last particle removed.\n");
+	}
+	return removed_N;
+}
+
 int reb_remove_by_id(struct reb_simulation* const r, int id, int keepSorted){
 	int success = 0;
 	for(int i=0;i<r->N;i++){
@@ -160,3 +275,12 @@ int reb_remove_by_id(struct reb_simulation* const r, int id, int keepSorted){
 	}
 	return success;
 }
+
+int reb_get_particle_index_by_id(const struct reb_simulation* const r, int id){
+	for(int i=0;i<r->N;i++){
+		if(r->particles[i].id == id){
+			return i;
+		}
+	}
+	return -1;
+}
@@ -40,8 +40,11 @@
 #include "integrator_wh.h"
 #include "integrator_whfast.h"
 #include "integrator_ias15.h"
+#include "integrator_leapfrog.h"
+#include "integrator_hermite.h"
 #include "boundary.h"
 #include "gravity.h"
+#include "gravity_pm.h"
 #include "collision.h"
 #include "tree.h"
 #include "output.h"
@@ -63,16 +66,16 @@ const char* reb_build_str = __DATE__ " " __TIME__;	// Date and time build string
 const char* reb_version_str = "2.14.4";			// **VERSIONLINE** This line gets updated automatically. Do not edit manually.
 
 
-void reb_step(struct reb_simulation* const r){
-	// A 'DKD'-like integrator will do the first 'D' part.
-	PROFILING_START()
-	reb_integrator_part1(r);
-	PROFILING_STOP(PROFILING_CAT_INTEGRATOR)
-
+/**
+ * @brief Checks for root crossings and updates the tree if the gravity or collision module uses it.
+ * @details The particles might get reordered.
+ * @param r REBOUND simulation to operate on
+ */
+static void reb_step_update_tree(struct reb_simulation* const r){
 	// Update and simplify tree. 
 	// Prepare particles for distribution to other nodes. 
 	// This function also creates the tree if called for the first time.
-	if (r->tree_needs_update || r->gravity==REB_GRAVITY_TREE || r->collision==REB_COLLISION_TREE){
+	if (r->tree_needs_update || r->gravity==REB_GRAVITY_TREE || r->gravity==REB_GRAVITY_FMM || r->collision==REB_COLLISION_TREE){
         // Check for root crossings.
         PROFILING_START()
         reb_boundary_check(r);     
@@ -81,8 +84,33 @@ void reb_step(struct reb_simulation* const r){
         // Update tree (this will remove particles which left the box)
 	    PROFILING_START()
 		reb_tree_update(r);          
+		// Sort particles to improve memory locality of the tree.
+		if (r->tree_sort_interval>0 && ++r->tree_sort_steps>=r->tree_sort_interval){
+			r->tree_sort_steps = 0;
+			if (reb_tree_sort_particles(r)==0){
+				r->tree_sort_interval = 0;
+			}
+		}
 	    PROFILING_STOP(PROFILING_CAT_GRAVITY)
 	}
+}
+
+void reb_step(struct reb_simulation* const r){
+	// Integrators with block timesteps keep per-particle data between part1 and part2, so 
+	// the particle order must not change. The tree is then updated at the beginning of the timestep.
+	const int block_timesteps = (r->integrator==REB_INTEGRATOR_LEAPFROG && r->ri_leapfrog.block_levels>1) || r->integrator==REB_INTEGRATOR_HERMITE;
+	if (block_timesteps){
+		reb_step_update_tree(r);
+	}
+
+	// A 'DKD'-like integrator will do the first 'D' part.
+	PROFILING_START()
+	reb_integrator_part1(r);
+	PROFILING_STOP(PROFILING_CAT_INTEGRATOR)
+
+	if (!block_timesteps){
+		reb_step_update_tree(r);
+	}
 
 	PROFILING_START()
 #ifdef MPI
@@ -201,19 +229,111 @@ void reb_free_simulation(struct reb_simulation* const r){
 void reb_free_pointers(struct reb_simulation* const r){
 	reb_tree_delete(r);
 	free(r->gravity_cs 	);
+	free(r->gravity_soa 	);
+	free(r->gravity_omp 	);
+	free(r->gravity_sources 	);
+	free(r->tree_sort_keys 	);
+	free(r->tree_aerr 	);
+	free(r->tree_sort_particles	);
+	free(r->tree_build_index	);
+	free(r->fmm_cells 	);
+	free(r->fmm_coeffs 	);
+	free(r->fmm_particles 	);
+	free(r->gravity_ewald_table	);
+	reb_gravity_pm_free(r);
 	free(r->collisions	);
+	free(r->collisions_fused	);
+	free(r->collision_grid_hash	);
+	free(r->collision_grid_particles	);
+	free(r->collision_grid_xyzr	);
+	free(r->collision_grid_start	);
+	free(r->collision_sweep_xvalues	);
+	for (int t=0;t<r->collision_buffers_N;t++){
+		free(r->collision_buffers[t].collisions);
+	}
+	free(r->collision_buffers	);
+	free(r->collision_batch_last	);
+	free(r->collision_batch	);
+	free(r->collision_batch_order	);
+	free(r->collision_batch_start	);
+	free(r->collision_batch_plog	);
 	reb_integrator_wh_reset(r);
 	reb_integrator_whfast_reset(r);
 	reb_integrator_ias15_reset(r);
+	reb_integrator_leapfrog_reset(r);
+	reb_integrator_hermite_reset(r);
 	free(r->particles	);
+	free(r->removed	);
+	free(r->removed_map	);
 }
 
 void reb_reset_temporary_pointers(struct reb_simulation* const r){
 	// Note: this will not clear the particle array.
+	r->removed			= NULL;
+	r->removed_allocatedN		= 0;
+	r->removed_N			= 0;
+	r->removed_map			= NULL;
+	r->removed_map_N		= 0;
+	r->removed_map_allocatedN	= 0;
 	r->gravity_cs_allocatedN 	= 0;
 	r->gravity_cs 			= NULL;
+	r->gravity_soa_allocatedN 	= 0;
+	r->gravity_soa 			= NULL;
+	r->gravity_omp_allocatedN 	= 0;
+	r->gravity_omp 			= NULL;
+	r->gravity_sources_allocatedN 	= 0;
+	r->gravity_sources 		= NULL;
+	r->tree_pool_slabs		= NULL;
+	r->tree_pool_slabs_N		= 0;
+	r->tree_pool_slabs_allocatedN	= 0;
+	r->tree_pool_used		= 0;
+	r->tree_pool_free		= NULL;
+	r->tree_pool_N			= 0;
+	r->tree_sort_keys		= NULL;
+	r->tree_sort_keys_allocatedN	= 0;
+	r->tree_aerr			= NULL;
+	r->tree_aerr_allocatedN		= 0;
+	r->tree_sort_particles		= NULL;
+	r->tree_sort_particles_allocatedN	= 0;
+	r->tree_build_index		= NULL;
+	r->tree_build_index_allocatedN	= 0;
+	r->fmm_cells_allocatedN 	= 0;
+	r->fmm_cells 			= NULL;
+	r->fmm_coeffs_allocatedN 	= 0;
+	r->fmm_coeffs 			= NULL;
+	r->fmm_particles_allocatedN 	= 0;
+	r->fmm_particles 		= NULL;
+	r->gravity_ewald_table		= NULL;
+	r->pm_grid			= NULL;
+	r->pm_work			= NULL;
+	r->pm_grid_nx			= 0;
+	r->pm_grid_ny			= 0;
+	r->pm_grid_nz			= 0;
+	r->pm_fftw_plan_forward		= NULL;
+	r->pm_fftw_plan_backward	= NULL;
 	r->collisions_allocatedN	= 0;
 	r->collisions			= NULL;
+	r->collisions_fused_allocatedN	= 0;
+	r->collisions_fused		= NULL;
+	r->collisions_fused_N		= -1;
+	r->collision_grid_hash		= NULL;
+	r->collision_grid_particles	= NULL;
+	r->collision_grid_xyzr		= NULL;
+	r->collision_grid_allocatedN	= 0;
+	r->collision_grid_start		= NULL;
+	r->collision_grid_start_allocatedN	= 0;
+	r->collision_sweep_xvalues	= NULL;
+	r->collision_sweep_N		= 0;
+	r->collision_sweep_allocatedN	= 0;
+	r->collision_buffers		= NULL;
+	r->collision_buffers_N		= 0;
+	r->collision_batch_last		= NULL;
+	r->collision_batch_last_allocatedN	= 0;
+	r->collision_batch		= NULL;
+	r->collision_batch_order	= NULL;
+	r->collision_batch_start	= NULL;
+	r->collision_batch_plog		= NULL;
+	r->collision_batch_allocatedN	= 0;
 	// ********** WHFAST
 	r->ri_whfast.allocated_N	= 0;
 	r->ri_whfast.eta		= NULL;
@@ -237,6 +357,24 @@ void reb_reset_temporary_pointers(struct reb_simulation* const r){
 	// ********** WH
 	r->ri_wh.allocatedN 		= 0;
 	r->ri_wh.eta 			= NULL;
+	// ********** LEAPFROG
+	r->ri_leapfrog.allocatedN 	= 0;
+	r->ri_leapfrog.rung 		= NULL;
+	r->ri_leapfrog.active 		= NULL;
+	r->ri_leapfrog.rung_N 		= 0;
+	// ********** HERMITE
+	r->ri_hermite.allocatedN 	= 0;
+	r->ri_hermite.x0 		= NULL;
+	r->ri_hermite.v0 		= NULL;
+	r->ri_hermite.a0 		= NULL;
+	r->ri_hermite.j0 		= NULL;
+	r->ri_hermite.jerk 		= NULL;
+	r->ri_hermite.level 		= NULL;
+	r->ri_hermite.tick 		= NULL;
+	r->ri_hermite.active 		= NULL;
+	r->ri_hermite.N_last 		= 0;
+	r->gravity_active 		= NULL;
+	r->gravity_active_N 		= -1;
 }
 
 void reb_reset_function_pointers(struct reb_simulation* const r){
@@ -296,6 +434,7 @@ void reb_init_simulation(struct reb_simulation* r){
 	r->minimum_collision_velocity = 0;
 	r->collisions_plog 	= 0;
 	r->collisions_Nlog 	= 0;	
+	r->collision_fused 	= 0;
 	
 	// Default modules
 	r->integrator   = REB_INTEGRATOR_IAS15;
@@ -321,6 +460,14 @@ void reb_init_simulation(struct reb_simulation* r){
 	r->ri_ias15.epsilon_global	= 1;
 	r->ri_ias15.iterations_max_exceeded = 0;	
 	
+	// ********** LEAPFROG
+	r->ri_leapfrog.block_levels	= 1;
+	r->ri_leapfrog.block_eta 	= 0.025;
+	
+	// ********** HERMITE
+	r->ri_hermite.eta 		= 0.02;
+	r->ri_hermite.block_levels 	= 1;
+	
 	// ********** SEI
 	r->ri_sei.OMEGA  	= 1;
 	r->ri_sei.OMEGAZ 	= -1;
@@ -333,6 +480,23 @@ void reb_init_simulation(struct reb_simulation* r){
     r->tree_needs_update= 0;
 	r->tree_root		= NULL;
 	r->opening_angle2	= 0.25;
+	r->tree_group_size	= 0;
+	r->tree_multipole_order	= 0;
+	r->tree_multipole_N	= 0;
+	r->tree_opening_tolerance	= 0.;
+	r->gravity_mixed_precision	= 0;
+	r->tree_pool_N_max	= 0;
+	r->tree_sort_interval	= 0;
+	r->tree_sort_steps	= 0;
+	r->tree_rebuild		= 0;
+	r->tree_refit		= 0;
+	r->fmm_order		= 3;
+	r->fmm_opening_angle	= 0.5;
+	r->gravity_ewald	= 0;
+	r->pm_nx		= 32;
+	r->pm_ny		= 32;
+	r->pm_nz		= 32;
+	r->pm_assignment	= 2;
 
 #ifdef MPI
     r->mpi_id = 0;                            
@@ -155,6 +155,43 @@ struct reb_simulation_integrator_hybrid {
         mode;       ///< Flag determining the current integrator used
 };
 
+/**
+ * @brief This structure contains variables and pointer used by the Hermite integrator.
+ */
+struct reb_simulation_integrator_hermite {
+    /**
+     * @brief Accuracy parameter of Aarseth's timestep criterion.
+     * @details The default value is 0.02.
+     **/
+    double eta;
+
+    /**
+     * @brief Number of timestep levels.
+     * @details If set to 1 (default), all particles share one adaptive timestep dt. 
+     * Otherwise, dt is kept fixed and each particle is advanced with its own timestep 
+     * dt/2^k with k<block_levels (block timesteps).
+     **/
+    unsigned int block_levels;
+
+    /**
+     * @cond PRIVATE
+     * Internal data structures below. Nothing to be changed by the user.
+     */
+    int allocatedN;             ///< Size of allocated arrays.
+    double* x0;                 ///< Positions at the beginning of the current step of each particle (3 per particle)
+    double* v0;                 ///< Velocities at the beginning of the current step
+    double* a0;                 ///< Accelerations at the beginning of the current step
+    double* j0;                 ///< Jerks at the beginning of the current step
+    double* jerk;               ///< Jerks calculated together with the accelerations in reb_calculate_acceleration()
+    int* level;                 ///< Timestep level of each particle
+    unsigned int* tick;         ///< Beginning of the current step of each particle in units of dt/2^(block_levels-1)
+    int* active;                ///< Indices of the particles that are corrected on the current substep
+    int N_last;                 ///< Number of particles at the end of the last timestep, 0 if accelerations and jerks need to be calculated
+    /**
+     * @endcond
+     */
+};
+
 /**
  * @brief This structure contains variables and pointer used by the IAS15 integrator.
  */
@@ -219,6 +256,40 @@ struct reb_simulation_integrator_ias15 {
 
 };
 
+/**
+ * @brief This structure contains variables used by the leapfrog integrator.
+ * @details By default, all particles are advanced with the timestep dt. 
+ * With block timesteps, particles with large accelerations are kicked 
+ * more often on power-of-two fractions of dt.
+ */
+struct reb_simulation_integrator_leapfrog {
+    /**
+     * @brief Number of timestep levels.
+     * @details Particles on level k are kicked with the timestep dt/2^k. A particle
+     * gets the smallest level k for which dt/2^k is not larger than sqrt(2*block_eta*softening/|a|).
+     * On each substep, only the accelerations of particles that are kicked are calculated.
+     * Block timesteps are only supported with REB_GRAVITY_TREE.
+     * The default value is 1 (no block timesteps).
+     **/
+    unsigned int block_levels;
+    
+    /**
+     * @brief Accuracy parameter of the timestep criterion.
+     * @details The default value is 0.025.
+     **/
+    double block_eta;
+
+    /**
+     * @cond PRIVATE
+     * Internal data structures below. Nothing to be changed by the user.
+     */
+    int allocatedN;     ///< Size of allocated arrays.
+    int* rung;          ///< Level of each particle during the current timestep.
+    int* active;        ///< Indices of the particles that are kicked on the current substep.
+    int rung_N;         ///< Number of particles at the end of the last timestep. If N differs, all accelerations are recalculated.
+    /** @endcond */
+};
+
 /**
  * @brief This structure contains variables used by the SEI integrator.
  * @details This is where the user sets the orbital frequency OMEGA for 
@@ -324,13 +395,27 @@ struct reb_collision{
     int p1;         ///< One of the colliding particles
     int p2;         ///< One of the colliding particles
     struct reb_ghostbox gb; ///< Ghostbox (of particle p1, used for periodic and shearing sheet boundary conditions)
-#if defined(COLLISIONS_SWEEP) || defined(COLLISIONS_SWEEPPHI)
-    double time;        ///< Time of collision.
-    int crossing;       ///< Collision occurs at the interface of two sweep boxes.
-#endif // COLLISIONS_SWEEP
     int ri;         ///< Index of rootcell (needed for MPI only).
 };
 
+/**
+ * @brief Collisions found by one thread during a parallel collision search.
+ */
+struct reb_collision_buffer{
+    struct reb_collision* collisions;   ///< Collisions found by this thread.
+    int N;                              ///< Number of collisions in the buffer.
+    int allocatedN;                     ///< Size allocated for collisions.
+};
+
+/**
+ * @brief Position of a particle along the sweep axis.
+ * @details Used by the sweep and prune collision search (REB_COLLISION_SWEEP).
+ */
+struct reb_collision_sweep_xvalue{
+    double x;       ///< Position along the sweep axis.
+    int pt;         ///< Index of the particle.
+};
+
 
 /**
  * @brief Struct describing the properties of a set of variational equations.
@@ -376,16 +461,77 @@ struct reb_simulation {
     int     testparticle_type;      ///< Type of the particles with an index>=N_active. 0 means particle does not influence any other particle (default), 1 means particles with index < N_active feel testparticles (similar to MERCURY's small particles). Testparticles never feel each other.
     int     allocatedN;             ///< Current maximum space allocated in the particles array on this node. 
     struct reb_particle* particles; ///< Main particle array. This contains all particles on this node.  
+    int*    removed;                ///< Flags of the particles marked for removal with reb_remove_mark() (internal use).
+    int     removed_allocatedN;     ///< Size allocated for removed.
+    int     removed_N;              ///< Number of particles currently marked for removal.
+    int*    removed_map;            ///< Translation table from particle indices before the last reb_remove_marked() call to indices after it, -1 for removed particles.
+    int     removed_map_N;          ///< Number of entries in removed_map (N before the last reb_remove_marked() call).
+    int     removed_map_allocatedN; ///< Size allocated for removed_map.
     struct reb_vec3d* gravity_cs;   ///< Vector containing the information for compensated gravity summation 
     int     gravity_cs_allocatedN;  ///< Current number of allocated space for cs array
+    double* gravity_soa;            ///< Aligned structure-of-arrays buffer (x, y, z, m, ax, ay, az) used by the vectorized BASIC gravity kernel
+    int     gravity_soa_allocatedN; ///< Current number of allocated space (per component) for the soa buffer
+    double* gravity_omp;            ///< Per-thread partial accelerations used by the symmetric OpenMP gravity routines
+    int     gravity_omp_allocatedN; ///< Current number of allocated space for the gravity_omp buffer
+    double* gravity_sources;        ///< Massive particles (x, y, z, G*m) including all ghostbox shifts, used by the BASIC test particle kernel
+    int     gravity_sources_allocatedN; ///< Current number of allocated space (per component) for the gravity_sources buffer
     struct reb_treecell** tree_root;///< Pointer to the roots of the trees. 
     int     tree_needs_update;      ///< Flag to force a tree update (after boundary check)
     double opening_angle2;          ///< Square of the cell opening angle \f$ \theta \f$. 
+    int     tree_group_size;        ///< If larger than 0, REB_GRAVITY_TREE walks the tree once for each group of at most tree_group_size nearby particles instead of once per particle. The opening criterion is applied to the whole group, which is stricter than for single particles and typically several times faster. Values of 16 to 32 work well. Default: 0 (one walk per particle).
+    int     tree_multipole_order;   ///< Multipole order used by the tree code: 0 (monopole, default), 2 (quadrupole) or 3 (octupole). Higher orders allow a larger opening_angle2 at the same accuracy. With MPI, set it before calling reb_communication_mpi_init().
+    int     tree_multipole_N;       ///< Number of multipole components allocated per tree cell. Set internally.
+    double  tree_opening_tolerance; ///< If larger than 0, REB_GRAVITY_TREE uses a relative opening criterion instead of opening_angle2: a cell is opened if the estimated error of its multipole expansion exceeds tree_opening_tolerance times the particle's acceleration from the previous step, or if the particle lies within the cell's bounding sphere. Particles without a previous acceleration use opening_angle2. Ignored with MPI and Ewald summation. Values around 1e-3 give errors similar to opening_angle2=0.25 at lower cost in clustered systems. Default: 0 (off).
+    double* tree_aerr;              ///< Allowed acceleration error of each particle, used by the relative opening criterion. Set internally.
+    int     tree_aerr_allocatedN;   ///< Current number of allocated space for tree_aerr
+    int     gravity_mixed_precision;///< Set to 1 to calculate the interactions of REB_GRAVITY_TREE in single precision and accumulate them in double precision. Separations are taken relative to a nearby particle, so the relative force error is about 1e-6 per interaction. Only used by the group walk (tree_group_size>0). Default: 0.
+    char**  tree_pool_slabs;        ///< Slabs of memory from which the cells of the tree are allocated
+    int     tree_pool_slabs_N;      ///< Number of slabs in use
+    int     tree_pool_slabs_allocatedN; ///< Current number of allocated space for the tree_pool_slabs array
+    int     tree_pool_used;         ///< Number of cells taken from the last slab in use
+    struct reb_treecell* tree_pool_free;    ///< Released cells available for reuse, linked through oct[0]
+    int     tree_pool_N;            ///< Number of tree cells currently in use
+    int     tree_pool_N_max;        ///< Largest number of tree cells in use at the same time (high-water mark)
+    int     tree_sort_interval;     ///< If larger than 0, the particles are sorted along a Morton curve every tree_sort_interval timesteps, see reb_tree_sort_particles(). Only used with a tree. Default: 0 (off).
+    int     tree_sort_steps;        ///< Number of timesteps since the particles were last sorted. Set internally.
+    struct reb_tree_sort_key* tree_sort_keys;   ///< Sort keys used by reb_tree_sort_particles()
+    int     tree_sort_keys_allocatedN;  ///< Current number of allocated space for tree_sort_keys
+    struct reb_particle* tree_sort_particles;   ///< Temporary particle array used by reb_tree_sort_particles()
+    int     tree_sort_particles_allocatedN; ///< Current number of allocated space for tree_sort_particles
+    int     tree_rebuild;           ///< Set to 1 to rebuild the tree from scratch every timestep instead of updating it. The rebuild runs in parallel if OPENMP is defined and is recommended when running with several threads. Ignored with MPI. Default: 0.
+    int     tree_refit;             ///< Set to 1 to only refit the tree when possible. The structural update of the tree is skipped if no particle has left its cell, and multipole moments are only recalculated for cells whose particles have moved or changed. Useful if tree_rebuild is 0 and many particles do not move every timestep. Default: 0.
+    int*    tree_build_index;       ///< Particle indices used while building the tree
+    int     tree_build_index_allocatedN;    ///< Current number of allocated space for tree_build_index
+    int     fmm_order;              ///< Expansion order used by REB_GRAVITY_FMM (1 to REB_FMM_ORDER_MAX). Default: 3.
+    double  fmm_opening_angle;      ///< Cells A and B interact via expansions if \f$ r_A+r_B < \f$ fmm_opening_angle times their distance. Needs to be smaller than 1. Default: 0.5.
+    struct reb_fmm_cell* fmm_cells; ///< Flattened tree used by REB_GRAVITY_FMM
+    int     fmm_cells_allocatedN;   ///< Current number of allocated space for fmm_cells
+    double* fmm_coeffs;             ///< Multipole and local expansion coefficients of all fmm_cells
+    int     fmm_coeffs_allocatedN;  ///< Current number of allocated space for fmm_coeffs
+    int*    fmm_particles;          ///< Particle indices, sorted by the leaf cells of REB_GRAVITY_FMM
+    int     fmm_particles_allocatedN;   ///< Current number of allocated space for fmm_particles
+    int     gravity_ewald;          ///< Set to 1 to calculate periodic gravity with Ewald summation instead of summing over ghost boxes. Requires REB_BOUNDARY_PERIODIC and REB_GRAVITY_BASIC or REB_GRAVITY_TREE. The ghost boxes are then only used for collisions. The tree is walked once per particle (tree_group_size is ignored). Not supported with MPI. With REB_GRAVITY_TREE, cells are accepted with a single Ewald correction at their centre of mass, also if they straddle the nearest image boundary. This adds an error of order 1e-3 of the largest acceleration for a few particles, decreasing to about 1e-5 for a few thousand particles and a small opening_angle2. Default: 0.
+    double* gravity_ewald_table;    ///< Ewald correction table, see REB_EWALD_N. Calculated when needed.
+    struct reb_vec3d gravity_ewald_table_boxsize;   ///< Box size the Ewald correction table has been calculated for
+    unsigned int gravity_ewald_warning;    ///< Counter of warnings about an unsupported gravity_ewald setting
+    int     pm_nx;                  ///< Number of grid points of REB_GRAVITY_PM in the x direction. Needs to be a power of two unless compiled with FFTW=1. Default: 32.
+    int     pm_ny;                  ///< Number of grid points of REB_GRAVITY_PM in the y direction. Default: 32.
+    int     pm_nz;                  ///< Number of grid points of REB_GRAVITY_PM in the z direction. Set to 1 to treat the particles as a razor thin sheet (two dimensional solver, no vertical acceleration). Default: 32.
+    int     pm_assignment;          ///< Mass assignment and interpolation scheme of REB_GRAVITY_PM: 1 (cloud-in-cell) or 2 (triangular-shaped cloud, default).
+    double* pm_grid;                ///< Complex density and potential grid of REB_GRAVITY_PM
+    double* pm_work;                ///< Complex grid used for the acceleration components by REB_GRAVITY_PM
+    int     pm_grid_nx;             ///< Number of grid points in x direction pm_grid and pm_work have been allocated for
+    int     pm_grid_ny;             ///< Number of grid points in y direction pm_grid and pm_work have been allocated for
+    int     pm_grid_nz;             ///< Number of grid points in z direction pm_grid and pm_work have been allocated for
+    void*   pm_fftw_plan_forward;   ///< FFTW plan for pm_grid (only used with FFTW=1)
+    void*   pm_fftw_plan_backward;  ///< FFTW plan for pm_work (only used with FFTW=1)
     enum REB_STATUS status;         ///< Set to 1 to exit the simulation at the end of the next timestep. 
     int     exact_finish_time;      ///< Set to 1 to finish the integration exactly at tmax. Set to 0 to finish at the next dt. Default is 1. 
 
     unsigned int force_is_velocity_dependent;   ///< Set to 1 if integrator needs to consider velocity dependent forces.  
     unsigned int gravity_ignore_10; ///< Ignore the gravity form the central object (for WH-type integrators)
+    int*    gravity_active;         ///< Indices of the particles whose accelerations are calculated (set by integrators with block timesteps, only used with REB_GRAVITY_TREE).
+    int     gravity_active_N;       ///< Number of indices in gravity_active. If -1, the accelerations of all particles are calculated. Default -1.
     double output_timing_last;      ///< Time when reb_output_timing() was called the last time. 
     double exit_max_distance;       ///< Exit simulation if distance from origin larger than this value 
     double exit_min_distance;       ///< Exit simulation if distance from another particle smaller than this value 
@@ -442,6 +588,29 @@ struct reb_simulation {
     double collisions_plog;             ///< Keep track of momentum exchange (used to calculate collisional viscosity in ring systems. 
     double max_radius[2];               ///< Two largest particle radii, set automatically, needed for collision search. 
     long collisions_Nlog;               ///< Keep track of number of collisions. 
+    int collision_fused;                ///< If 1, overlapping pairs are recorded during the tree gravity walk and checked again at the end of the timestep instead of walking the tree a second time (REB_GRAVITY_TREE and REB_COLLISION_TREE only). The candidate radius is widened by the largest relative motion over a timestep, so the same collisions are found as with the tree search. Default 0.
+    struct reb_collision* collisions_fused;     ///< Collision candidates recorded during the tree gravity walk (internal use).
+    int collisions_fused_N;             ///< Number of collision candidates, -1 if the candidates are not valid. Candidates are kept in collision_buffers until the collision search (internal use).
+    int collisions_fused_allocatedN;    ///< Size allocated for collisions_fused.
+    int* collision_grid_hash;           ///< Hash bucket of each particle (REB_COLLISION_GRID, internal use).
+    int* collision_grid_particles;      ///< Particle indices sorted by hash bucket (REB_COLLISION_GRID, internal use).
+    double* collision_grid_xyzr;        ///< Positions and radii of the particles sorted by hash bucket, four values per particle (REB_COLLISION_GRID, internal use).
+    int collision_grid_allocatedN;      ///< Number of particles allocated for collision_grid_hash, collision_grid_particles and collision_grid_xyzr.
+    int* collision_grid_start;          ///< Index of the first particle of each hash bucket in collision_grid_particles (REB_COLLISION_GRID, internal use).
+    int collision_grid_start_allocatedN;    ///< Size allocated for collision_grid_start.
+    struct reb_collision_sweep_xvalue* collision_sweep_xvalues;  ///< Particles sorted along the sweep axis, kept between timesteps (REB_COLLISION_SWEEP, internal use).
+    int collision_sweep_N;              ///< Number of particles in collision_sweep_xvalues. If it differs from N, the list is rebuilt. Reset to 0 when the particles are reordered.
+    int collision_sweep_allocatedN;     ///< Size allocated for collision_sweep_xvalues.
+    int collision_sweep_axis;           ///< Sweep axis (0: x, 1: y, 2: z), the longest extent of the particle distribution when the list was last rebuilt.
+    struct reb_collision_buffer* collision_buffers; ///< Collisions found by each OpenMP thread during a parallel search, merged afterwards (internal use).
+    int collision_buffers_N;            ///< Number of collision buffers (maximum number of threads).
+    int* collision_batch_last;          ///< Scratch array with one entry per particle used to group collisions into independent batches (OpenMP, hard sphere collisions only, internal use).
+    int collision_batch_last_allocatedN;    ///< Size allocated for collision_batch_last.
+    int* collision_batch;               ///< Batch of each collision (internal use).
+    int* collision_batch_order;         ///< Collisions sorted by batch (internal use).
+    int* collision_batch_start;         ///< Index of the first collision of each batch in collision_batch_order (internal use).
+    double* collision_batch_plog;       ///< Momentum exchange of each collision, added to collisions_plog in the original order (internal use).
+    int collision_batch_allocatedN;     ///< Number of collisions allocated for collision_batch, collision_batch_order, collision_batch_start and collision_batch_plog.
     /** @} */
 
     /**
@@ -469,6 +638,8 @@ struct reb_simulation {
         REB_COLLISION_NONE = 0,     ///< Do not search for collisions (default)
         REB_COLLISION_DIRECT = 1,   ///< Direct collision search O(N^2)
         REB_COLLISION_TREE = 2,     ///< Tree based collision search O(N log(N))
+        REB_COLLISION_GRID = 3,     ///< Collision search with a hashed uniform grid O(N), cell size is the largest sum of two radii. Best for particles of similar size.
+        REB_COLLISION_SWEEP = 4,    ///< Sweep and prune along the longest axis of the particle distribution, O(N) for elongated configurations such as narrow rings.
         } collision;
     /**
      * @brief Available integrators
@@ -481,6 +652,7 @@ struct reb_simulation {
         REB_INTEGRATOR_LEAPFROG = 4,    ///< LEAPFROG integrator, simple, 2nd order, symplectic
         REB_INTEGRATOR_HYBRID = 5,  ///< HYBRID Integrator for close encounters (experimental)
         REB_INTEGRATOR_NONE = 6,    ///< Do not integrate anything
+        REB_INTEGRATOR_HERMITE = 7, ///< Fourth order Hermite integrator with adaptive or block timesteps, for collisional stellar dynamics
         } integrator;
 
     /**
@@ -501,6 +673,8 @@ struct reb_simulation {
         REB_GRAVITY_BASIC = 1,      ///< Basic O(N^2) direct summation algorithm, choose this for shearing sheet and periodic boundary conditions
         REB_GRAVITY_COMPENSATED = 2,    ///< Direct summation algorithm O(N^2) but with compensated summation, slightly slower than BASIC but more accurate
         REB_GRAVITY_TREE = 3,       ///< Use the tree to calculate gravity, O(N log(N)), set opening_angle2 to adjust accuracy.
+        REB_GRAVITY_FMM = 4,        ///< Fast multipole method on top of the tree, O(N), set fmm_order and fmm_opening_angle to adjust accuracy.
+        REB_GRAVITY_PM = 5,         ///< Particle-mesh method using FFTs, O(N), for periodic and shearing sheet boxes. Set pm_nx, pm_ny and pm_nz to adjust the resolution.
         } gravity;
     /** @} */
 
@@ -514,6 +688,8 @@ struct reb_simulation {
     struct reb_simulation_integrator_hybrid ri_hybrid;  ///< The Hybrid struct 
     struct reb_simulation_integrator_whfast ri_whfast;  ///< The WHFast struct 
     struct reb_simulation_integrator_ias15 ri_ias15;    ///< The IAS15 struct 
+    struct reb_simulation_integrator_leapfrog ri_leapfrog;  ///< The leapfrog struct 
+    struct reb_simulation_integrator_hermite ri_hermite;    ///< The Hermite struct 
     /** @} */
 
     /**
@@ -536,7 +712,7 @@ struct reb_simulation {
     /**
      * @brief Return the coefficient of restitution. By default it is NULL, assuming a coefficient of 1.
      * @details The velocity of the collision is given to allow for velocity dependent coefficients
-     * of restitution.
+     * of restitution. If set, hard sphere collisions are resolved one by one, also with OpenMP.
      */
     double (*coefficient_of_restitution) (const struct reb_simulation* const r, double v); 
 
@@ -694,6 +870,30 @@ void reb_remove_all(struct reb_simulation* const r);
  */
 int reb_remove(struct reb_simulation* const r, int index, int keepSorted);
 
+/**
+ * @brief Mark a particle for removal.
+ * @details The particle stays in the particles array, so the indices of all particles
+ * remain valid, until reb_remove_marked() is called. Collisions and the open boundary 
+ * use this to remove many particles in O(N+k) instead of O(N*k).
+ * Do not call reb_remove() while particles are marked.
+ * @param r The rebound simulation to be considered
+ * @param index The index in the particles array of the particle to be removed.
+ * @return Returns 1 if the particle was marked, 0 if index was out of range.
+ */
+int reb_remove_mark(struct reb_simulation* const r, int index);
+
+/**
+ * @brief Remove all particles marked with reb_remove_mark() in a single pass.
+ * @details Afterwards, r->removed_map translates the old indices to the new ones 
+ * (-1 for removed particles). If a tree is used, the particles are only flagged
+ * and removed during the next tree update (the indices do not change).
+ * @param r The rebound simulation to be considered
+ * @param keepSorted Set to 1 to keep the order of the remaining particles. Otherwise
+ * the holes are filled with particles from the end of the array.
+ * @return Returns the number of removed particles.
+ */
+int reb_remove_marked(struct reb_simulation* const r, int keepSorted);
+
 /**
  * @brief Remove a particle by its id.
  * @param r The rebound simulation to be considered
@@ -706,6 +906,31 @@ int reb_remove(struct reb_simulation* const r, int index, int keepSorted);
  */
 int reb_remove_by_id(struct reb_simulation* const r, int id, int keepSorted);
 
+/**
+ * @brief Returns the index of a particle in the particles array by its id.
+ * @details Use this function to find particles after their order has been changed,
+ * for example by reb_tree_sort_particles().
+ * @param r The rebound simulation to be considered
+ * @param id The id of the particle.
+ * @return The index of the first particle with the given id, or -1 if no particle has this id.
+ */
+int reb_get_particle_index_by_id(const struct reb_simulation* const r, int id);
+
+/**
+ * @brief Sorts the particles along a Morton (Z-order) curve.
+ * @details Particles that are close in space end up close in memory, which improves the cache
+ * efficiency of the tree code. Particles are sorted by root box first and then along the 
+ * curve within each root box. Active particles and test particles are sorted separately so 
+ * that N_active remains valid. If a tree exists, it is updated to the new particle indices. 
+ * The indices of particles change, use the particle id to identify particles.
+ * The particles are not sorted if an integrator other than LEAPFROG, SEI or NONE is used 
+ * (these store per-particle state), or if there are variational particles.
+ * This function is called automatically every tree_sort_interval timesteps.
+ * @param r The rebound simulation to be considered
+ * @return Returns 1 if the particles were sorted, 0 otherwise.
+ */
+int reb_tree_sort_particles(struct reb_simulation* const r);
+
 /**
  * @brief Run the heartbeat function and check for escaping/colliding particles.
  * @details You rarely want to call this function yourself. It is used internally to 
@@ -25,6 +25,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
@@ -33,6 +34,9 @@
 #include "boundary.h"
 #include "tree.h"
 #include "communication_mpi.h"
+#ifdef OPENMP
+#include <omp.h>
+#endif // OPENMP
 
 
 /**
@@ -61,9 +65,141 @@ static int reb_reb_tree_get_octant_for_particle_in_cell(const struct reb_particl
   */
 static struct reb_treecell *reb_tree_add_particle_to_cell(struct reb_simulation* const r, struct reb_treecell *node, int pt, struct reb_treecell *parent, int o);
 
+int reb_tree_multipole_components(const int order){
+	switch (order){
+		case 0:
+			return 0;
+		case 2:
+			return 6;
+		case 3:
+			return 6+10;
+		default:
+			reb_exit("tree_multipole_order needs to be 0, 2 or 3.");
+	}
+	return 0;
+}
+
+size_t reb_tree_cell_size(const struct reb_simulation* const r){
+	return sizeof(struct reb_treecell) + r->tree_multipole_N*sizeof(double);
+}
+
+/**
+  * @brief Returns the number of cells in the slab with index i of the cell pool.
+  * @details Slabs grow geometrically from REB_TREE_POOL_SLAB_MIN up to REB_TREE_POOL_SLAB_MAX cells.
+  */
+static int reb_tree_pool_slab_capacity(const int i){
+	int cap = REB_TREE_POOL_SLAB_MIN;
+	for (int k=0;k<i && cap<REB_TREE_POOL_SLAB_MAX;k++){
+		cap *= 2;
+	}
+	return cap;
+}
+
+/**
+  * @brief Adds a cell to the list of released cells of the cell pool without changing tree_pool_N.
+  */
+static void reb_tree_pool_push_free(struct reb_simulation* const r, struct reb_treecell* node){
+	node->oct[0] = r->tree_pool_free;
+	r->tree_pool_free = node;
+}
+
+/**
+  * @brief Takes n contiguous unused cells from the slabs of the cell pool.
+  * @details Cells left over at the end of a slab that are too few for the request 
+  * are moved to the list of released cells. 
+  * The cells are not counted in tree_pool_N and are not initialized.
+  * @param r REBOUND simulation to operate on
+  * @param n Number of cells, at most REB_TREE_POOL_SLAB_MIN.
+  */
+static char* reb_tree_pool_take(struct reb_simulation* const r, const int n){
+	const size_t size = reb_tree_cell_size(r);
+	if (r->tree_pool_slabs_N==0 || r->tree_pool_used+n>reb_tree_pool_slab_capacity(r->tree_pool_slabs_N-1)){
+		if (r->tree_pool_slabs_N>0){
+			const int cap = reb_tree_pool_slab_capacity(r->tree_pool_slabs_N-1);
+			for (;r->tree_pool_used<cap;r->tree_pool_used++){
+				reb_tree_pool_push_free(r, (struct reb_treecell*)(r->tree_pool_slabs[r->tree_pool_slabs_N-1] + size*r->tree_pool_used));
+			}
+		}
+		if (r->tree_pool_slabs_N>=r->tree_pool_slabs_allocatedN){
+			r->tree_pool_slabs_allocatedN += 32;
+			r->tree_pool_slabs = realloc(r->tree_pool_slabs, sizeof(char*)*r->tree_pool_slabs_allocatedN);
+			for (int i=r->tree_pool_slabs_N;i<r->tree_pool_slabs_allocatedN;i++){
+				r->tree_pool_slabs[i] = NULL;
+			}
+		}
+		// Slabs are kept when the pool is reset, reuse them if possible.
+		if (r->tree_pool_slabs[r->tree_pool_slabs_N]==NULL){
+			r->tree_pool_slabs[r->tree_pool_slabs_N] = malloc(size*reb_tree_pool_slab_capacity(r->tree_pool_slabs_N));
+		}
+		r->tree_pool_slabs_N++;
+		r->tree_pool_used = 0;
+	}
+	char* cells = r->tree_pool_slabs[r->tree_pool_slabs_N-1] + size*r->tree_pool_used;
+	r->tree_pool_used += n;
+	return cells;
+}
+
+/**
+  * @brief Returns a zeroed cell from the cell pool of the simulation.
+  * @details Released cells are reused first. Otherwise the next unused cell of the
+  * current slab is returned, so that cells created during a tree build are contiguous
+  * in memory. A new slab is allocated only when all existing slabs are full.
+  * @param r REBOUND simulation to operate on
+  */
+static struct reb_treecell* reb_tree_cell_alloc(struct reb_simulation* const r){
+	const size_t size = reb_tree_cell_size(r);
+	struct reb_treecell* node;
+	if (r->tree_pool_free){
+		node = r->tree_pool_free;
+		r->tree_pool_free = node->oct[0];
+	}else{
+		node = (struct reb_treecell*)reb_tree_pool_take(r, 1);
+	}
+	memset(node, 0, size);
+	node->dirty = 1;
+	r->tree_pool_N++;
+	if (r->tree_pool_N>r->tree_pool_N_max){
+		r->tree_pool_N_max = r->tree_pool_N;
+	}
+	return node;
+}
+
+/**
+  * @brief Returns a cell to the cell pool of the simulation.
+  * @param r REBOUND simulation to operate on
+  * @param node Cell to be released. Its children are not released.
+  */
+static void reb_tree_cell_release(struct reb_simulation* const r, struct reb_treecell* node){
+	reb_tree_pool_push_free(r, node);
+	r->tree_pool_N--;
+}
+
+/**
+  * @brief Releases all cells of the cell pool at once.
+  * @details The slabs are kept for the next tree build unless free_slabs is 1.
+  * Slabs need to be freed whenever the cell size changes.
+  * @param r REBOUND simulation to operate on
+  * @param free_slabs If 1, the memory of the slabs is freed.
+  */
+static void reb_tree_pool_reset(struct reb_simulation* const r, const int free_slabs){
+	if (free_slabs){
+		for (int i=0;i<r->tree_pool_slabs_allocatedN;i++){
+			free(r->tree_pool_slabs[i]);
+		}
+		free(r->tree_pool_slabs);
+		r->tree_pool_slabs = NULL;
+		r->tree_pool_slabs_allocatedN = 0;
+	}
+	r->tree_pool_slabs_N = 0;
+	r->tree_pool_used = 0;
+	r->tree_pool_free = NULL;
+	r->tree_pool_N = 0;
+}
+
 void reb_tree_add_particle_to_tree(struct reb_simulation* const r, int pt){
 	if (r->tree_root==NULL){
 		r->tree_root = calloc(r->root_nx*r->root_ny*r->root_nz,sizeof(struct reb_treecell*));
+		r->tree_multipole_N = reb_tree_multipole_components(r->tree_multipole_order);
 	}
 	struct reb_particle p = r->particles[pt];
 	int rootbox = reb_get_rootbox_for_particle(r, p);
@@ -80,7 +216,7 @@ static struct reb_treecell *reb_tree_add_particle_to_cell(struct reb_simulation*
 	struct reb_particle* const particles = r->particles;
 	// Initialize a new node
 	if (node == NULL) {  
-		node = calloc(1, sizeof(struct reb_treecell));
+		node = reb_tree_cell_alloc(r);
 		struct reb_particle p = particles[pt];
 		if (parent == NULL){ // The new node is a root
 			node->w = r->root_size;
@@ -104,6 +240,7 @@ static struct reb_treecell *reb_tree_add_particle_to_cell(struct reb_simulation*
 		return node;
 	}
 	// In a existing node
+	node->dirty = 1;
 	if (node->pt >= 0) { // It's a leaf node
 		int o = reb_reb_tree_get_octant_for_particle_in_cell(particles[node->pt], node);
 		node->oct[o] = reb_tree_add_particle_to_cell(r, node->oct[o], node->pt, node, o); 
@@ -157,7 +294,11 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
 	// Non-leaf nodes	
 	if (node->pt < 0) {
 		for (int o=0; o<8; o++) {
-			node->oct[o] = reb_tree_update_cell(r, node->oct[o]);
+			struct reb_treecell* const old = node->oct[o];
+			node->oct[o] = reb_tree_update_cell(r, old);
+			if (node->oct[o]!=old){
+				node->dirty = 1;
+			}
 		}
 		node->pt = 0;
 		for (int o=0; o<8; o++) {
@@ -174,12 +315,13 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
 		}
 		// Check if the node requires derefinement.
 		if (node->pt == 0) {	// The node is empty.
-			free(node);
+			reb_tree_cell_release(r, node);
 			return NULL;
 		} else if (node->pt == -1) { // The node becomes a leaf.
 			node->pt = node->oct[test]->pt;
+			node->dirty = 1;
 			r->particles[node->pt].c = node;
-			free(node->oct[test]);
+			reb_tree_cell_release(r, node->oct[test]);
 			node->oct[test]=NULL;
 			return node;
 		}
@@ -195,7 +337,7 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
         if (!isnan(reinsertme.y)){ // Do not reinsert if flagged for removal
 		    reb_add(r, reinsertme);
         }
-		free(node);
+		reb_tree_cell_release(r, node);
 		return NULL; 
 	} else {
 		r->particles[node->pt].c = node;
@@ -204,27 +346,54 @@ static struct reb_treecell *reb_tree_update_cell(struct reb_simulation* const r,
 }
 
 /**
-  * @brief The function calculates the total mass and center of mass of a node. When QUADRUPOLE is defined, it also calculates the mass quadrupole tensor for all non-leaf nodes.
+  * @brief The function calculates the total mass and center of mass of a node. Depending on tree_multipole_order, it also calculates the traceless quadrupole and octupole tensors of mass for all non-leaf nodes.
+  * @details The moments of the children are shifted to the center of mass of the parent. With
+  * q the offset of a child, the quadrupole changes by m(3qq-q^2 I) (Hernquist 1987, ApJS 64, 715).
+  * The octupole changes by the traceless part of 5(q Q + Q q + ...) + 15 m qqq.
+  *
+  * If refit is 1, the moments are only recalculated for cells which are dirty or have a
+  * descendant that is dirty or contains a particle whose mass or position has changed.
+  * @return 1 if the data of the cell has changed, 0 otherwise.
   */
-static void reb_tree_update_gravity_data_in_cell(const struct reb_simulation* const r, struct reb_treecell *node){
-#ifdef QUADRUPOLE
-	node->mxx = 0;
-	node->mxy = 0;
-	node->mxz = 0;
-	node->myy = 0;
-	node->myz = 0;
-	node->mzz = 0;
-#endif // QUADRUPOLE
+static int reb_tree_update_gravity_data_in_cell(const struct reb_simulation* const r, struct reb_treecell *node, const int refit){
+	const int Nmp = r->tree_multipole_N;
+	int changed = node->dirty || !refit;
+	node->dirty = 0;
 	if (node->pt < 0) {
 		// Non-leaf nodes	
+		int changed_oct[8] = {0};
+		if (-node->pt>REB_TREE_TASK_N){
+			// Large cells: children are processed in parallel.
+			for (int o=0; o<8; o++) {
+				struct reb_treecell* d = node->oct[o];
+				if (d!=NULL){
+#pragma omp task firstprivate(d, o) shared(changed_oct)
+					changed_oct[o] = reb_tree_update_gravity_data_in_cell(r, d, refit);
+				}
+			}
+#pragma omp taskwait
+		}else{
+			for (int o=0; o<8; o++) {
+				struct reb_treecell* d = node->oct[o];
+				if (d!=NULL){
+					changed_oct[o] = reb_tree_update_gravity_data_in_cell(r, d, refit);
+				}
+			}
+		}
+		for (int o=0; o<8; o++) {
+			changed |= changed_oct[o];
+		}
+		if (!changed) return 0;
 		node->m  = 0;
 		node->mx = 0;
 		node->my = 0;
 		node->mz = 0;
+		for (int k=0; k<Nmp; k++){
+			node->mp[k] = 0.;
+		}
 		for (int o=0; o<8; o++) {
 			struct reb_treecell* d = node->oct[o];
 			if (d!=NULL){
-				reb_tree_update_gravity_data_in_cell(r, d);
 				// Calculate the total mass and the center of mass
 				double d_m = d->m;
 				node->mx += d->mx*d_m;
@@ -239,42 +408,117 @@ static void reb_tree_update_gravity_data_in_cell(const struct reb_simulation* co
 			node->my /= m_tot;
 			node->mz /= m_tot;
 		}
-#ifdef QUADRUPOLE
+		const double bx = fabs(node->mx-node->x) + 0.5*node->w;
+		const double by = fabs(node->my-node->y) + 0.5*node->w;
+		const double bz = fabs(node->mz-node->z) + 0.5*node->w;
+		node->b = sqrt(bx*bx + by*by + bz*bz);
+		if (Nmp==0) return 1;
+		double* const Q = node->mp;
+		double* const O = node->mp+6;
 		for (int o=0; o<8; o++) {
 			struct reb_treecell* d = node->oct[o];
 			if (d!=NULL){
-				// Ref: Hernquist, L., 1987, APJS
 				double d_m = d->m;
 				double qx  = d->mx - node->mx;
 				double qy  = d->my - node->my;
 				double qz  = d->mz - node->mz;
 				double qr2 = qx*qx + qy*qy + qz*qz;
-				node->mxx += d->mxx + d_m*(3.*qx*qx - qr2);
-				node->mxy += d->mxy + d_m*3.*qx*qy;
-				node->mxz += d->mxz + d_m*3.*qx*qz;
-				node->myy += d->myy + d_m*(3.*qy*qy - qr2);
-				node->myz += d->myz + d_m*3.*qy*qz;
+				const double* const dQ = d->mp; // Zero for leaves
+				Q[0] += d_m*(3.*qx*qx - qr2);
+				Q[1] += d_m*3.*qx*qy;
+				Q[2] += d_m*3.*qx*qz;
+				Q[3] += d_m*(3.*qy*qy - qr2);
+				Q[4] += d_m*3.*qy*qz;
+				for (int k=0; k<5; k++){
+					Q[k] += dQ[k];
+				}
+				if (Nmp<16) continue;
+				// Octupole, trace is removed below.
+				const double q[3] = {qx, qy, qz};
+				const double Qc[3][3] = {{dQ[0], dQ[1], dQ[2]}, {dQ[1], dQ[3], dQ[4]}, {dQ[2], dQ[4], dQ[5]}};
+				int k = 0;
+				for (int i=0; i<3; i++){
+				for (int j=i; j<3; j++){
+				for (int l=j; l<3; l++){
+					O[k] += d->mp[6+k] + 5.*(q[i]*Qc[j][l] + q[j]*Qc[i][l] + q[l]*Qc[i][j]) + 15.*d_m*q[i]*q[j]*q[l];
+					k++;
+				}
+				}
+				}
 			}
 		}
-		node->mzz = -node->mxx -node->myy;
-#endif // QUADRUPOLE
+		Q[5] = -Q[0] -Q[3];
+		if (Nmp<16) return 1;
+		// Remove the trace: O_ijk -= (delta_jk a_i + delta_ik a_j + delta_ij a_k)/5 with a_i = O_ill.
+		const double ax = (O[0] + O[3] + O[5])/5.;	// xxx + xyy + xzz
+		const double ay = (O[1] + O[6] + O[8])/5.;	// xxy + yyy + yzz
+		const double az = (O[2] + O[7] + O[9])/5.;	// xxz + yyz + zzz
+		O[0] -= 3.*ax;	// xxx
+		O[1] -= ay;	// xxy
+		O[2] -= az;	// xxz
+		O[3] -= ax;	// xyy
+		O[5] -= ax;	// xzz
+		O[6] -= 3.*ay;	// yyy
+		O[7] -= az;	// yyz
+		O[8] -= ay;	// yzz
+		O[9] -= 3.*az;	// zzz
+		return 1;
 	}else{ 
 		// Leaf nodes
 		struct reb_particle p = r->particles[node->pt];
+		if (!changed && node->m==p.m && node->mx==p.x && node->my==p.y && node->mz==p.z){
+			return 0;
+		}
 		node->m = p.m;
 		node->mx = p.x;
 		node->my = p.y;
 		node->mz = p.z;
+		node->b  = 0.;
+		for (int k=0; k<Nmp; k++){
+			node->mp[k] = 0.;
+		}
+		return 1;
+	}
+}
+
+/**
+  * @brief Rebuilds the tree if tree_multipole_order has changed since the cells were allocated.
+  * @param r Rebound simulation to operate on
+  */
+static void reb_tree_check_multipole_order(struct reb_simulation* const r){
+	const int Nmp = reb_tree_multipole_components(r->tree_multipole_order);
+	if (Nmp==r->tree_multipole_N){
+		return;
+	}
+	r->tree_multipole_N = Nmp;
+	// The cell size changes, release all cells and their slabs.
+	reb_tree_pool_reset(r, 1);
+	if (r->tree_root==NULL){
+		return;
+	}
+	for(int i=0;i<r->root_n;i++){
+#ifdef MPI
+		if (reb_communication_mpi_rootbox_is_local(r, i)==0) continue;
+#endif // MPI
+		r->tree_root[i] = NULL;
+	}
+	for (int i=0;i<r->N;i++){
+		reb_tree_add_particle_to_tree(r, i);
 	}
 }
 
 void reb_tree_update_gravity_data(struct reb_simulation* const r){
+	reb_tree_check_multipole_order(r);
+	// Root boxes and the top levels of large trees are processed in parallel.
+#pragma omp parallel
+#pragma omp single
 	for(int i=0;i<r->root_n;i++){
 #ifdef MPI
 		if (reb_communication_mpi_rootbox_is_local(r, i)==1){
 #endif // MPI
 			if (r->tree_root[i]!=NULL){
-				reb_tree_update_gravity_data_in_cell(r, r->tree_root[i]);
+#pragma omp task firstprivate(i)
+				reb_tree_update_gravity_data_in_cell(r, r->tree_root[i], r->tree_refit);
 			}
 #ifdef MPI
 		}
@@ -282,9 +526,252 @@ void reb_tree_update_gravity_data(struct reb_simulation* const r){
 	}
 }
 
+#ifndef MPI
+/**
+  * @brief Cells reserved by one thread during reb_tree_build().
+  */
+struct reb_tree_build_chunk {
+	char* cells;	/**< Next unused cell */
+	int N;		/**< Number of unused cells left */
+	int used;	/**< Number of cells handed out by this thread */
+	char pad[64-sizeof(char*)-2*sizeof(int)]; /**< Avoid false sharing between threads */
+};
+
+/**
+  * @brief Returns a zeroed cell for reb_tree_build(). Thread safe.
+  * @details Each thread reserves cells from the pool in blocks of REB_TREE_POOL_SLAB_MIN.
+  */
+static struct reb_treecell* reb_tree_build_cell_alloc(struct reb_simulation* const r, struct reb_tree_build_chunk* const chunks){
+	const size_t size = reb_tree_cell_size(r);
+#ifdef OPENMP
+	struct reb_tree_build_chunk* const c = &chunks[omp_get_thread_num()];
+#else // OPENMP
+	struct reb_tree_build_chunk* const c = &chunks[0];
+#endif // OPENMP
+	if (c->N==0){
+#pragma omp critical (reb_tree_pool)
+		c->cells = reb_tree_pool_take(r, REB_TREE_POOL_SLAB_MIN);
+		c->N = REB_TREE_POOL_SLAB_MIN;
+	}
+	struct reb_treecell* node = (struct reb_treecell*)c->cells;
+	c->cells += size;
+	c->N--;
+	c->used++;
+	memset(node, 0, size);
+	node->dirty = 1;
+	return node;
+}
+
+/**
+  * @brief Returns the coordinate dim (0=x, 1=y, 2=z) of particle i.
+  */
+static inline double reb_tree_build_coordinate(const struct reb_particle* const particles, const int i, const int dim){
+	switch (dim){
+		case 0:
+			return particles[i].x;
+		case 1:
+			return particles[i].y;
+		default:
+			return particles[i].z;
+	}
+}
+
+/**
+  * @brief Moves all indices of particles with coordinate dim >= c to the front.
+  * @return Number of indices moved to the front.
+  */
+static int reb_tree_build_partition(const struct reb_particle* const particles, int* const idx, const int n, const int dim, const double c){
+	int lo = 0;
+	int hi = n-1;
+	while (lo<=hi){
+		if (reb_tree_build_coordinate(particles, idx[lo], dim)>=c){
+			lo++;
+		}else{
+			const int t = idx[lo];
+			idx[lo] = idx[hi];
+			idx[hi] = t;
+			hi--;
+		}
+	}
+	return lo;
+}
+
+/**
+  * @brief Builds the subtree containing the particles idx[0..n-1] in a cell with the given center and width.
+  * @details The particles are partitioned in the same octant order as used by reb_reb_tree_get_octant_for_particle_in_cell(),
+  * so the resulting cells are identical to the ones created by inserting particles one by one.
+  * Subtrees of large cells are built in parallel with OpenMP tasks.
+  */
+static struct reb_treecell* reb_tree_build_cell(struct reb_simulation* const r, struct reb_tree_build_chunk* const chunks, int* const idx, const int n, const double x, const double y, const double z, const double w){
+	struct reb_treecell* node = reb_tree_build_cell_alloc(r, chunks);
+	node->x = x;
+	node->y = y;
+	node->z = z;
+	node->w = w;
+	if (n==1){
+		node->pt = idx[0];
+		r->particles[idx[0]].c = node;
+		return node;
+	}
+	node->pt = -n;
+	// Octant o has bit 0 set for x<node->x, bit 1 for y<node->y and bit 2 for z<node->z.
+	int start[9];
+	start[0] = 0;
+	start[8] = n;
+	start[4] = reb_tree_build_partition(r->particles, idx, n, 2, z);
+	for (int h=0;h<8;h+=4){
+		start[h+2] = start[h] + reb_tree_build_partition(r->particles, idx+start[h], start[h+4]-start[h], 1, y);
+		for (int q=h;q<h+4;q+=2){
+			start[q+1] = start[q] + reb_tree_build_partition(r->particles, idx+start[q], start[q+2]-start[q], 0, x);
+		}
+	}
+	for (int o=0;o<8;o++){
+		const int no = start[o+1]-start[o];
+		if (no==0) continue;
+		const double xo = x + w/4.*((o>>0)%2==0?1.:-1);
+		const double yo = y + w/4.*((o>>1)%2==0?1.:-1);
+		const double zo = z + w/4.*((o>>2)%2==0?1.:-1);
+		if (no>REB_TREE_TASK_N){
+#pragma omp task firstprivate(o, no, xo, yo, zo)
+			node->oct[o] = reb_tree_build_cell(r, chunks, idx+start[o], no, xo, yo, zo, w/2.);
+		}else{
+			node->oct[o] = reb_tree_build_cell(r, chunks, idx+start[o], no, xo, yo, zo, w/2.);
+		}
+	}
+#pragma omp taskwait
+	return node;
+}
+
+void reb_tree_build(struct reb_simulation* const r){
+	const int Nmp = reb_tree_multipole_components(r->tree_multipole_order);
+	if (Nmp!=r->tree_multipole_N){
+		// The cell size changes, release slabs.
+		r->tree_multipole_N = Nmp;
+		reb_tree_pool_reset(r, 1);
+	}
+	if (r->tree_root==NULL){
+		r->tree_root = calloc(r->root_nx*r->root_ny*r->root_nz,sizeof(struct reb_treecell*));
+	}
+	// Remove particles which left the box or are flagged for removal, as reb_tree_update() does.
+	int N = 0;
+	for (int i=0;i<r->N;i++){
+		const struct reb_particle p = r->particles[i];
+		if (isnan(p.y)){
+			continue;
+		}
+		if (reb_boundary_particle_is_in_box(r, p)==0){
+			reb_warning("Did not add particle outside of box boundaries.");
+			continue;
+		}
+		r->particles[N++] = p;
+	}
+	r->N = N;
+	// Sort particle indices by root box.
+	if (r->tree_build_index_allocatedN<N){
+		r->tree_build_index_allocatedN = N;
+		r->tree_build_index = realloc(r->tree_build_index, sizeof(int)*N);
+	}
+	int* const idx = r->tree_build_index;
+	int* const root_start = calloc(r->root_n+1, sizeof(int));
+	for (int i=0;i<N;i++){
+		root_start[reb_get_rootbox_for_particle(r, r->particles[i])+1]++;
+	}
+	for (int i=0;i<r->root_n;i++){
+		root_start[i+1] += root_start[i];
+	}
+	int* const root_next = malloc(sizeof(int)*r->root_n);
+	memcpy(root_next, root_start, sizeof(int)*r->root_n);
+	for (int i=0;i<N;i++){
+		idx[root_next[reb_get_rootbox_for_particle(r, r->particles[i])]++] = i;
+	}
+	free(root_next);
+	// Build all trees
+	reb_tree_pool_reset(r, 0);
+#ifdef OPENMP
+	const int Nthreads = omp_get_max_threads();
+#else // OPENMP
+	const int Nthreads = 1;
+#endif // OPENMP
+	struct reb_tree_build_chunk* const chunks = calloc(Nthreads, sizeof(struct reb_tree_build_chunk));
+#pragma omp parallel
+#pragma omp single
+	for (int i=0;i<r->root_n;i++){
+		r->tree_root[i] = NULL;
+		const int n = root_start[i+1]-root_start[i];
+		if (n==0) continue;
+		const int ri = i%r->root_nx;
+		const int rj = (i/r->root_nx)%r->root_ny;
+		const int rk = i/(r->root_nx*r->root_ny);
+		const double x = -r->boxsize.x/2.+r->root_size*(0.5+(double)ri);
+		const double y = -r->boxsize.y/2.+r->root_size*(0.5+(double)rj);
+		const double z = -r->boxsize.z/2.+r->root_size*(0.5+(double)rk);
+#pragma omp task firstprivate(i, n, x, y, z)
+		r->tree_root[i] = reb_tree_build_cell(r, chunks, idx+root_start[i], n, x, y, z, r->root_size);
+	}
+	free(root_start);
+	// Return cells that were reserved but not used.
+	const size_t size = reb_tree_cell_size(r);
+	for (int t=0;t<Nthreads;t++){
+		for (int k=0;k<chunks[t].N;k++){
+			reb_tree_pool_push_free(r, (struct reb_treecell*)(chunks[t].cells+size*k));
+		}
+		r->tree_pool_N += chunks[t].used;
+	}
+	free(chunks);
+	if (r->tree_pool_N>r->tree_pool_N_max){
+		r->tree_pool_N_max = r->tree_pool_N;
+	}
+	r->tree_needs_update = 0;
+}
+#endif // MPI
+
+/**
+  * @brief Checks whether the structure of the tree needs to be updated.
+  * @details This is the case if a particle is not in the tree, has left its leaf cell or is flagged for removal.
+  * The particles are checked in the order of the particle array, which is much cheaper than walking the tree.
+  * @param r Rebound simulation to operate on
+  * @return 1 if reb_tree_update_cell() needs to be called, 0 otherwise.
+  */
+static int reb_tree_needs_structural_update(struct reb_simulation* const r){
+	int N_tree = 0;
+	for(int i=0;i<r->root_n;i++){
+#ifdef MPI
+		if (reb_communication_mpi_rootbox_is_local(r, i)==0) continue;
+#endif // MPI
+		const struct reb_treecell* const node = r->tree_root[i];
+		if (node!=NULL){
+			N_tree += node->pt<0?-node->pt:1;
+		}
+	}
+	if (N_tree!=r->N){
+		return 1;
+	}
+	// All particles are in the tree, so their cell pointers are valid.
+	for (int i=0;i<r->N;i++){
+		struct reb_treecell* const c = r->particles[i].c;
+		if (c==NULL || c->pt!=i || reb_tree_particle_is_inside_cell(r, c)==0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
 void reb_tree_update(struct reb_simulation* const r){
+	// Particles might be reordered, collision candidates from the gravity walk are no longer valid.
+	r->collisions_fused_N = -1;
+#ifndef MPI
+	if (r->tree_rebuild){
+		reb_tree_build(r);
+		return;
+	}
+#endif // MPI
+	if (r->tree_refit && r->tree_root!=NULL && reb_tree_needs_structural_update(r)==0){
+		r->tree_needs_update= 0;
+		return;
+	}
 	if (r->tree_root==NULL){
 		r->tree_root = calloc(r->root_nx*r->root_ny*r->root_nz,sizeof(struct reb_treecell*));
+		r->tree_multipole_N = reb_tree_multipole_components(r->tree_multipole_order);
 	}
 	for(int i=0;i<r->root_n;i++){
 
@@ -297,23 +784,129 @@ void reb_tree_update(struct reb_simulation* const r){
 #endif // MPI
 	}
     r->tree_needs_update= 0;
+	reb_tree_check_multipole_order(r);
+}
+void reb_tree_delete(struct reb_simulation* const r){
+	// All local cells live in the cell pool. Essential cells received from 
+	// other nodes are stored in tree_essential_recv and are not freed here.
+	reb_tree_pool_reset(r, 1);
+	free(r->tree_root);
+	r->tree_root = NULL;
 }
-static void reb_tree_delete_cell(struct reb_treecell* node){
+
+/**
+  * @brief Spreads the lowest 21 bits of v so that there are two zero bits between each of them.
+  */
+static uint64_t reb_tree_morton_spread(uint64_t v){
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+	v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2)  & 0x1249249249249249ULL;
+	return v;
+}
+
+/**
+  * @brief Quantizes a coordinate within a root box to 21 bits.
+  * @details The result is inverted so that the Morton order matches the order
+  * in which reb_reb_tree_get_octant_for_particle_in_cell() numbers the octants.
+  * @param x Coordinate relative to the lower edge of the root box, in units of the root box size.
+  */
+static uint64_t reb_tree_morton_quantize(double x){
+	const double max = (double)0x1fffff;
+	double q = floor(x*(max+1.));
+	if (q<0.) q = 0.;
+	if (q>max) q = max;
+	return 0x1fffff - (uint64_t)q;
+}
+
+/**
+  * @brief Sets the cell pointer of all particles in the leaves below node.
+  */
+static void reb_tree_set_particle_cells(struct reb_simulation* const r, struct reb_treecell* node){
 	if (node==NULL){
 		return;
 	}
-	for (int o=0; o<8; o++) {
-		reb_tree_delete_cell(node->oct[o]);
+	if (node->pt>=0){
+		r->particles[node->pt].c = node;
+		return;
+	}
+	for (int o=0;o<8;o++){
+		reb_tree_set_particle_cells(r, node->oct[o]);
 	}
 }
 
-void reb_tree_delete(struct reb_simulation* const r){
+static int reb_tree_compare_sort_keys(const void* a, const void* b){
+	const struct reb_tree_sort_key* ka = a;
+	const struct reb_tree_sort_key* kb = b;
+	if (ka->rootbox != kb->rootbox) return ka->rootbox < kb->rootbox ? -1 : 1;
+	if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+	return ka->index - kb->index;
+}
+
+int reb_tree_sort_particles(struct reb_simulation* const r){
+	if (r->N_var){
+		reb_warning("Particles cannot be sorted when variational particles are present.");
+		return 0;
+	}
+	if (r->integrator!=REB_INTEGRATOR_LEAPFROG && r->integrator!=REB_INTEGRATOR_SEI && r->integrator!=REB_INTEGRATOR_NONE){
+		reb_warning("Particles can only be sorted with the LEAPFROG, SEI or NONE integrators.");
+		return 0;
+	}
+	const int N = r->N;
+	const int N_active = (r->N_active==-1 || r->N_active>N)?N:r->N_active;
+	if (r->tree_sort_keys_allocatedN<N){
+		r->tree_sort_keys_allocatedN = N;
+		r->tree_sort_keys = realloc(r->tree_sort_keys, sizeof(struct reb_tree_sort_key)*N);
+	}
+	if (r->tree_sort_particles_allocatedN<N){
+		r->tree_sort_particles_allocatedN = N;
+		r->tree_sort_particles = realloc(r->tree_sort_particles, sizeof(struct reb_particle)*N);
+	}
+	struct reb_tree_sort_key* const keys = r->tree_sort_keys;
+	struct reb_particle* const particles = r->particles;
+	// Make sure the cell pointers of all particles are valid, they are used to update the tree below.
+	for (int i=0;i<N;i++){
+		particles[i].c = NULL;
+	}
 	if (r->tree_root!=NULL){
-		for(int i=0;i<r->root_n;i++){
-			reb_tree_delete_cell(r->tree_root[i]);
+		for (int i=0;i<r->root_n;i++){
+#ifdef MPI
+			if (reb_communication_mpi_rootbox_is_local(r, i)==0) continue;
+#endif // MPI
+			reb_tree_set_particle_cells(r, r->tree_root[i]);
 		}
-		free(r->tree_root);
 	}
+	for (int i=0;i<N;i++){
+		const struct reb_particle p = particles[i];
+		// Position relative to the lower corner of the simulation box in units of the root box size
+		const double x = (p.x + r->boxsize.x/2.)/r->root_size;
+		const double y = (p.y + r->boxsize.y/2.)/r->root_size;
+		const double z = (p.z + r->boxsize.z/2.)/r->root_size;
+		keys[i].rootbox = reb_get_rootbox_for_particle(r, p);
+		keys[i].key = reb_tree_morton_spread(reb_tree_morton_quantize(x-floor(x)))
+			| reb_tree_morton_spread(reb_tree_morton_quantize(y-floor(y)))<<1
+			| reb_tree_morton_spread(reb_tree_morton_quantize(z-floor(z)))<<2;
+		keys[i].index = i;
+	}
+	// Sort active and test particles separately
+	qsort(keys, N_active, sizeof(struct reb_tree_sort_key), reb_tree_compare_sort_keys);
+	qsort(keys+N_active, N-N_active, sizeof(struct reb_tree_sort_key), reb_tree_compare_sort_keys);
+	struct reb_particle* const sorted = r->tree_sort_particles;
+	for (int i=0;i<N;i++){
+		sorted[i] = particles[keys[i].index];
+	}
+	memcpy(particles, sorted, sizeof(struct reb_particle)*N);
+	// The sweep list refers to the old order.
+	r->collision_sweep_N = 0;
+	// Leaf cells point to particles by index
+	for (int i=0;i<N;i++){
+		if (particles[i].c!=NULL){
+			particles[i].c->pt = i;
+		}
+	}
+	return 1;
 }
 
 
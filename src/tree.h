@@ -25,9 +25,39 @@
 
 #ifndef _TREE_H
 #define _TREE_H
+#include <stddef.h>
+#include <stdint.h>
 
 struct reb_treecell; 
 
+/**
+ * @brief Number of cells in the first slab of the cell pool. Later slabs double in size.
+ */
+#define REB_TREE_POOL_SLAB_MIN 64
+/**
+ * @brief Maximum number of cells in one slab of the cell pool.
+ */
+#define REB_TREE_POOL_SLAB_MAX 65536
+/**
+ * @brief Cells containing more particles than this are processed by OpenMP tasks when building the tree and calculating the multipole moments.
+ */
+#define REB_TREE_TASK_N 4096
+/**
+ * @brief Maximum number of images of a particle handled by one tree walk over all ghost boxes.
+ * @details Covers one layer of ghost boxes in three dimensions and two layers in the shearing sheet.
+ * The image lists are kept on the stack. With more ghost boxes, the tree is walked once per chunk of images.
+ */
+#define REB_TREE_IMAGES_MAX 27
+
+/**
+ * @brief Sort key of one particle, used by reb_tree_sort_particles().
+ */
+struct reb_tree_sort_key {
+	uint64_t key;	/**< Morton key of the particle within its root box */
+	int rootbox;	/**< Index of the root box of the particle */
+	int index;	/**< Index of the particle before sorting */
+};
+
 /**
  * @brief The data structure of one node of a tree 
  */
@@ -40,20 +70,31 @@ struct reb_treecell {
 	double mx; /**< The x position of the center of mass of a cell */
 	double my; /**< The y position of the center of mass of a cell */
 	double mz; /**< The z position of the center of mass of a cell */
-#ifdef QUADRUPOLE
-	double mxx; /**< The xx component of the quadrupole tensor of mass of a cell */
-	double mxy; /**< The xy component of the quadrupole tensor of mass of a cell */
-	double mxz; /**< The xz component of the quadrupole tensor of mass of a cell */
-	double myy; /**< The yy component of the quadrupole tensor of mass of a cell */
-	double myz; /**< The yz component of the quadrupole tensor of mass of a cell */
-	double mzz; /**< The zz component of the quadrupole tensor of mass of a cell */
-#endif // QUADRUPOLE
 	struct reb_treecell *oct[8]; /**< The pointer array to the octants of a cell */
 	int pt;		/**< It has double usages: in a leaf node, it stores the index 
 			  * of a particle; in a non-leaf node, it equals to (-1)*Total 
 			  * Number of particles within that cell. */ 
+	int dirty;	/**< Set to 1 if the children of the cell have changed since its multipole moments were last calculated. */
+	double b;	/**< Radius of the sphere around the center of mass which contains the whole cell. Zero for leaves. */
+	double mp[];	/**< Traceless multipole moments of mass, r->tree_multipole_N components. 
+			  * For tree_multipole_order>=2 the first six are the quadrupole tensor (xx, xy, xz, yy, yz, zz).
+			  * For tree_multipole_order==3 they are followed by the ten components of the octupole tensor
+			  * (xxx, xxy, xxz, xyy, xyz, xzz, yyy, yyz, yzz, zzz). */
 };
 
+/**
+  * @brief Returns the number of multipole components stored per cell for a given multipole order.
+  * @details Exits if the order is not 0, 2 or 3.
+  * @param order Multipole order
+  */
+int reb_tree_multipole_components(const int order);
+
+/**
+  * @brief Returns the size in bytes of one cell of the tree, including the multipole moments.
+  * @param r Rebound simulation to operate on
+  */
+size_t reb_tree_cell_size(const struct reb_simulation* const r);
+
 /**
   * @brief This function updates the tree.
   * @details The tree needs to be updated when particles move, this function does that.
@@ -61,6 +102,19 @@ struct reb_treecell {
   */
 void reb_tree_update(struct reb_simulation* const r);
 
+#ifndef MPI
+/**
+  * @brief Builds the tree from scratch.
+  * @details Replaces reb_tree_update() if tree_rebuild is set. Particles which have left the box or 
+  * are flagged for removal are removed first. The particles are then partitioned into the
+  * octants of each cell, which gives the same cells as inserting them one by one with 
+  * reb_tree_add_particle_to_tree(). Root boxes and large cells are built in parallel
+  * if OPENMP is defined. The order of the particles is not changed. Not available with MPI.
+  * @param r Rebound simulation to operate on
+  */
+void reb_tree_build(struct reb_simulation* const r);
+#endif // MPI
+
 /**
   * @brief The wrap function calls reb_tree_update_gravity_data_in_cell() for each tree.
   * @param r Rebound simulation to operate on
@@ -75,7 +129,7 @@ void reb_tree_update_gravity_data(struct reb_simulation* const r);
 void reb_tree_add_particle_to_tree(struct reb_simulation* const r, int pt);
 
 /**
- * @brief Free up all space occupied by the tree structure.
+ * @brief Free up all space occupied by the tree structure, including the cell pool.
  * This will not modify particles.
   * @param r Rebound simulation to operate on
  */